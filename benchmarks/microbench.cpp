@@ -0,0 +1,510 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+/*
+ * Microbenchmarks of the hot paths of a Dht node.
+ *
+ * Messages are built like a remote node would send them, and handed to
+ * Dht::periodic of a node whose clock is virtual and whose transport
+ * discards what it sends: each benchmark measures the whole processing
+ * of a message, replies included. Every group runs against
+ * increasingly large routing tables or storages.
+ *
+ * Usage: microbench [iterations]
+ */
+
+#include <opendht.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+using namespace dht;
+
+// Count allocations made by the whole process, the library included.
+static std::atomic<size_t> allocations {0};
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+/**
+ * Run op(i) for i in [0, n) and print the mean time and
+ * allocation count of an operation.
+ */
+template <typename Op>
+static void
+bench(const std::string& name, size_t n, Op&& op)
+{
+    using namespace std::chrono;
+    auto allocs = allocations.load();
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < n; i++)
+        op(i);
+    auto ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    allocs = allocations.load() - allocs;
+    std::printf("%-44s %12.1f ns/op %10.2f allocs/op\n", name.c_str(), (double)ns / n, (double)allocs / n);
+}
+
+/** Transport sending nowhere, keeping the sent packets when asked to. */
+class CaptureTransport : public Transport {
+public:
+    int send(const uint8_t* buf, size_t len, int, const sockaddr*, socklen_t) {
+        if (capture)
+            packets.emplace_back(buf, buf + len);
+        return len;
+    }
+    bool supports(sa_family_t af) const {
+        return af == 0 or af == AF_INET;
+    }
+
+    bool capture {false};
+    std::vector<Blob> packets {};
+};
+
+static std::mt19937_64 rd {42};
+
+static InfoHash
+randomId()
+{
+    InfoHash h;
+    std::uniform_int_distribution<unsigned> dist(0, 255);
+    for (auto& b : h)
+        b = dist(rd);
+    return h;
+}
+
+static sockaddr_in
+randomAddr()
+{
+    sockaddr_in sin;
+    std::fill_n((uint8_t*)&sin, sizeof(sin), 0);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl((10 << 24) | std::uniform_int_distribution<uint32_t>(1, 0xfffffe)(rd));
+    sin.sin_port = htons(4222);
+    return sin;
+}
+
+static Value
+randomValue(size_t size = 64)
+{
+    Blob data(size);
+    std::uniform_int_distribution<unsigned> dist(0, 255);
+    for (auto& b : data)
+        b = dist(rd);
+    Value v {ValueType::USER_DATA.id, std::move(data)};
+    v.id = std::uniform_int_distribution<Value::Id>{1}(rd);
+    return v;
+}
+
+using Packer = msgpack::packer<msgpack::sbuffer>;
+
+static const std::array<char, 4> QUERY_TID {{'b', 'n', 0, 0}};
+
+static void
+packTid(Packer& pk, const std::array<char, 4>& tid)
+{
+    pk.pack(std::string("t")); pk.pack_bin(tid.size());
+                               pk.pack_bin_body(tid.data(), tid.size());
+}
+
+/** Build a query, the arguments (args, of nargs entries) following the node id */
+template <typename Args>
+static Blob
+makeQuery(const InfoHash& from, const std::string& q, unsigned nargs, Args&& args)
+{
+    msgpack::sbuffer buffer;
+    Packer pk(&buffer);
+    pk.pack_map(5);
+    pk.pack(std::string("a")); pk.pack_map(1 + nargs);
+      pk.pack(std::string("id")); pk.pack(from);
+      args(pk);
+    pk.pack(std::string("q")); pk.pack(q);
+    packTid(pk, QUERY_TID);
+    pk.pack(std::string("y")); pk.pack(std::string("q"));
+    pk.pack(std::string("v")); pk.pack(std::string("RNG1"));
+    return {buffer.data(), buffer.data() + buffer.size()};
+}
+
+static void
+packToken(Packer& pk, const Blob& token)
+{
+    pk.pack(std::string("token")); pk.pack_bin(token.size());
+                                   pk.pack_bin_body((const char*)token.data(), token.size());
+}
+
+static Blob
+makePing(const InfoHash& from)
+{
+    return makeQuery(from, "ping", 0, [](Packer&) {});
+}
+
+static Blob
+makeFind(const InfoHash& from, const InfoHash& target)
+{
+    return makeQuery(from, "find", 1, [&](Packer& pk) {
+        pk.pack(std::string("target")); pk.pack(target);
+    });
+}
+
+static Blob
+makeGet(const InfoHash& from, const InfoHash& key)
+{
+    return makeQuery(from, "get", 1, [&](Packer& pk) {
+        pk.pack(std::string("h")); pk.pack(key);
+    });
+}
+
+static Blob
+makePut(const InfoHash& from, const InfoHash& key, const Value& value, const Blob& token)
+{
+    return makeQuery(from, "put", 3, [&](Packer& pk) {
+        pk.pack(std::string("h")); pk.pack(key);
+        pk.pack(std::string("values")); pk.pack_array(1); pk.pack(value);
+        packToken(pk, token);
+    });
+}
+
+static Blob
+makeListen(const InfoHash& from, const InfoHash& key, const Blob& token)
+{
+    return makeQuery(from, "listen", 2, [&](Packer& pk) {
+        pk.pack(std::string("h")); pk.pack(key);
+        packToken(pk, token);
+    });
+}
+
+/** Reply to a 'get' request (tid) with count random IPv4 nodes */
+static Blob
+makeNodesReply(const InfoHash& from, const std::array<char, 4>& tid, unsigned count)
+{
+    Blob nodes;
+    for (unsigned i = 0; i < count; i++) {
+        auto id = randomId();
+        auto sin = randomAddr();
+        nodes.insert(nodes.end(), id.begin(), id.end());
+        nodes.insert(nodes.end(), (uint8_t*)&sin.sin_addr, (uint8_t*)&sin.sin_addr + 4);
+        nodes.insert(nodes.end(), (uint8_t*)&sin.sin_port, (uint8_t*)&sin.sin_port + 2);
+    }
+    msgpack::sbuffer buffer;
+    Packer pk(&buffer);
+    pk.pack_map(4);
+    pk.pack(std::string("r")); pk.pack_map(2);
+      pk.pack(std::string("id")); pk.pack(from);
+      pk.pack(std::string("n4")); pk.pack_bin(nodes.size());
+                                  pk.pack_bin_body((const char*)nodes.data(), nodes.size());
+    packTid(pk, tid);
+    pk.pack(std::string("y")); pk.pack(std::string("r"));
+    pk.pack(std::string("v")); pk.pack(std::string("RNG1"));
+    return {buffer.data(), buffer.data() + buffer.size()};
+}
+
+static const msgpack::object*
+findEntry(const msgpack::object& map, const std::string& key)
+{
+    if (map.type != msgpack::type::MAP)
+        return nullptr;
+    for (unsigned i = 0; i < map.via.map.size; i++) {
+        auto& o = map.via.map.ptr[i];
+        if (o.key.type == msgpack::type::STR and o.key.as<std::string>() == key)
+            return &o.val;
+    }
+    return nullptr;
+}
+
+/** Find the field of the arguments or results of a message */
+static const msgpack::object*
+findField(const msgpack::object& msg, const std::string& field)
+{
+    for (const auto& section : {"a", "r"})
+        if (auto s = findEntry(msg, section))
+            if (auto f = findEntry(*s, field))
+                return f;
+    return nullptr;
+}
+
+/**
+ * A Dht node whose clock advances by a millisecond for every message,
+ * so that the request rate limit is never reached.
+ */
+struct BenchNode {
+    BenchNode(size_t max_store_size = 0) {
+        auto t = std::unique_ptr<CaptureTransport>(new CaptureTransport);
+        transport = t.get();
+        dht.reset(new Dht(std::move(t), {randomId(), false, max_store_size, max_store_size, {},
+            [this]{ return now; }, (uint32_t)rd(), false}));
+        // Don't slice maintenance on the real clock, so that runs are comparable.
+        dht->setMaintenanceBudget(duration::zero());
+    }
+
+    void receive(const Blob& msg, const sockaddr_in& from) {
+        now += std::chrono::milliseconds(1);
+        dht->periodic(msg.data(), msg.size(), (const sockaddr*)&from, sizeof(from));
+    }
+
+    /** Insert known random nodes, as if they were heard of */
+    void populate(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            auto sin = randomAddr();
+            dht->insertNode(randomId(), (const sockaddr*)&sin, sizeof(sin));
+        }
+    }
+
+    unsigned tableSize() const {
+        unsigned good = 0, dubious = 0, cached = 0, incoming = 0;
+        dht->getNodesStats(AF_INET, &good, &dubious, &cached, &incoming);
+        return good + dubious;
+    }
+
+    /** Messages sent while handling msg */
+    std::vector<Blob> exchange(const Blob& msg, const sockaddr_in& from) {
+        transport->capture = true;
+        receive(msg, from);
+        transport->capture = false;
+        return std::move(transport->packets);
+    }
+
+    /** Get a token allowing the client to put and listen */
+    Blob getToken(const InfoHash& client, const sockaddr_in& from) {
+        for (const auto& p : exchange(makeGet(client, randomId()), from)) {
+            auto msg = unpackMsg(p);
+            if (auto token = findField(msg.get(), "token")) {
+                auto o = *token;
+                return unpackBlob(o);
+            }
+        }
+        throw DhtException("No token received");
+    }
+
+    time_point now {clock::now()};
+    CaptureTransport* transport;
+    std::unique_ptr<Dht> dht;
+};
+
+static std::string
+label(const std::string& name, const std::string& size)
+{
+    return name + " [" + size + "]";
+}
+
+static void
+benchEncoding(size_t n)
+{
+    std::vector<Blob> data;
+    for (size_t i = 0; i < 1024; i++)
+        data.emplace_back(packMsg(randomValue()));
+    bench("InfoHash::get (64 bytes)", n, [&](size_t i) {
+        auto h = InfoHash::get(data[i % data.size()]);
+        (void)h;
+    });
+
+    std::vector<InfoHash> ids(1024);
+    for (auto& id : ids)
+        id = randomId();
+    auto target = randomId();
+    int sink = 0;
+    bench("InfoHash::xorCmp", n, [&](size_t i) {
+        sink += target.xorCmp(ids[i % ids.size()], ids[(i + 1) % ids.size()]);
+    });
+    if (sink == 42)
+        std::printf("\n");
+
+    auto value = randomValue();
+    bench("Value pack (64 bytes)", n, [&](size_t) {
+        auto p = packMsg(value);
+        (void)p;
+    });
+    bench("Value unpack (64 bytes)", n, [&](size_t i) {
+        auto msg = unpackMsg(data[i % data.size()]);
+        Value v {msg.get()};
+    });
+}
+
+static void
+benchSignatures(size_t n)
+{
+    auto key = crypto::PrivateKey::generate();
+    auto value = randomValue();
+    value.owner = key.getPublicKey();
+    bench("Value sign (RSA 4096)", std::max<size_t>(n / 1000, 10), [&](size_t) {
+        value.invalidate();
+        value.signature = key.sign(value.getToSign());
+    });
+
+    // Received values are checked by SecureDht as they are unpacked.
+    auto packed = packMsg(value);
+    bench("SecureDht signature check (RSA 4096)", std::max<size_t>(n / 100, 10), [&](size_t) {
+        auto msg = unpackMsg(packed);
+        Value v {msg.get()};
+        if (not v.owner.checkSignature(v.getToSign(), v.signature))
+            throw DhtException("Bad signature");
+    });
+}
+
+static void
+benchRouting(size_t n, size_t known)
+{
+    BenchNode node;
+    node.populate(known);
+    auto size = std::to_string(known) + " known, " + std::to_string(node.tableSize()) + " in table";
+
+    std::vector<std::pair<InfoHash, sockaddr_in>> nodes(1024);
+    for (auto& np : nodes)
+        np = {randomId(), randomAddr()};
+    bench(label("insertNode (findBucket)", size), n, [&](size_t i) {
+        const auto& np = nodes[i % nodes.size()];
+        node.dht->insertNode(np.first, (const sockaddr*)&np.second, sizeof(np.second));
+    });
+
+    auto client = randomId();
+    auto from = randomAddr();
+    auto ping = makePing(client);
+    bench(label("processMessage ping", size), n, [&](size_t) {
+        node.receive(ping, from);
+    });
+
+    std::vector<Blob> finds;
+    for (size_t i = 0; i < 1024; i++)
+        finds.emplace_back(makeFind(client, randomId()));
+    bench(label("processMessage find (sendClosestNodes)", size), n, [&](size_t i) {
+        node.receive(finds[i % finds.size()], from);
+    });
+
+    std::vector<Blob> gets;
+    for (size_t i = 0; i < 1024; i++)
+        gets.emplace_back(makeGet(client, randomId()));
+    bench(label("processMessage get (makeToken)", size), n, [&](size_t i) {
+        node.receive(gets[i % gets.size()], from);
+    });
+}
+
+static void
+benchStorage(size_t n, size_t keys)
+{
+    BenchNode node(size_t(1) << 30);
+    node.populate(4096);
+    auto client = randomId();
+    auto from = randomAddr();
+    auto token = node.getToken(client, from);
+
+    std::vector<InfoHash> stored(keys);
+    for (auto& k : stored) {
+        k = randomId();
+        node.receive(makePut(client, k, randomValue(), token), from);
+    }
+    auto size = std::to_string(node.dht->getStorageStats().values) + " values";
+
+    std::vector<Blob> puts;
+    for (size_t i = 0; i < n; i++)
+        puts.emplace_back(makePut(client, stored[i % keys], randomValue(), token));
+    bench(label("processMessage put (storageStore)", size), n, [&](size_t i) {
+        node.receive(puts[i], from);
+    });
+
+    std::vector<Blob> gets;
+    for (size_t i = 0; i < 1024; i++)
+        gets.emplace_back(makeGet(client, stored[i % keys]));
+    bench(label("processMessage get (values)", size), n, [&](size_t i) {
+        node.receive(gets[i % gets.size()], from);
+    });
+
+    std::vector<Blob> listens;
+    for (size_t i = 0; i < 1024; i++)
+        listens.emplace_back(makeListen(client, stored[i % keys], token));
+    bench(label("processMessage listen", size), n, [&](size_t i) {
+        node.receive(listens[i % listens.size()], from);
+    });
+}
+
+static void
+benchSearch(size_t n, size_t known)
+{
+    BenchNode node;
+    node.populate(known);
+    auto size = std::to_string(node.tableSize()) + " in table";
+
+    // Start a search and find the transaction id of its requests.
+    node.dht->get(randomId(), [](const std::vector<std::shared_ptr<Value>>&) { return true; });
+    std::array<char, 4> tid;
+    bool found = false;
+    for (const auto& p : node.exchange(makePing(randomId()), randomAddr())) {
+        auto msg = unpackMsg(p);
+        auto q = findEntry(msg.get(), "q");
+        if (q and q->as<std::string>() == "get") {
+            tid = findEntry(msg.get(), "t")->as<std::array<char, 4>>();
+            found = true;
+            break;
+        }
+    }
+    if (not found)
+        throw DhtException("No search request sent");
+
+    std::vector<std::pair<Blob, sockaddr_in>> replies;
+    for (size_t i = 0; i < n; i++)
+        replies.emplace_back(makeNodesReply(randomId(), tid, 8), randomAddr());
+    bench(label("processMessage get reply (Search::insertNode)", size), n, [&](size_t i) {
+        node.receive(replies[i].first, replies[i].second);
+    });
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+    if (n == 0) {
+        std::fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+    try {
+        benchEncoding(n * 10);
+        benchSignatures(n);
+        for (size_t known : {1024, 16384, 131072})
+            benchRouting(n, known);
+        for (size_t keys : {1024, 8192})
+            benchStorage(n, keys);
+        for (size_t known : {1024, 131072})
+            benchSearch(n, known);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
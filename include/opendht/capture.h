@@ -0,0 +1,117 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#pragma once
+
+#include "infohash.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#else
+#include <ws2tcpip.h>
+#endif
+
+namespace dht {
+
+/**
+ * Writes the datagrams received by a node to a capture file.
+ *
+ * The file starts with the ID of the node. Each record holds the time
+ * of reception since the start of the capture, the source address and
+ * the datagram. Records are buffered: they are written when the buffer
+ * is full, on flush, and when the writer is destroyed.
+ *
+ * Sent datagrams and the secrets of the node are not recorded:
+ * a replay reproduces the handling of requests, without checking
+ * their tokens, but replies match no request of the replaying node.
+ */
+class CaptureWriter {
+public:
+    /**
+     * Create the capture file at path, starting the capture.
+     * Throws DhtException if the file can't be created.
+     */
+    CaptureWriter(const std::string& path, const InfoHash& node_id);
+    ~CaptureWriter();
+
+    /**
+     * Add a datagram received at time t.
+     * Throws DhtException on I/O error.
+     */
+    void write(time_point t, const uint8_t* buf, size_t len, const sockaddr* from, socklen_t fromlen);
+
+    /** Throws DhtException on I/O error. */
+    void flush();
+
+private:
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    const std::string path_;
+    std::FILE* file_ {nullptr};
+    const time_point start_;
+};
+
+/** A datagram read from a capture file */
+struct CapturedPacket {
+    /** Time of reception since the start of the capture */
+    duration time;
+    sockaddr_storage from;
+    socklen_t fromlen;
+    Blob data;
+};
+
+/**
+ * Reads a capture file written by CaptureWriter.
+ */
+class CaptureReader {
+public:
+    /**
+     * Throws DhtException if the file can't be read
+     * or isn't a capture file.
+     */
+    CaptureReader(const std::string& path);
+    ~CaptureReader();
+
+    /** ID of the node whose datagrams were captured */
+    const InfoHash& getNodeId() const {
+        return node_id_;
+    }
+
+    /**
+     * Read the next datagram.
+     * A trailing partial record, left by an interrupted capture, is ignored.
+     * @returns false at the end of the capture.
+     */
+    bool next(CapturedPacket& packet);
+
+private:
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    std::FILE* file_ {nullptr};
+    InfoHash node_id_ {};
+};
+
+}
@@ -0,0 +1,109 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#pragma once
+
+#include "crypto.h"
+#include "infohash.h"
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dht {
+
+/**
+ * Persistent certificate store.
+ *
+ * Certificates are appended to a data file (path), and their offset
+ * to an index file (path + ".idx") of fixed-size entries keyed by public key ID.
+ * The index is read in memory when the store is created;
+ * certificates are only read from the data file when queried.
+ * Certificates are written by a thread of the store, which also compacts
+ * the files when most of the index holds replaced certificates.
+ */
+class CertificateStore {
+public:
+    CertificateStore(const std::string& path);
+    ~CertificateStore();
+
+    /**
+     * Find certificates for a public key ID.
+     * Suitable as a SecureDht::CertificateStoreQuery.
+     */
+    std::vector<std::shared_ptr<crypto::Certificate>> query(const InfoHash& pk_id);
+
+    /**
+     * Queue the certificate to be written to disk, unless it is already stored.
+     * Throws DhtException if the certificate can't be stored,
+     * or if writing a previous one failed.
+     */
+    void store(const crypto::Certificate& crt);
+
+    /**
+     * Wait for queued certificates to be written.
+     */
+    void flush();
+
+    /** Number of stored certificates */
+    size_t size();
+
+    /** The files are compacted when the index holds more than this many replaced entries */
+    static constexpr size_t MIN_COMPACT_ENTRIES {64};
+
+private:
+    CertificateStore(const CertificateStore&) = delete;
+    CertificateStore& operator=(const CertificateStore&) = delete;
+
+    /* Called from the constructor, or with mtx_ locked */
+    void load();
+
+    Blob read(uint64_t offset, const InfoHash& pk_id) const;
+
+    /* Called by the writer thread */
+    void work();
+    uint64_t append(const InfoHash& id, const Blob& packed);
+    void compact(std::unique_lock<std::mutex>& lck);
+
+    const std::string path_;
+    const std::string index_path_;
+
+    std::mutex mtx_ {};
+    std::condition_variable cv_ {};
+    std::condition_variable done_cv_ {};
+    /** Offset of the record of every stored certificate, modified by the writer thread only */
+    std::map<InfoHash, uint64_t> index_ {};
+    /** Entries of the index file, including replaced ones */
+    size_t index_entries_ {0};
+    /** Incremented when the files are replaced by compaction */
+    unsigned generation_ {0};
+    /** The index file ends with a partial entry */
+    bool torn_ {false};
+    /** Certificates waiting to be written */
+    std::map<InfoHash, Blob> pending_ {};
+    std::string error_ {};
+    bool busy_ {false};
+    bool stop_ {false};
+    std::thread writer_ {};
+};
+
+}
@@ -63,18 +63,46 @@ Identity generateIdentity(const std::string& name = "dhtnode", Identity ca = {},
 
 /**
  * A public key.
+ *
+ * Keys read from the network are only parsed on first use,
+ * so that values are cheap to decode even if their signature is never checked.
+ * Identical packed keys are interned and share the same data and memoized ID.
  */
 struct PublicKey
 {
     PublicKey() {}
-    PublicKey(gnutls_pubkey_t k) : pk(k) {}
+
+    /**
+     * Take ownership of existing gnutls structure
+     */
+    PublicKey(gnutls_pubkey_t k);
     PublicKey(const Blob& pk);
-    PublicKey(PublicKey&& o) noexcept : pk(o.pk) { o.pk = nullptr; };
+    PublicKey(PublicKey&& o) noexcept : key_(std::move(o.key_)) {};
+
+    /**
+     * Copies share the same immutable key.
+     */
+    PublicKey(const PublicKey& o) : key_(o.key_) {};
 
     ~PublicKey();
-    operator bool() const { return pk; }
+
+    /**
+     * True if a key is set. Keys read from values are checked to be
+     * well-formed, but only parsed on first use: get() returns nullptr
+     * if parsing fails.
+     */
+    operator bool() const { return (bool)key_; }
 
     PublicKey& operator=(PublicKey&& o) noexcept;
+    PublicKey& operator=(const PublicKey& o) {
+        key_ = o.key_;
+        return *this;
+    }
+
+    bool operator==(const PublicKey& o) const;
+    bool operator!=(const PublicKey& o) const {
+        return not (*this == o);
+    }
 
     InfoHash getId() const;
     bool checkSignature(const Blob& data, const Blob& signature) const;
@@ -94,11 +122,27 @@ struct PublicKey
 
     void msgpack_unpack(msgpack::object o);
 
-    gnutls_pubkey_t pk {};
+    /**
+     * The underlying gnutls key, parsed on first use.
+     * @returns nullptr if the key is not set or invalid.
+     */
+    gnutls_pubkey_t get() const;
+
+    /**
+     * Read-only view of the underlying gnutls key.
+     * @deprecated Use get()
+     */
+    struct KeyView {
+        OPENDHT_DEPRECATED operator gnutls_pubkey_t() const { return key.get(); }
+        const PublicKey& key;
+    };
+    const KeyView pk {*this};
+
 private:
-    PublicKey(const PublicKey&) = delete;
-    PublicKey& operator=(const PublicKey&) = delete;
     void encryptBloc(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size) const;
+
+    struct KeyData;
+    std::shared_ptr<KeyData> key_ {};
 };
 
 /**
@@ -131,6 +175,13 @@ struct PrivateKey
      */
     Blob decrypt(const Blob& cypher) const;
 
+    /**
+     * X25519 public key used to encrypt data for this key (see ecEncrypt).
+     * The matching secret is derived from the private key material,
+     * so it doesn't need to be stored separately.
+     */
+    Blob getEncryptionKey() const;
+
     /**
      * Generate a new RSA key pair
      * @param key_length : size of the modulus in bits
@@ -146,6 +197,14 @@ private:
     PrivateKey& operator=(const PrivateKey&) = delete;
     Blob decryptBloc(const uint8_t* src, size_t src_size) const;
 
+    /* X25519 key pair, derived once from the private key */
+    struct EncryptionKeyPair;
+    std::shared_ptr<const EncryptionKeyPair> getEncryptionKeyPair() const;
+    mutable std::shared_ptr<const EncryptionKeyPair> ec_keys {};
+
+    Blob ecDecrypt(const Blob& cypher) const;
+    Blob multiDecrypt(const Blob& cypher) const;
+
     friend dht::crypto::Identity dht::crypto::generateIdentity(const std::string&, dht::crypto::Identity, unsigned key_length);
 };
 
@@ -272,6 +331,12 @@ struct Certificate {
     /** Read certificate alternative names */
     std::vector<std::pair<NameType, std::string>> getAltNames() const;
 
+    /**
+     * Read the X25519 public key published by the certificate (see ecEncrypt).
+     * @returns an empty blob if the certificate doesn't support hybrid encryption.
+     */
+    Blob getEncryptionKey() const;
+
     /**
      * Returns true if the certificate is marked as a Certificate Authority.
      */
@@ -302,5 +367,28 @@ Blob aesEncrypt(const Blob& data, const Blob& key);
  */
 Blob aesDecrypt(const Blob& data, const Blob& key);
 
+/**
+ * Hybrid encryption for a X25519 public key (as returned by Certificate::getEncryptionKey):
+ * an ephemeral key agreement is used to derive an AES-256 key, used to encrypt data with AES-GCM.
+ * The result can be decrypted with PrivateKey::decrypt.
+ * Much smaller and faster than RSA encryption.
+ */
+Blob ecEncrypt(const Blob& data, const Blob& public_key);
+
+/**
+ * Encrypt data once, for several recipients.
+ * Data is encrypted with a random AES-256 key, which is then wrapped
+ * for each recipient (using hybrid encryption if supported by the certificate).
+ * The result can be decrypted by any recipient with PrivateKey::decrypt.
+ */
+Blob multiEncrypt(const Blob& data, const std::vector<std::shared_ptr<Certificate>>& recipients);
+
+/**
+ * Public key IDs of the recipients of data encrypted with multiEncrypt,
+ * in the order they were provided.
+ * @returns an empty vector if the data is not multi-recipient encrypted.
+ */
+std::vector<InfoHash> getRecipients(const Blob& cypher);
+
 }
 }
@@ -29,16 +29,23 @@ THE SOFTWARE.
 
 #include "infohash.h"
 #include "value.h"
+#include "valuestore.h"
+#include "transport.h"
+#include "metrics.h"
+#include "searchtrace.h"
 
 #include <string>
 #include <array>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <list>
 #include <queue>
+#include <deque>
 #include <functional>
 #include <algorithm>
 #include <memory>
+#include <random>
 
 namespace dht {
 
@@ -54,6 +61,18 @@ struct NodeExport {
     socklen_t sslen;
 };
 
+/**
+ * Write nodes to a file in a compact binary format, keeping their order.
+ * Throws DhtException on I/O error.
+ */
+void saveNodes(const std::string& path, const std::vector<NodeExport>& nodes);
+
+/**
+ * Read nodes written by saveNodes.
+ * Returns no node if the file doesn't exist, throws DhtException if it is invalid.
+ */
+std::vector<NodeExport> loadNodes(const std::string& path);
+
 struct Node {
     InfoHash id {};
     sockaddr_storage ss;
@@ -62,6 +81,8 @@ struct Node {
     time_point reply_time {time_point::min()};      /* time of last correct reply received */
     time_point pinged_time {time_point::min()};     /* time of last message sent */
     unsigned pinged {0};           /* how many requests we sent since last reply */
+    duration rtt {duration::zero()};  /* smoothed round-trip time, zero if unknown */
+    duration last_rtt {duration::zero()};  /* round-trip time of the last answer, zero if unknown */
 
     Node() : ss() {
         std::fill_n((uint8_t*)&ss, sizeof(ss), 0);
@@ -82,7 +103,6 @@ struct Node {
         return print_addr(ss, sslen);
     }
     bool isExpired(time_point now) const;
-    bool isExpired() const { return isExpired(clock::now()); }
     bool isGood(time_point now) const;
     bool isMessagePending(time_point now) const;
     NodeExport exportNode() const { return NodeExport {id, ss, sslen}; }
@@ -127,6 +147,49 @@ public:
     struct Config {
         InfoHash node_id;
         bool is_bootstrap;
+
+        /** Maximum bytes of values stored by the node (0 for the default) */
+        size_t max_store_size;
+
+        /** Maximum bytes of values stored for a single IP address (0 for the default) */
+        size_t max_store_size_per_ip;
+
+        /** Path of the log where stored values are persisted (empty to keep values in memory only) */
+        std::string storage_path;
+
+        /**
+         * Source of the current time of the node (empty for the system clock).
+         * Allows simulations to run faster than real time.
+         */
+        std::function<time_point()> time_source;
+
+        /** Seed of the node random number generator (0 for a random seed) */
+        uint32_t random_seed;
+
+        /**
+         * Accept nodes on loopback addresses, which are otherwise rejected.
+         * Allows to run several nodes on a single host.
+         */
+        bool allow_loopback;
+    };
+
+    /**
+     * Storage usage, for monitoring purposes.
+     */
+    struct StorageStats {
+        size_t keys {0};
+        size_t values {0};
+        /** Bytes of stored values */
+        size_t size {0};
+        size_t max_size {0};
+        std::map<ValueType::Id, size_t> type_size {};
+        /** Number of sources (IP addresses) storing values */
+        size_t sources {0};
+        /** Values and bytes evicted to stay within storage limits */
+        size_t evicted_values {0};
+        size_t evicted_size {0};
+
+        std::string toString() const;
     };
 
     // [[deprecated]]
@@ -182,13 +245,19 @@ public:
 
     using want_t = int_fast8_t;
 
-    Dht() {}
+    Dht();
 
     /**
      * Initialise the Dht with two open sockets (for IPv4 and IP6)
      * and an ID for the node.
      */
     Dht(int s, int s6, Config config);
+
+    /**
+     * Initialise the Dht with a transport to send messages.
+     * Received messages must be given to periodic.
+     */
+    Dht(std::unique_ptr<Transport>&& transport, Config config);
     virtual ~Dht();
 
     /**
@@ -196,6 +265,13 @@ public:
      */
     inline const InfoHash& getNodeId() const { return myid; }
 
+    /**
+     * Current time, from Config::time_source.
+     */
+    time_point getTime() const {
+        return time_source ? time_source() : clock::now();
+    }
+
     /**
      * Get the current status of the node for the given family.
      */
@@ -252,6 +328,12 @@ public:
 
     time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr *from, socklen_t fromlen);
 
+    /**
+     * Like periodic, but the payloads of values received in packet
+     * share its bytes instead of being copied.
+     */
+    time_point periodic(const SharedBlob& packet, const sockaddr *from, socklen_t fromlen);
+
     /**
      * Get a value by searching on all available protocols (IPv4, IPv6),
      * and call the provided get callback when values are found at key.
@@ -343,20 +425,115 @@ public:
     void connectivityChanged();
 
     /**
-     * Get the list of good nodes for local storage saving purposes
+     * Get the list of known nodes of every bucket for local storage saving purposes
      * The list is ordered to minimize the back-to-work delay.
      */
     std::vector<NodeExport> exportNodes();
 
+    /**
+     * Export active puts and listens, with the closest nodes known for them,
+     * so that a later session can resume them without a new lookup.
+     * Listen callbacks are not exported: listened keys are only warmed up
+     * for the application to listen again.
+     */
+    Blob exportSearches() const;
+
+    /**
+     * Import searches exported by exportSearches.
+     * Puts are resumed right away, and only sent again to nodes
+     * which acknowledged them when they are about to expire.
+     * @returns the number of imported searches.
+     */
+    size_t importSearches(const Blob& searches);
+
+    /**
+     * Insert nodes, typically exported by a previous session, then ping
+     * every node of the routing table that is not known to be good,
+     * IMPORT_PINGS nodes every IMPORT_PING_PERIOD.
+     * @returns the number of inserted nodes.
+     */
+    size_t importNodes(const std::vector<NodeExport>& nodes);
+
     typedef std::pair<InfoHash, Blob> ValuesExport;
     std::vector<ValuesExport> exportValues() const;
     void importValues(const std::vector<ValuesExport>&);
 
+    /**
+     * Values stored at a given time.
+     * Stored values are never modified in place (a new version replaces
+     * the old one, and locally put values are stored as a copy), so the
+     * snapshot shares them with the Dht and can be written from another
+     * thread while the Dht keeps running.
+     */
+    struct ValuesSnapshot {
+        struct Entry {
+            InfoHash key;
+            std::shared_ptr<Value> value;
+            std::time_t created;
+        };
+        std::vector<Entry> values {};
+
+        /**
+         * Stream the snapshot file to fd.
+         * Throws DhtException on I/O error.
+         */
+        void write(int fd) const;
+
+        /**
+         * Write the snapshot file at path, replacing it once complete.
+         * Throws DhtException on I/O error.
+         */
+        void write(const std::string& path) const;
+    };
+    ValuesSnapshot snapshotValues() const;
+
+    /**
+     * Write stored values to fd in the snapshot file format.
+     * Throws DhtException on I/O error.
+     */
+    void exportValues(int fd) const {
+        snapshotValues().write(fd);
+    }
+
+    /**
+     * Import values from a snapshot file written by exportValues(int).
+     * The file is mapped in memory and values are decoded in parallel.
+     * Throws DhtException if the file can't be read.
+     * @returns the number of imported values.
+     */
+    size_t importValues(const std::string& path);
+
     int getNodesStats(sa_family_t af, unsigned *good_return, unsigned *dubious_return, unsigned *cached_return, unsigned *incoming_return) const;
     std::string getStorageLog() const;
+    StorageStats getStorageStats() const;
+
+    /**
+     * Evict stored values, least valuable first, until
+     * at most max_size bytes of values are stored.
+     * Can be used to react to memory pressure.
+     * @returns the number of bytes freed.
+     */
+    size_t trimStorage(size_t max_size);
+
+    /**
+     * Use backend to persist stored values.
+     * Values held by the backend are loaded.
+     */
+    void setStorageBackend(std::unique_ptr<ValueStore>&& backend);
     std::string getRoutingTablesLog(sa_family_t) const;
     std::string getSearchesLog(sa_family_t) const;
 
+    /**
+     * Record the timeline of searches (see SearchTrace).
+     * Disabling tracing discards the recorded traces.
+     */
+    void setSearchTracing(bool enabled);
+    bool isSearchTracing() const {
+        return search_tracing;
+    }
+    /** Traces of the current searches */
+    std::vector<SearchTrace> getSearchTraces() const;
+
     void dumpTables() const;
     std::vector<unsigned> getNodeMessageStats(bool in = false) {
         auto stats = in ? std::vector<unsigned>{in_stats.ping,  in_stats.find,  in_stats.get,  in_stats.listen,  in_stats.put}
@@ -367,6 +544,61 @@ public:
         return stats;
     }
 
+    /**
+     * Metrics of this node: messages, round-trip times, searches and storage.
+     * The registry can be read from any thread.
+     */
+    std::shared_ptr<metrics::Registry> getMetrics() const {
+        return metrics_registry;
+    }
+
+    /** Phases of the work done by periodic */
+    enum class Phase : size_t {
+        ProcessMessage = 0,
+        RotateSecrets,
+        ExpireBuckets,
+        ExpireStorage,
+        ExpireSearches,
+        SearchStep,
+        BucketMaintenance,
+        NeighbourhoodMaintenance,
+        StorageMaintenance,
+        StorageSync
+    };
+    static constexpr size_t PHASE_COUNT {10};
+    static const char* getPhaseName(Phase p);
+
+    struct PhaseStats {
+        uint64_t calls {0};
+        duration total {duration::zero()};
+        duration max {duration::zero()};
+    };
+
+    /**
+     * Time spent in each phase of periodic since the last reset, indexed by Phase.
+     * Also available from the metrics registry.
+     */
+    std::array<PhaseStats, PHASE_COUNT> getPhaseStats(bool reset = false);
+
+    /**
+     * A warning is logged when a phase of periodic takes longer than budget
+     * (DEFAULT_PHASE_BUDGET by default). A zero budget disables the warning.
+     */
+    void setPhaseBudget(duration budget) {
+        phase_budget = budget;
+    }
+
+    /**
+     * Maximum time spent by each call to periodic on maintenance:
+     * expiring storage, maintaining storage and stepping searches
+     * (DEFAULT_MAINTENANCE_BUDGET by default). Work left when the budget
+     * is spent is resumed at the next call, which periodic then
+     * asks for immediately. A zero budget disables the limit.
+     */
+    void setMaintenanceBudget(duration budget) {
+        maintenance_budget = budget;
+    }
+
     /* This must be provided by the user. */
     static bool isBlacklisted(const sockaddr*, socklen_t) { return false; }
 
@@ -377,6 +609,35 @@ protected:
     LogMethod DHT_WARN = NOLOG;
     LogMethod DHT_ERROR = NOLOG;
 
+    /**
+     * Called by periodic before processing the message, for subclasses to run
+     * work completed by other threads on the DHT thread.
+     */
+    virtual void runPendingCompletions() {}
+
+    /**
+     * Called when a node returns found, a value with the id of announced,
+     * which is being put at key. Returns true if nodes would refuse
+     * announced because of found, to fail the put early.
+     */
+    virtual bool isOutdated(const InfoHash& /*key*/, const Value& /*announced*/, const Value& /*found*/) {
+        return false;
+    }
+
+    /**
+     * True if the listen token was not cancelled.
+     */
+    bool isListening(size_t token) const {
+        return listeners.find(token) != listeners.end();
+    }
+
+    /**
+     * If false, the tokens of put and listen requests are not checked:
+     * for replays of messages received by another node, whose tokens
+     * were given with its own secrets.
+     */
+    bool check_tokens {true};
+
 private:
 
     static constexpr unsigned TARGET_NODES {8};
@@ -393,6 +654,11 @@ private:
     /* The maximum number of hashes we're willing to track. */
     static constexpr unsigned MAX_HASHES {16384};
 
+    /* Default maximum number of bytes of stored values,
+       in total and for a single IP address. */
+    static constexpr size_t DEFAULT_STORAGE_LIMIT {1024 * 1024 * 64};
+    static constexpr size_t DEFAULT_STORAGE_LIMIT_PER_IP {1024 * 1024 * 8};
+
     /* The maximum number of searches we keep data about. */
     static constexpr unsigned MAX_SEARCHES {128};
 
@@ -418,6 +684,13 @@ private:
 
     static constexpr long unsigned MAX_REQUESTS_PER_SEC {1600};
 
+    /* Pace of the pings validating the routing table after importNodes */
+    static constexpr unsigned IMPORT_PINGS {16};
+    static constexpr std::chrono::milliseconds IMPORT_PING_PERIOD {100};
+
+    static constexpr std::chrono::milliseconds DEFAULT_PHASE_BUDGET {50};
+    static constexpr std::chrono::milliseconds DEFAULT_MAINTENANCE_BUDGET {10};
+
     static constexpr unsigned TOKEN_SIZE {64};
 
     static const std::string my_v;
@@ -450,7 +723,7 @@ private:
         socklen_t cachedlen {0};
 
         /** Return a random node in a bucket. */
-        std::shared_ptr<Node> randomNode();
+        std::shared_ptr<Node> randomNode(std::mt19937& rd);
     };
 
     class RoutingTable : public std::list<Bucket> {
@@ -482,7 +755,7 @@ private:
         /**
          * Return a random id in the bucket's range.
          */
-        InfoHash randomId(const RoutingTable::const_iterator& bucket) const;
+        InfoHash randomId(const RoutingTable::const_iterator& bucket, std::mt19937& rd) const;
 
         unsigned depth(const RoutingTable::const_iterator& bucket) const;
 
@@ -552,6 +825,7 @@ private:
         }
 
         std::shared_ptr<Node> node {};
+        unsigned hops {0};             /* replies followed to learn about the node */
 
         RequestStatus getStatus {};    /* get/sync status */
         RequestStatus listenStatus {};
@@ -623,10 +897,12 @@ private:
         std::map<size_t, LocalListener> listeners {};
         size_t listener_token = 1;
 
+        std::shared_ptr<SearchTrace> trace {};      /* if search tracing is enabled */
+
         /**
          * @returns true if the node was not present and added to the search
          */
-        bool insertNode(std::shared_ptr<Node> n, time_point now, const Blob& token={});
+        bool insertNode(std::shared_ptr<Node> n, time_point now, const Blob& token={}, unsigned hops=0);
         unsigned insertBucket(const Bucket&, time_point now);
 
         /**
@@ -670,9 +946,13 @@ private:
     struct ValueStorage {
         std::shared_ptr<Value> data {};
         time_point time {};
+        /** IP address of the node which stored the value (empty for local values) */
+        std::string source {};
+        /** Size accounted for the value when it was stored */
+        size_t size {0};
 
         ValueStorage() {}
-        ValueStorage(const std::shared_ptr<Value>& v, time_point t) : data(v), time(t) {}
+        ValueStorage(const std::shared_ptr<Value>& v, time_point t) : data(v), time(t), size(v ? v->size() : 0) {}
     };
 
     /**
@@ -706,8 +986,40 @@ private:
         std::map<size_t, LocalListener> local_listeners {};
         size_t listener_token {1};
 
+        /** Position of values in values, by value id */
+        std::unordered_map<Value::Id, size_t> values_index {};
+
+        /** Bytes of stored values, total and by value type */
+        size_t total_size {0};
+        std::map<ValueType::Id, size_t> type_size {};
+
+        /** Number of get requests received for this key */
+        size_t hits {0};
+
         Storage() {}
         Storage(InfoHash id, time_point now) : id(id), maintenance_time(now+MAX_STORAGE_MAINTENANCE_EXPIRE_TIME) {}
+
+        ValueStorage* getById(Value::Id vid);
+        const ValueStorage* getById(Value::Id vid) const {
+            return const_cast<Storage*>(this)->getById(vid);
+        }
+
+        /**
+         * Store a new value or update the value with the same id.
+         * @returns the stored value, or nullptr if max_values is reached,
+         *          and whether the stored value changed.
+         */
+        std::pair<ValueStorage*, bool> store(const std::shared_ptr<Value>& value, time_point created, size_t max_values);
+
+        /**
+         * Remove values for which remove returns true.
+         * @returns the number of removed values.
+         */
+        size_t removeIf(const std::function<bool(const ValueStorage&)>& remove);
+
+    private:
+        void addSize(const ValueStorage& v);
+        void removeSize(const ValueStorage& v);
     };
 
     enum class MessageType {
@@ -766,9 +1078,9 @@ private:
     Dht(const Dht&) = delete;
     Dht& operator=(const Dht&) = delete;
 
-    // socket descriptors
-    int dht_socket {-1};
-    int dht_socket6 {-1};
+    std::unique_ptr<Transport> transport {};
+    const std::function<time_point()> time_source {};
+    std::mt19937 rd;
 
     InfoHash myid {};
 
@@ -786,13 +1098,23 @@ private:
     //       Only nodes running only as bootstrap nodes should
     //       be put in bootstrap mode.
     const bool is_bootstrap {false};
+    const bool allow_loopback {false};
 
     // the stuff
     RoutingTable buckets {};
     RoutingTable buckets6 {};
     std::vector<Storage> store {};
+    const size_t max_store_size {DEFAULT_STORAGE_LIMIT};
+    const size_t max_store_size_per_ip {DEFAULT_STORAGE_LIMIT_PER_IP};
+    size_t total_store_size {0};
+    std::map<ValueType::Id, size_t> total_type_size {};
+    std::map<std::string, size_t> source_store_size {};
+    size_t evicted_values {0};
+    size_t evicted_size {0};
+    std::unique_ptr<ValueStore> storage_backend {};
     std::list<Search> searches {};
     uint16_t search_id {0};
+    bool search_tracing {false};
 
     // map a global listen token to IPv4, IPv6 specific listen tokens.
     // 0 is the invalid token.
@@ -806,11 +1128,17 @@ private:
     time_point now;
     time_point mybucket_grow_time {time_point::min()}, mybucket6_grow_time {time_point::min()};
     time_point expire_stuff_time {time_point::min()};
+    bool expiring_storage {false};
+    size_t expire_storage_pos {0};          /* where to resume expireStorage */
     time_point search_time {time_point::max()};
     time_point confirm_nodes_time {time_point::min()};
     time_point rotate_secrets_time {time_point::min()};
     std::queue<time_point> rate_limit_time {};
 
+    /* Nodes to ping after importNodes, and when to send the next pings */
+    std::deque<std::weak_ptr<Node>> import_pings {};
+    time_point import_ping_time {time_point::max()};
+
     using ReportedAddr = std::pair<unsigned, Address>;
     std::vector<ReportedAddr> reported_addr;
 
@@ -847,7 +1175,10 @@ private:
 
     int sendError(const sockaddr*, socklen_t, TransId tid, uint16_t code, const char *message, bool include_id=false);
 
-    void processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, socklen_t fromlen);
+    time_point runPeriodic(const uint8_t *buf, size_t buflen, const SharedBlob& packet, const sockaddr *from, socklen_t fromlen);
+
+    /* packet, if not empty, holds buf: values share its bytes */
+    void processMessage(const uint8_t *buf, size_t buflen, const SharedBlob& packet, const sockaddr *from, socklen_t fromlen);
 
     struct ParsedMessage {
         MessageType type;
@@ -865,7 +1196,8 @@ private:
         uint16_t error_code;
         std::string ua;
         Address addr;
-        void msgpack_unpack(msgpack::object o);
+        /* now: current time of the node, for the creation time */
+        void msgpack_unpack(msgpack::object o, time_point now, const SharedBlob& source = {});
     };
 
     void rotateSecrets();
@@ -882,8 +1214,25 @@ private:
     }
 
     void storageAddListener(const InfoHash& id, const InfoHash& node, const sockaddr *from, socklen_t fromlen, uint16_t tid);
-    ValueStorage* storageStore(const InfoHash& id, const std::shared_ptr<Value>& value, time_point created=time_point::max());
-    void expireStorage();
+    ValueStorage* storageStore(const InfoHash& id, const std::shared_ptr<Value>& value, time_point created=time_point::max(),
+                               const sockaddr* from=nullptr, socklen_t fromlen=0);
+    /**
+     * Expire listeners and values of the store, stopping at deadline.
+     * @returns true if the whole store was expired, false if
+     *          the next call will resume where this one stopped.
+     */
+    bool expireStorage(time_point deadline = time_point::max());
+    void storageValueRemoved(const InfoHash& id, const ValueStorage&);
+    void updateStorageSize(const ValueStorage&, bool added);
+
+    /**
+     * Evict values, least valuable first, to get from size down to target bytes.
+     * Only values of type are evicted if it is not null,
+     * and the value with id keep.second stored at keep.first never is.
+     * @returns the number of bytes freed.
+     */
+    size_t evictValues(size_t size, size_t target,
+        const std::pair<InfoHash, Value::Id>& keep = {}, const ValueType* type = nullptr);
     void storageChanged(Storage& st, ValueStorage&);
 
     size_t maintainStorage(InfoHash id, bool force=false, DoneCallback donecb=nullptr);
@@ -909,6 +1258,7 @@ private:
     void expireBuckets(RoutingTable&);
     int sendCachedPing(Bucket& b);
     bool bucketMaintenance(RoutingTable&);
+    void sendImportPings();
     static unsigned insertClosestNode(uint8_t *nodes, unsigned numnodes, const InfoHash& id, const Node& n);
     unsigned bufferClosestNodes(uint8_t *nodes, unsigned numnodes, const InfoHash& id, const Bucket& b) const;
     void dumpBucket(const Bucket& b, std::ostream& out) const;
@@ -924,6 +1274,10 @@ private:
     void blacklistNode(const InfoHash* id, const sockaddr*, socklen_t);
     bool isNodeBlacklisted(const sockaddr*, socklen_t) const;
     static bool isMartian(const sockaddr*, socklen_t);
+    static bool isLoopback(const sockaddr*, socklen_t);
+    bool isRejected(const sockaddr* sa, socklen_t salen) const {
+        return isMartian(sa, salen) and not (allow_loopback and isLoopback(sa, salen));
+    }
 
     // Searches
 
@@ -934,9 +1288,19 @@ private:
      */
     Search* search(const InfoHash& id, sa_family_t af, GetCallback = nullptr, DoneCallback = nullptr, Value::Filter = Value::AllFilter());
     void announce(const InfoHash& id, sa_family_t af, std::shared_ptr<Value> value, DoneCallback callback, time_point created=time_point::max());
+
+    /**
+     * Stop announcing the value on all networks, and call the callbacks of the put with a failure.
+     */
+    void failPut(const InfoHash& id, Value::Id vid);
     size_t listenTo(const InfoHash& id, sa_family_t af, GetCallback cb, Value::Filter f = Value::AllFilter());
 
     std::list<Search>::iterator newSearch();
+    /**
+     * Find or create the search for id and af.
+     * Returns nullptr if no search slot is available.
+     */
+    Search* getSearch(const InfoHash& id, sa_family_t af);
     void bootstrapSearch(Search& sr);
     Search *findSearch(unsigned short tid, sa_family_t af);
     void expireSearches();
@@ -962,6 +1326,20 @@ private:
 
     MessageStats in_stats {}, out_stats {};
 
+    struct Metrics;
+    std::shared_ptr<metrics::Registry> metrics_registry;
+    std::unique_ptr<Metrics> metrics;
+
+    std::array<PhaseStats, PHASE_COUNT> phase_stats {};
+    duration phase_budget {DEFAULT_PHASE_BUDGET};
+    duration maintenance_budget {DEFAULT_MAINTENANCE_BUDGET};
+
+    /**
+     * Account the time since start to phase p.
+     * @returns the current time, as the start of the next phase.
+     */
+    time_point phaseDone(Phase p, time_point start);
+
 };
 
 }
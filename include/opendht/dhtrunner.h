@@ -21,6 +21,7 @@
 #pragma once
 
 #include "securedht.h"
+#include "capture.h"
 
 #include <thread>
 #include <mutex>
@@ -169,6 +170,10 @@ public:
         putEncrypted(hash, to, std::forward<Value>(value), Dht::bindDoneCb(cb));
     }
     void putEncrypted(const std::string& key, InfoHash to, Value&& value, Dht::DoneCallback cb=nullptr);
+    void putEncrypted(InfoHash hash, const std::vector<InfoHash>& to, Value&& value, Dht::DoneCallback cb=nullptr);
+    void putEncrypted(InfoHash hash, const std::vector<InfoHash>& to, Value&& value, Dht::DoneCallbackSimple cb) {
+        putEncrypted(hash, to, std::forward<Value>(value), Dht::bindDoneCb(cb));
+    }
 
     void bootstrap(const char* host, const char* service);
     void bootstrap(const std::vector<std::pair<sockaddr_storage, socklen_t>>& nodes);
@@ -252,6 +257,49 @@ public:
         dht_->importValues(values);
     }
 
+    /**
+     * Export active puts and listens, see Dht::exportSearches.
+     */
+    Blob exportSearches() const {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            return {};
+        return dht_->exportSearches();
+    }
+
+    /**
+     * Resume puts and warm up listens of a previous session.
+     */
+    void importSearches(const Blob& searches);
+
+    /**
+     * Write stored values to a snapshot file.
+     * The Dht is only locked while values are collected,
+     * not while they are written.
+     * Throws DhtException on I/O error.
+     */
+    void exportValues(const std::string& path) const {
+        Dht::ValuesSnapshot snapshot;
+        {
+            std::lock_guard<std::mutex> lck(dht_mtx);
+            if (!dht_)
+                return;
+            snapshot = dht_->snapshotValues();
+        }
+        snapshot.write(path);
+    }
+
+    /**
+     * Import values from a snapshot file written by exportValues.
+     * @returns the number of imported values.
+     */
+    size_t importValues(const std::string& path) {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            return 0;
+        return dht_->importValues(path);
+    }
+
     bool isRunning() const {
         return running;
     }
@@ -268,11 +316,81 @@ public:
         return dht_->getNodeMessageStats(in);
     }
 
+    ThreadPool::Stats getCryptoStats() const
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_->getCryptoStats();
+    }
+
+    std::array<Dht::PhaseStats, Dht::PHASE_COUNT> getPhaseStats(bool reset = false)
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_->getPhaseStats(reset);
+    }
+
+    void setPhaseBudget(duration budget)
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        dht_->setPhaseBudget(budget);
+    }
+
+    void setMaintenanceBudget(duration budget)
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        dht_->setMaintenanceBudget(budget);
+    }
+
+    /**
+     * Metrics of the running node, see Dht::getMetrics.
+     * The registry can be rendered without blocking the node:
+     * getMetrics()->toPrometheus()
+     */
+    std::shared_ptr<metrics::Registry> getMetrics() const
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_ ? dht_->getMetrics() : nullptr;
+    }
+
+    /** Datagrams and bytes exchanged by the node since it was started */
+    struct Traffic {
+        uint64_t packets_in;
+        uint64_t bytes_in;
+        uint64_t packets_out;
+        uint64_t bytes_out;
+    };
+    Traffic getTraffic() const {
+        return {packets_in.load(), bytes_in.load(), packets_out.load(), bytes_out.load()};
+    }
+
+    /**
+     * Write received datagrams, with their source and time of reception,
+     * to a capture file until stopCapture is called (see CaptureReader).
+     * Throws DhtException if the file can't be created.
+     */
+    void startCapture(const std::string& path) {
+        std::lock_guard<std::mutex> lck(capture_mtx);
+        capture.reset(new CaptureWriter(path, getNodeId()));
+    }
+    void stopCapture() {
+        std::lock_guard<std::mutex> lck(capture_mtx);
+        capture.reset();
+    }
+
     std::string getStorageLog() const
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
         return dht_->getStorageLog();
     }
+    Dht::StorageStats getStorageStats() const
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_->getStorageStats();
+    }
+
+    /**
+     * Evict stored values until at most max_size bytes are stored.
+     */
+    void trimStorage(size_t max_size);
     std::string getRoutingTablesLog(sa_family_t af) const
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
@@ -283,6 +401,21 @@ public:
         std::lock_guard<std::mutex> lck(dht_mtx);
         return dht_->getSearchesLog(af);
     }
+    void setSearchTracing(bool enabled)
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        dht_->setSearchTracing(enabled);
+    }
+    bool isSearchTracing() const
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_->isSearchTracing();
+    }
+    std::vector<SearchTrace> getSearchTraces() const
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_->getSearchTraces();
+    }
     std::vector<Address> getPublicAddress(sa_family_t af = 0)
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
@@ -324,9 +457,18 @@ public:
             .dht_config = {
                 .node_config = {
                     .node_id = {},
-                    .is_bootstrap = is_bootstrap
+                    .is_bootstrap = is_bootstrap,
+                    .max_store_size = 0,
+                    .max_store_size_per_ip = 0,
+                    .storage_path = {},
+                    .time_source = {},
+                    .random_seed = 0,
+                    .allow_loopback = false
                 },
-                .id = identity
+                .id = identity,
+                .crypto_threads = 0,
+                .certificate_store_path = {},
+                .seq_store_path = {}
             },
             .threaded = threaded
         });
@@ -392,7 +534,7 @@ private:
 
     std::thread rcv_thread {};
     std::mutex sock_mtx {};
-    std::vector<std::pair<Blob, std::pair<sockaddr_storage, socklen_t>>> rcv {};
+    std::vector<std::pair<SharedBlob, std::pair<sockaddr_storage, socklen_t>>> rcv {};
 
     std::queue<std::function<void(SecureDht&)>> pending_ops_prio {};
     std::queue<std::function<void(SecureDht&)>> pending_ops {};
@@ -406,6 +548,12 @@ private:
 
     Address bound4 {};
     Address bound6 {};
+
+    std::unique_ptr<CaptureWriter> capture {};
+    std::mutex capture_mtx {};
+
+    std::atomic<uint64_t> packets_in {0}, bytes_in {0};
+    std::atomic<uint64_t> packets_out {0}, bytes_out {0};
 };
 
 }
@@ -0,0 +1,131 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#pragma once
+
+#include "utils.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace dht {
+namespace metrics {
+
+/** Monotonic counter */
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        value_.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t get() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+private:
+    std::atomic<uint64_t> value_ {0};
+};
+
+/** Value that can go up and down */
+class Gauge {
+public:
+    void set(int64_t v) {
+        value_.store(v, std::memory_order_relaxed);
+    }
+    void add(int64_t n) {
+        value_.fetch_add(n, std::memory_order_relaxed);
+    }
+    int64_t get() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+private:
+    std::atomic<int64_t> value_ {0};
+};
+
+/**
+ * Distribution of observed values over buckets of fixed upper bounds.
+ * Durations are observed in seconds.
+ */
+class Histogram {
+public:
+    /** bounds: increasing upper bounds of the buckets */
+    Histogram(std::vector<double> bounds);
+
+    void observe(double v);
+    void observe(duration d) {
+        observe(std::chrono::duration<double>(d).count());
+    }
+
+    const std::vector<double>& getBounds() const {
+        return bounds_;
+    }
+    /** Number of observed values of each bucket, the last one counting values above all bounds */
+    std::vector<uint64_t> getCounts() const;
+    double getSum() const;
+
+private:
+    // The sum is kept in millionths, to be updated atomically.
+    static constexpr double SUM_SCALE {1000000.};
+
+    const std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+    std::atomic<uint64_t> sum_ {0};
+};
+
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+/**
+ * Set of metrics, rendered in the Prometheus text format.
+ *
+ * Metrics are registered once and then updated without locking,
+ * so that updates stay cheap and the registry can be rendered
+ * from any thread. Registering an existing metric (same name and labels)
+ * returns it.
+ */
+class Registry {
+public:
+    Counter& counter(const std::string& name, const std::string& help, const Labels& labels = {});
+    Gauge& gauge(const std::string& name, const std::string& help, const Labels& labels = {});
+    Histogram& histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds, const Labels& labels = {});
+
+    std::string toPrometheus() const;
+
+private:
+    struct Series {
+        Labels labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+    struct Family {
+        std::string help;
+        std::string type;
+        std::vector<Series> series;
+    };
+
+    Series& getSeries(const std::string& name, const std::string& help, const std::string& type, const Labels& labels);
+
+    mutable std::mutex mtx_ {};
+    std::map<std::string, Family> families_ {};
+};
+
+}
+}
@@ -0,0 +1,105 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#pragma once
+
+#include "infohash.h"
+#include "utils.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#else
+#include <ws2tcpip.h>
+#endif
+
+namespace dht {
+
+/**
+ * Timeline of a search: the requests it sent, their replies
+ * and timeouts, and the operations (get, put, listen) it performed.
+ * Recorded by the Dht when search tracing is enabled.
+ */
+struct SearchTrace {
+    enum class EventType : uint8_t {
+        Start,      /* an operation was started */
+        Request,    /* a request was sent to the node */
+        Reply,      /* the node replied */
+        Timeout,    /* the node didn't reply in time */
+        Done,       /* an operation completed */
+        Failed      /* an operation failed */
+    };
+
+    enum class Request : uint8_t {
+        None,
+        Get,        /* get or find nodes */
+        Put,
+        Listen
+    };
+
+    struct Event {
+        Event(duration time, EventType type, Request request, const InfoHash& node = {}, std::string addr = {},
+              std::vector<InfoHash>&& learned = {}, unsigned values = 0)
+            : time(time), type(type), request(request), node(node), addr(std::move(addr)),
+              learned(std::move(learned)), values(values) {}
+
+        duration time;          /* since the start of the trace */
+        EventType type;
+        Request request;
+        InfoHash node;
+        std::string addr;
+        /* Reply: nodes added to the search, and number of values received */
+        std::vector<InfoHash> learned;
+        unsigned values;
+    };
+
+    /** Events beyond this number are counted in dropped, but not recorded */
+    static constexpr size_t MAX_EVENTS {4096};
+
+    SearchTrace(const InfoHash& id, sa_family_t af, time_point start) : id(id), af(af), start(start) {}
+
+    InfoHash id;
+    sa_family_t af;
+    time_point start;
+    std::vector<Event> events {};
+    size_t dropped {0};
+
+    void operationStarted(Request r, time_point now);
+    void operationDone(Request r, bool ok, time_point now);
+    void requestSent(Request r, const InfoHash& node, std::string addr, time_point now);
+    void replyReceived(Request r, const InfoHash& node, std::string addr, time_point now,
+            std::vector<InfoHash>&& learned = {}, unsigned values = 0);
+
+    /** Add a Timeout event for the requests sent before now - timeout and not answered */
+    void checkTimeouts(time_point now, duration timeout);
+
+    /** The events as JSON lines, one object per event. */
+    std::string toJson() const;
+
+private:
+    void add(Event&& e);
+
+    /* time of the requests waiting for a reply */
+    std::map<std::pair<InfoHash, Request>, time_point> pending_ {};
+};
+
+}
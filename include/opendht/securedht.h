@@ -32,8 +32,11 @@
 
 #include "dht.h"
 #include "crypto.h"
+#include "threadpool.h"
+#include "certstore.h"
 
 #include <map>
+#include <list>
 #include <vector>
 #include <memory>
 #include <random>
@@ -44,14 +47,41 @@ class SecureDht : public Dht {
 public:
 
     typedef std::function<void(bool)> SignatureCheckCallback;
+    typedef std::function<void(const std::shared_ptr<crypto::Certificate>)> CertificateCallback;
+
+    /* Maximum number of certificates kept in cache */
+    static constexpr unsigned MAX_CERTIFICATES {1024};
+
+    /* Time during which a certificate that couldn't be found is not searched again */
+    static constexpr std::chrono::minutes CERTIFICATE_NOT_FOUND_TTL {1};
 
     struct Config
     {
         Dht::Config node_config;
         crypto::Identity id;
+
+        /**
+         * Number of threads used to offload cryptographic operations
+         * of get, listen, putSigned and putEncrypted from the DHT thread.
+         * If 0, these operations are done synchronously.
+         */
+        unsigned crypto_threads;
+
+        /**
+         * If not empty, path of the built-in persistent certificate store:
+         * certificates are written to disk in the background when registered,
+         * and searched there before querying the network.
+         */
+        std::string certificate_store_path;
+
+        /**
+         * If not empty, file used to persist the sequence number of values published
+         * with putSigned, so that they can be updated without querying the network first.
+         */
+        std::string seq_store_path;
     };
 
-    SecureDht() {}
+    SecureDht();
 
     /**
      * s, s6: bound socket descriptors for IPv4 and IPv6, respectively.
@@ -61,10 +91,32 @@ public:
      */
     SecureDht(int s, int s6, Config config);
 
+    SecureDht(std::unique_ptr<Transport>&& transport, Config config);
+
     virtual ~SecureDht();
 
     InfoHash getId() const {
-        return key_ ? key_->getPublicKey().getId() : InfoHash();
+        return publicKey_.getId();
+    }
+
+    /**
+     * True if completed cryptographic operations are waiting to be run by periodic().
+     */
+    bool hasCryptoCompletions() const {
+        return cryptoPool_ and cryptoPool_->hasCompletions();
+    }
+
+    /**
+     * Set a callback called from a crypto worker thread when an operation completed,
+     * to wake up the thread calling periodic().
+     */
+    void setOnCryptoCompletion(ThreadPool::Task&& cb) {
+        if (cryptoPool_)
+            cryptoPool_->setNotify(std::move(cb));
+    }
+
+    ThreadPool::Stats getCryptoStats() const {
+        return cryptoPool_ ? cryptoPool_->getStats() : ThreadPool::Stats {};
     }
 
     ValueType secureType(ValueType&& type);
@@ -98,6 +150,10 @@ public:
 
     /**
      * Will take ownership of the value, sign it using our private key and put it in the DHT.
+     * The sequence number is set after the one we last published for this value,
+     * or found on the network if unknown.
+     * A copy of the value is signed: val gets its sequence number, owner
+     * and signature from the DHT thread, before the signed value is put.
      */
     void putSigned(const InfoHash& hash, std::shared_ptr<Value> val, DoneCallback callback);
     void putSigned(const InfoHash& hash, Value&& v, DoneCallback callback) {
@@ -114,6 +170,16 @@ public:
         putEncrypted(hash, to, std::make_shared<Value>(std::move(v)), callback);
     }
 
+    /**
+     * Same as putEncrypted for several recipients: the data is encrypted once,
+     * and the encryption key wrapped for every recipient, producing a single value.
+     * Fails if any of the recipient' public keys can't be found.
+     */
+    void putEncrypted(const InfoHash& hash, const std::vector<InfoHash>& to, std::shared_ptr<Value> val, DoneCallback callback);
+    void putEncrypted(const InfoHash& hash, const std::vector<InfoHash>& to, Value&& v, DoneCallback callback) {
+        putEncrypted(hash, to, std::make_shared<Value>(std::move(v)), callback);
+    }
+
     /**
      * Take ownership of the value and sign it using our private key.
      */
@@ -121,9 +187,26 @@ public:
 
     Value encrypt(Value& v, const crypto::PublicKey& to) const;
 
+    /**
+     * Sign and encrypt the value for the owner of the certificate.
+     * Uses hybrid X25519 encryption if the certificate supports it,
+     * RSA encryption otherwise.
+     */
+    Value encrypt(Value& v, const crypto::Certificate& to) const;
+
+    /**
+     * Sign and encrypt the value for several recipients.
+     * The value recipient is set to the hash of the recipient list.
+     */
+    Value encrypt(Value& v, const std::vector<std::shared_ptr<crypto::Certificate>>& to) const;
+
     Value decrypt(const Value& v);
 
-    void findCertificate(const InfoHash& node, std::function<void(const std::shared_ptr<crypto::Certificate>)> cb);
+    /**
+     * Find the certificate of a node from the cache, the local store or the network.
+     * Concurrent lookups for the same node share a single network request.
+     */
+    void findCertificate(const InfoHash& node, CertificateCallback cb);
 
     const std::shared_ptr<crypto::Certificate> registerCertificate(const InfoHash& node, const Blob& cert);
     void registerCertificate(std::shared_ptr<crypto::Certificate>& cert);
@@ -142,23 +225,115 @@ public:
         localQueryMethod_ = std::move(query_method);
     }
 
+protected:
+    /**
+     * Run completed cryptographic operations, called by periodic().
+     */
+    virtual void runPendingCompletions() override {
+        if (cryptoPool_)
+            cryptoPool_->runCompletions();
+    }
+
+    /**
+     * A signed value is outdated by a valid one, with the same owner,
+     * that nodes keep instead: a greater sequence number, or the same
+     * with different data.
+     */
+    virtual bool isOutdated(const InfoHash& key, const Value& announced, const Value& found) override;
+
 private:
     // prevent copy
     SecureDht(const SecureDht&) = delete;
     SecureDht& operator=(const SecureDht&) = delete;
 
-    GetCallback getCallbackFilter(GetCallback, Value::Filter&&);
+    /**
+     * State shared between the value and done callbacks of an operation
+     * whose values are checked asynchronously by the crypto pool.
+     */
+    struct CryptoGetState {
+        size_t pending {0};
+        bool stop {false};
+        std::function<void()> done {};
+        // listen token, 0 for a get
+        size_t listen_token {0};
+    };
+
+    GetCallback getCallbackFilter(GetCallback, Value::Filter&&, std::shared_ptr<CryptoGetState> = {});
+
+    /**
+     * Check signatures and decrypt values.
+     * Values that can't be checked or decrypted are dropped.
+     */
+    std::vector<std::shared_ptr<Value>> checkValues(const std::vector<std::shared_ptr<Value>>& values);
+
+    /**
+     * Run task on the crypto pool, and completion on the DHT thread once done.
+     * Without crypto pool, both are run immediately.
+     */
+    void runCrypto(ThreadPool::Task&& task, ThreadPool::Task&& completion);
+
+    /**
+     * Put the value returned by encrypt_value, called from the crypto pool.
+     */
+    void putEncryptedValue(const InfoHash& hash, std::function<Value()>&& encrypt_value, DoneCallback callback);
 
     std::shared_ptr<crypto::PrivateKey> key_ {};
     std::shared_ptr<crypto::Certificate> certificate_ {};
+    const crypto::PublicKey publicKey_ {};
 
     // method to query the local certificate store
     CertificateStoreQuery localQueryMethod_ {};
 
-    // our certificate cache
-    std::map<InfoHash, std::shared_ptr<crypto::Certificate>> nodesCertificates_ {};
+    // built-in persistent certificate store
+    std::unique_ptr<CertificateStore> certStore_ {};
+
+    // last sequence number published with putSigned, per key and value id
+    std::map<std::pair<InfoHash, Value::Id>, uint16_t> publishedSeqs_ {};
+
+    // writes published sequence numbers to the seq_store_path file in the background
+    class SeqLog;
+    std::unique_ptr<SeqLog> seqLog_ {};
+
+    // sequence numbers found online that made a put fail, per key and value id
+    std::map<std::pair<InfoHash, Value::Id>, uint16_t> outdatedSeqs_ {};
+
+    void cacheCertificate(const InfoHash& node, const std::shared_ptr<crypto::Certificate>& cert);
+    void onCertificateFound(const InfoHash& node, const std::shared_ptr<crypto::Certificate>& cert);
+    void persistCertificate(const crypto::Certificate& cert);
+
+    void fetchSeqAndPut(const InfoHash& hash, std::shared_ptr<Value> val, std::shared_ptr<Value> orig, DoneCallback callback);
+    /**
+     * Sign and put val, which must not be shared with the DHT thread.
+     * Once signed, orig (the value passed to putSigned) gets its
+     * sequence number, owner and signature.
+     * If retry is true and the put fails because a newer version is
+     * stored, the value is put again once after it.
+     */
+    void signAndPut(const InfoHash& hash, std::shared_ptr<Value> val, std::shared_ptr<Value> orig, DoneCallback callback, bool retry = true);
+    void loadPublishedSeqs(const std::string& path);
+    void recordPublishedSeq(const InfoHash& hash, Value::Id id, uint16_t seq);
+
+    // our certificate cache, most recently used first
+    using CertificateCache = std::list<std::pair<InfoHash, std::shared_ptr<crypto::Certificate>>>;
+    CertificateCache nodesCertificates_ {};
+    std::map<InfoHash, CertificateCache::iterator> nodesCertificatesIndex_ {};
+
+    // nodes whose certificate couldn't be found, and when to search again
+    std::map<InfoHash, time_point> missingCertificates_ {};
+
+    // callbacks waiting for a certificate lookup in progress
+    std::map<InfoHash, std::vector<CertificateCallback>> pendingCertificateQueries_ {};
 
     std::uniform_int_distribution<Value::Id> rand_id {};
+
+    // serializes private key operations run by the crypto pool
+    mutable std::mutex keyMtx_ {};
+
+    // set while the crypto pool is stopping: pending operations fail instead of completing
+    bool stopping_ {false};
+
+    // destroyed first, so that running tasks complete while the rest is still valid
+    std::unique_ptr<ThreadPool> cryptoPool_ {};
 };
 
 const ValueType CERTIFICATE_TYPE = {
@@ -166,7 +341,7 @@ const ValueType CERTIFICATE_TYPE = {
     // A certificate can only be stored at it's public key ID.
     [](InfoHash id, std::shared_ptr<Value>& v, InfoHash, const sockaddr*, socklen_t) {
         try {
-            crypto::Certificate crt(v->data);
+            crypto::Certificate crt(v->data.data(), v->data.size());
             // TODO check certificate signature
             return crt.getPublicKey().getId() == id;
         } catch (const std::exception& e) {}
@@ -174,7 +349,8 @@ const ValueType CERTIFICATE_TYPE = {
     },
     [](InfoHash, const std::shared_ptr<Value>& o, std::shared_ptr<Value>& n, InfoHash, const sockaddr*, socklen_t) {
         try {
-            return crypto::Certificate(o->data).getPublicKey().getId() == crypto::Certificate(n->data).getPublicKey().getId();
+            return crypto::Certificate(o->data.data(), o->data.size()).getPublicKey().getId()
+                == crypto::Certificate(n->data.data(), n->data.size()).getPublicKey().getId();
         } catch (const std::exception& e) {}
         return false;
     }
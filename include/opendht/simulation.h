@@ -0,0 +1,181 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#pragma once
+
+#include "dht.h"
+
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <vector>
+
+namespace dht {
+
+/**
+ * In-process simulated network of Dht nodes, for large-scale tests
+ * and benchmarks.
+ *
+ * Nodes get IPv4 addresses from 10.0.0.0/8 and exchange their messages
+ * through the network, which adds latency, loss, bandwidth limits
+ * and churn. Every node runs on the thread calling run(), one at a time:
+ * nodes can be used directly between calls to run().
+ *
+ * Nodes use the simulated clock of the network, which run() advances
+ * from one event to the next without waiting: hours of protocol activity
+ * are simulated in seconds. Node IDs and the random choices of the nodes
+ * derive from the seed of the network.
+ */
+class SimulatedNetwork {
+public:
+    struct Config {
+        /** One-way latency of every message */
+        duration latency;
+        /** Random additional latency, uniformly distributed */
+        duration jitter;
+        /** Probability for a message to be lost */
+        double loss;
+        /** Upload bandwidth of every node in bytes per second (0 for unlimited) */
+        size_t bandwidth;
+        /** Average time a node stays online (zero to disable churn) */
+        duration uptime;
+        /** Average time a node stays offline */
+        duration downtime;
+    };
+
+    /** Messages sent and received by a node */
+    struct Traffic {
+        size_t sent_packets {0};
+        size_t sent_bytes {0};
+        size_t received_packets {0};
+        size_t received_bytes {0};
+        /** Messages to the node lost or dropped while the node was offline */
+        size_t dropped_packets {0};
+
+        Traffic& operator+=(const Traffic& o);
+    };
+
+    SimulatedNetwork(Config config, unsigned seed = 0);
+    ~SimulatedNetwork();
+
+    /**
+     * Create a node, with an ID drawn from the seed of the network.
+     * @returns the index of the node.
+     */
+    size_t addNode();
+    size_t addNode(const InfoHash& id);
+
+    size_t size() const {
+        return nodes_.size();
+    }
+
+    /**
+     * A node, to be used between calls to run().
+     * The node runs at the next event, to start what was requested.
+     */
+    Dht& getNode(size_t i) {
+        auto& n = *nodes_.at(i);
+        schedule(i, now_);
+        return *n.dht;
+    }
+
+    /** ID and address of a node, to bootstrap other nodes */
+    NodeExport exportNode(size_t i) const;
+
+    bool isOnline(size_t i) const {
+        return nodes_.at(i)->online;
+    }
+
+    /**
+     * Take a node offline, or back online.
+     * Offline nodes don't run and their messages are dropped.
+     */
+    void setOnline(size_t i, bool online);
+
+    const Traffic& getTraffic(size_t i) const {
+        return nodes_.at(i)->traffic;
+    }
+
+    /** Traffic of all nodes */
+    Traffic getTraffic() const;
+
+    /** Current simulated time */
+    time_point now() const {
+        return now_;
+    }
+
+    /**
+     * Run the nodes and deliver messages until the simulated time t.
+     */
+    void run(time_point t);
+
+    /**
+     * Run the nodes until done returns true, checked after every event,
+     * or until the simulated time t.
+     * @returns true if done returned true.
+     */
+    bool run(std::function<bool()> done, time_point t);
+
+private:
+    SimulatedNetwork(const SimulatedNetwork&) = delete;
+    SimulatedNetwork& operator=(const SimulatedNetwork&) = delete;
+
+    class NodeTransport;
+
+    struct SimNode {
+        std::unique_ptr<Dht> dht;
+        sockaddr_in addr;
+        bool online {true};
+        time_point wakeup {time_point::min()};
+        time_point churn_time {time_point::max()};
+        /** When the upload link of the node is available */
+        time_point link_free {time_point::min()};
+        Traffic traffic {};
+    };
+
+    struct Packet {
+        size_t from;
+        size_t to;
+        Blob data;
+    };
+
+    /** Events are (time, node index) */
+    using Event = std::pair<time_point, size_t>;
+    using EventQueue = std::priority_queue<Event, std::vector<Event>, std::greater<Event>>;
+
+    int send(size_t from, const uint8_t* buf, size_t len, const sockaddr* to, socklen_t tolen);
+    void schedule(size_t i, time_point t);
+    void scheduleChurn(size_t i, time_point now);
+    time_point nextEvent() const;
+    void runNode(size_t i, const uint8_t* buf, size_t len, const sockaddr* from, socklen_t fromlen);
+    void runEvent();
+
+    const Config config_;
+    std::mt19937_64 rd_;
+    time_point now_;
+    std::vector<std::unique_ptr<SimNode>> nodes_ {};
+    /** Messages in flight, by delivery time */
+    std::multimap<time_point, Packet> packets_ {};
+    /** Node wake-up times; stale entries are skipped */
+    EventQueue wakeups_ {};
+    EventQueue churn_ {};
+};
+
+}
@@ -0,0 +1,119 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#pragma once
+
+#include "utils.h"
+
+#include <functional>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <queue>
+#include <vector>
+#include <string>
+
+namespace dht {
+
+/**
+ * A pool of worker threads, used to run expensive tasks
+ * (like cryptographic operations) outside of the DHT thread.
+ *
+ * Each task comes with a completion, queued once the task is done
+ * and executed by the owner thread when calling runCompletions().
+ * Completions can thus safely access state that is not thread-safe.
+ */
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    struct Stats {
+        /** Tasks waiting for a worker */
+        size_t queued {0};
+        /** Completions waiting to be run by the owner thread */
+        size_t completions {0};
+        /** Total number of completed tasks */
+        size_t done {0};
+        /** Average and maximum time from submission to task completion */
+        duration avg_latency {0};
+        duration max_latency {0};
+
+        std::string toString() const;
+    };
+
+    /**
+     * @param threads: number of worker threads.
+     * @param notify: called from a worker thread when a completion is ready.
+     */
+    ThreadPool(unsigned threads, Task&& notify = {});
+
+    /**
+     * Stops the pool. Completions not run yet are dropped.
+     */
+    ~ThreadPool();
+
+    /**
+     * Run task on a worker thread, then queue completion.
+     * Once the pool is stopped, task is run on the calling thread.
+     */
+    void run(Task&& task, Task&& completion);
+
+    /**
+     * Run the tasks still queued, then stop the workers.
+     * Their completions can then be run by runCompletions().
+     */
+    void stop();
+
+    /**
+     * Run queued completions on the calling thread.
+     * @returns the number of completions executed.
+     */
+    size_t runCompletions();
+
+    bool hasCompletions() const;
+
+    void setNotify(Task&& notify);
+
+    Stats getStats() const;
+
+private:
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    struct Job {
+        Task task;
+        Task completion;
+        time_point submitted;
+    };
+
+    void work();
+
+    mutable std::mutex mtx_ {};
+    std::condition_variable cv_ {};
+    std::queue<Job> jobs_ {};
+    std::queue<Task> completions_ {};
+    std::vector<std::thread> threads_ {};
+    Task notify_ {};
+    bool running_ {true};
+
+    size_t done_ {0};
+    duration total_latency_ {0};
+    duration max_latency_ {0};
+};
+
+}
@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#else
+#include <ws2tcpip.h>
+typedef uint16_t sa_family_t;
+#endif
+
+namespace dht {
+
+/**
+ * Sends the datagrams of a Dht node.
+ *
+ * Received datagrams are given by the owner of the transport
+ * to Dht::periodic.
+ */
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    /**
+     * Send a datagram to the address to.
+     * @returns the number of bytes sent, or -1 on error.
+     */
+    virtual int send(const uint8_t* buf, size_t len, int flags, const sockaddr* to, socklen_t tolen) = 0;
+
+    /**
+     * True if datagrams can be sent to the address family af,
+     * or to any address family if af is 0.
+     */
+    virtual bool supports(sa_family_t af = 0) const = 0;
+};
+
+/**
+ * Transport over bound UDP sockets.
+ * The sockets are set to non-blocking mode, and are not closed
+ * by the transport.
+ */
+class UdpTransport : public Transport {
+public:
+    /**
+     * s, s6: bound socket descriptors for IPv4 and IPv6, respectively,
+     *        or -1 for unsupported families.
+     * Throws DhtException if the sockets can't be set to non-blocking mode.
+     */
+    UdpTransport(int s, int s6);
+
+    int send(const uint8_t* buf, size_t len, int flags, const sockaddr* to, socklen_t tolen);
+    bool supports(sa_family_t af = 0) const;
+
+private:
+    const int s_;
+    const int s6_;
+};
+
+}
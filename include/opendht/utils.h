@@ -21,12 +21,24 @@
 
 #include <msgpack.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <random>
 #include <functional>
+#include <memory>
+#include <stdexcept>
 
 #include <cstdarg>
 
+// Marks deprecated API, kept for compatibility
+#if defined(__GNUC__) || defined(__clang__)
+#define OPENDHT_DEPRECATED __attribute__((deprecated))
+#elif defined(_MSC_VER)
+#define OPENDHT_DEPRECATED __declspec(deprecated)
+#else
+#define OPENDHT_DEPRECATED
+#endif
+
 namespace dht {
 
 class DhtException : public std::runtime_error {
@@ -42,8 +54,14 @@ using clock = std::chrono::steady_clock;
 using time_point = clock::time_point;
 using duration = clock::duration;
 
-time_point from_time_t(std::time_t t);
-std::time_t to_time_t(time_point t);
+/**
+ * Convert between system time and time points,
+ * now being the current time on the clock of the time points.
+ */
+time_point from_time_t(std::time_t t, time_point now);
+std::time_t to_time_t(time_point t, time_point now);
+inline time_point from_time_t(std::time_t t) { return from_time_t(t, clock::now()); }
+inline std::time_t to_time_t(time_point t) { return to_time_t(t, clock::now()); }
 
 static /*constexpr*/ const time_point TIME_INVALID = {time_point::min()};
 static /*constexpr*/ const time_point TIME_MAX {time_point::max()};
@@ -101,27 +119,147 @@ private:
 
 typedef std::vector<uint8_t> Blob;
 
+/**
+ * Immutable, reference-counted bytes.
+ *
+ * Copies and slices share the same storage, which is freed with the last
+ * of them: a payload can be allocated once, in a received packet for instance,
+ * and then shared instead of copied.
+ * Converts from and to Blob, the conversion to Blob copying the bytes.
+ */
+class SharedBlob {
+public:
+    using value_type = uint8_t;
+    using const_iterator = const uint8_t*;
+    using iterator = const_iterator;
+
+    SharedBlob() {}
+    SharedBlob(Blob&& b) : SharedBlob(std::make_shared<const Blob>(std::move(b))) {}
+    SharedBlob(const Blob& b) : SharedBlob(Blob(b)) {}
+    SharedBlob(const uint8_t* dat, size_t dat_size) : SharedBlob(Blob(dat, dat+dat_size)) {}
+    template <typename Iterator>
+    SharedBlob(const Iterator& begin, const Iterator& end) : SharedBlob(Blob(begin, end)) {}
+    SharedBlob(std::shared_ptr<const Blob> storage)
+     : storage_(std::move(storage)), data_(storage_->data()), size_(storage_->size()) {}
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const_iterator begin() const { return data_; }
+    const_iterator end() const { return data_ + size_; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    const uint8_t& operator[](size_t i) const { return data_[i]; }
+
+    /**
+     * Bytes [offset, offset+len), sharing the storage.
+     * Throws std::out_of_range if they are not all in this blob.
+     */
+    SharedBlob slice(size_t offset, size_t len) const {
+        if (offset > size_ or len > size_ - offset)
+            throw std::out_of_range("SharedBlob::slice");
+        SharedBlob ret {*this};
+        ret.data_ += offset;
+        ret.size_ = len;
+        return ret;
+    }
+
+    /**
+     * Slice of the bytes at [dat, dat+dat_size) if they are in this blob,
+     * or else a new blob with a copy of them.
+     */
+    SharedBlob share(const uint8_t* dat, size_t dat_size) const {
+        if (data_ and dat >= data_ and dat_size <= size_ and dat <= data_ + (size_ - dat_size))
+            return slice(dat - data_, dat_size);
+        return {dat, dat_size};
+    }
+
+    /** Copy of the bytes */
+    Blob toBlob() const {
+        return {begin(), end()};
+    }
+    operator Blob() const {
+        return toBlob();
+    }
+
+    bool operator==(const SharedBlob& o) const {
+        return size_ == o.size_ and (data_ == o.data_ or std::equal(begin(), end(), o.begin()));
+    }
+    bool operator!=(const SharedBlob& o) const {
+        return not (*this == o);
+    }
+
+private:
+    std::shared_ptr<const Blob> storage_ {};
+    const uint8_t* data_ {nullptr};
+    size_t size_ {0};
+};
+
 /**
  * Provides backward compatibility with msgpack 1.0
  */
 Blob unpackBlob(msgpack::object& o);
 
+/**
+ * Like unpackBlob, but binary and string objects referencing the bytes
+ * of source (see unpackMsgNoCopy) are sliced from it instead of copied.
+ */
+SharedBlob unpackSharedBlob(const msgpack::object& o, const SharedBlob& source);
+
+/**
+ * msgpack output stream appending to a Blob,
+ * to serialize without an intermediate buffer.
+ */
+struct BlobWriter {
+    BlobWriter(Blob& b) : blob(b) {}
+    void write(const char* buf, size_t len) {
+        blob.insert(blob.end(), (const uint8_t*)buf, (const uint8_t*)buf+len);
+    }
+    Blob& blob;
+};
+
 template <typename Type>
 Blob
 packMsg(const Type& t) {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    Blob ret;
+    BlobWriter writer(ret);
+    msgpack::packer<BlobWriter> pk(&writer);
     pk.pack(t);
-    return {buffer.data(), buffer.data()+buffer.size()};
+    return ret;
 }
 
+/**
+ * Unpack msgpack data without copying strings and binary objects:
+ * the resulting objects reference data, which must outlive them.
+ */
+msgpack::unpacked unpackMsgNoCopy(const uint8_t* data, size_t size);
+
 template <typename Type>
 Type
-unpackMsg(Blob b) {
-    msgpack::unpacked msg_res = msgpack::unpack((const char*)b.data(), b.size());
+unpackMsg(const Blob& b) {
+    msgpack::unpacked msg_res = unpackMsgNoCopy(b.data(), b.size());
     return msg_res.get().as<Type>();
 }
 
-msgpack::unpacked unpackMsg(Blob b);
+template <typename Type>
+Type
+unpackMsg(const SharedBlob& b) {
+    msgpack::unpacked msg_res = unpackMsgNoCopy(b.data(), b.size());
+    return msg_res.get().as<Type>();
+}
+
+msgpack::unpacked unpackMsg(const Blob& b);
+
+/**
+ * Write the n least significant bytes of v to dst, most significant first.
+ */
+void writeBE(uint8_t* dst, uint64_t v, size_t n);
+
+/**
+ * Read a big-endian unsigned integer of n bytes from src.
+ */
+uint64_t readBE(const uint8_t* src, size_t n);
 
 }
@@ -111,6 +111,9 @@ struct ValueType {
     duration expiration {60 * 60};
     StorePolicy storePolicy {DEFAULT_STORE_POLICY};
     EditPolicy editPolicy {DEFAULT_EDIT_POLICY};
+
+    /** Maximum bytes of values of this type stored by a node (0 for no specific limit) */
+    size_t max_store_size {0};
 };
 
 /**
@@ -180,7 +183,7 @@ struct Value
     {
         virtual const ValueType& getType() const = 0;
         virtual void unpackValue(const Value& v) {
-            auto msg = msgpack::unpack((const char*)v.data.data(), v.data.size());
+            auto msg = unpackMsgNoCopy(v.data.data(), v.data.size());
             msgpack::object obj = msg.get();
             obj.convert(static_cast<T*>(this));
         }
@@ -228,6 +231,15 @@ struct Value
         return not signature.empty();
     }
 
+    /**
+     * Approximate number of bytes held by the value.
+     * Memoized encodings are not counted, so that the size
+     * doesn't depend on whether the value is memoized.
+     */
+    size_t size() const {
+        return data.size() + cypher.size() + signature.size() + user_type.size();
+    }
+
     Value() {}
 
     Value (Id id) : id(id) {}
@@ -237,8 +249,10 @@ struct Value
      : id(id), type(t), data(data) {}
     Value(ValueType::Id t, Blob&& data, Id id = INVALID_ID)
      : id(id), type(t), data(std::move(data)) {}
+    Value(ValueType::Id t, const SharedBlob& data, Id id = INVALID_ID)
+     : id(id), type(t), data(data) {}
     Value(ValueType::Id t, const uint8_t* dat_ptr, size_t dat_len, Id id = INVALID_ID)
-     : id(id), type(t), data(dat_ptr, dat_ptr+dat_len) {}
+     : id(id), type(t), data(dat_ptr, dat_len) {}
     
     template <typename Type>
     Value(ValueType::Id t, const Type& d, Id id = INVALID_ID)
@@ -251,11 +265,21 @@ struct Value
     /** Custom user data constructor */
     Value(const Blob& userdata) : data(userdata) {}
     Value(Blob&& userdata) : data(std::move(userdata)) {}
-    Value(const uint8_t* dat_ptr, size_t dat_len) : data(dat_ptr, dat_ptr+dat_len) {}
+    Value(const SharedBlob& userdata) : data(userdata) {}
+    Value(const uint8_t* dat_ptr, size_t dat_len) : data(dat_ptr, dat_len) {}
 
     Value(Value&& o) noexcept
      : id(o.id), owner(std::move(o.owner)), recipient(o.recipient),
-     type(o.type), data(std::move(o.data)), user_type(std::move(o.user_type)), seq(o.seq), signature(std::move(o.signature)), cypher(std::move(o.cypher)) {}
+     type(o.type), data(std::move(o.data)), user_type(std::move(o.user_type)), seq(o.seq), signature(std::move(o.signature)), cypher(std::move(o.cypher)),
+     toSign_(std::move(o.toSign_)), toEncrypt_(std::move(o.toEncrypt_)) {}
+
+    /**
+     * Copies are not memoized, even if o is:
+     * their fields can be modified without calling invalidate().
+     */
+    Value(const Value& o)
+     : id(o.id), owner(o.owner), recipient(o.recipient),
+     type(o.type), data(o.data), user_type(o.user_type), seq(o.seq), signature(o.signature), cypher(o.cypher) {}
 
     template <typename Type>
     Value(const Type& vs)
@@ -265,6 +289,14 @@ struct Value
         msgpack_unpack(o);
     }
 
+    /**
+     * Unpack a value from o, unpacked from source with unpackMsgNoCopy:
+     * the payload is sliced from source instead of copied.
+     */
+    Value(const msgpack::object& o, const SharedBlob& source) {
+        msgpack_unpack(o, source);
+    }
+
     inline bool operator== (const Value& o) {
         return id == o.id &&
         (isEncrypted() ? cypher == o.cypher :
@@ -273,30 +305,46 @@ struct Value
 
     void setRecipient(const InfoHash& r) {
         recipient = r;
+        invalidate();
     }
 
     void setCypher(Blob&& c) {
         cypher = std::move(c);
+        invalidate();
     }
 
     /**
-     * Pack part of the data to be signed (must always be done the same way)
+     * Pack part of the data to be signed (must always be done the same way).
+     * The memoized encoding is used if any.
      */
-    Blob getToSign() const {
-        msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
-        msgpack_pack_to_sign(pk);
-        return {buffer.data(), buffer.data()+buffer.size()};
+    Blob getToSign() const;
+
+    /**
+     * Pack part of the data to be encrypted,
+     * which is also the serialized value data.
+     * The memoized encoding is used if any.
+     */
+    Blob getToEncrypt() const;
+
+    /**
+     * Compute the encodings again and keep them, to be reused by signature
+     * checks and serialization until the next call to invalidate().
+     * Done by Dht::put for announced values, which are sent many times:
+     * fields must not be modified afterwards without calling invalidate().
+     */
+    void memoize() {
+        invalidate();
+        std::atomic_store(&toSign_, packToSign());
+        std::atomic_store(&toEncrypt_, packToEncrypt());
     }
 
     /**
-     * Pack part of the data to be encrypted
+     * Drop memoized encodings.
+     * Must be called after modifying fields of a memoized value.
      */
-    Blob getToEncrypt() const {
-        msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
-        msgpack_pack_to_encrypt(pk);
-        return {buffer.data(), buffer.data()+buffer.size()};
+    void invalidate() {
+        std::atomic_store(&toSign_, std::shared_ptr<const Blob>());
+        std::atomic_store(&toEncrypt_, std::shared_ptr<const Blob>());
     }
 
     /** print value for debugging */
@@ -348,11 +396,16 @@ struct Value
     {
         pk.pack_map(2);
         pk.pack(std::string("id"));  pk.pack(id);
-        pk.pack(std::string("dat")); msgpack_pack_to_encrypt(pk);
+        pk.pack(std::string("dat"));
+        // The memoized encoding is appended as is.
+        if (auto dat = std::atomic_load(&toEncrypt_))
+            pk.pack_bin_body((const char*)dat->data(), dat->size());
+        else
+            msgpack_pack_to_encrypt(pk);
     }
 
-    void msgpack_unpack(msgpack::object o);
-    void msgpack_unpack_body(const msgpack::object& o);
+    void msgpack_unpack(msgpack::object o, const SharedBlob& source = {});
+    void msgpack_unpack_body(const msgpack::object& o, const SharedBlob& source = {});
 
     Id id {INVALID_ID};
 
@@ -372,7 +425,12 @@ struct Value
      * Type of data.
      */
     ValueType::Id type {ValueType::USER_DATA.id};
-    Blob data {};
+
+    /**
+     * Payload, immutable and shared by the copies of the value.
+     * Replaced by assigning it a new Blob.
+     */
+    SharedBlob data {};
 
     /**
      * Custom user-defined type
@@ -393,6 +451,20 @@ struct Value
      * Hold encrypted version of the data.
      */
     Blob cypher {};
+
+private:
+    /* The memoized encoding if any, or a new one */
+    std::shared_ptr<const Blob> packToSign() const;
+    std::shared_ptr<const Blob> packToEncrypt() const;
+
+    /**
+     * Memoized encodings, accessed atomically:
+     * values can be checked concurrently from crypto worker threads.
+     * Readers keep their own reference, so invalidate() can't free
+     * an encoding being used.
+     */
+    mutable std::shared_ptr<const Blob> toSign_ {};
+    mutable std::shared_ptr<const Blob> toEncrypt_ {};
 };
 
 template <typename T,
@@ -0,0 +1,210 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#pragma once
+
+#include "infohash.h"
+#include "value.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace dht {
+
+/**
+ * Storage backend for the values stored by a Dht node.
+ *
+ * The Dht keeps stored values in memory and reports every change
+ * to the backend, which can persist them. Values held by the backend
+ * are loaded when the Dht starts.
+ */
+class ValueStore {
+public:
+    using LoadCallback = std::function<void(const InfoHash& key, std::shared_ptr<Value> value, time_point created)>;
+
+    virtual ~ValueStore() {}
+
+    /** A value was stored or replaced */
+    virtual void store(const InfoHash& key, const Value& value, time_point created) = 0;
+
+    /** A stored value was announced again */
+    virtual void refresh(const InfoHash& key, Value::Id id, time_point created) = 0;
+
+    /** A stored value was removed */
+    virtual void remove(const InfoHash& key, Value::Id id) = 0;
+
+    /** Provide every value held by the backend */
+    virtual void load(LoadCallback cb) = 0;
+
+    /**
+     * Write pending changes.
+     * Called periodically by the Dht: unless force is true,
+     * backends may wait for more changes to write them in a batch.
+     * @returns the time before which sync should be called again.
+     */
+    virtual time_point sync(bool /*force*/ = false) { return time_point::max(); }
+};
+
+/**
+ * Disk-backed value store.
+ *
+ * Changes are appended to a log file (path), which serves as the
+ * write-ahead log: writes are batched and followed by a fsync at most
+ * every SYNC_PERIOD, or when MAX_PENDING_SIZE bytes are waiting.
+ * Batches are written, synced and the log compacted by a thread of the
+ * store, so that the Dht doesn't wait for the disk. A batch that can't be
+ * fully written is truncated from the log and written again later.
+ * An index of the latest record of every value is kept in memory and
+ * rebuilt by scanning the log on startup; a torn record at the end of the
+ * log, left by a crash, is dropped. The log is compacted when most of it
+ * holds outdated records.
+ */
+class LogValueStore : public ValueStore {
+public:
+    /**
+     * Open or create the log at path.
+     * time_source is the clock of the creation times (empty for the system clock).
+     * Throws DhtException if the log can't be opened.
+     */
+    LogValueStore(const std::string& path, std::function<time_point()> time_source = {});
+    ~LogValueStore();
+
+    /**
+     * A value already held with the same sequence number (if signed)
+     * or the same data is only refreshed.
+     */
+    void store(const InfoHash& key, const Value& value, time_point created);
+    void refresh(const InfoHash& key, Value::Id id, time_point created);
+    void remove(const InfoHash& key, Value::Id id);
+    void load(LoadCallback cb);
+
+    /**
+     * Hand pending records to the writer thread.
+     * With force, also wait for them to be written.
+     * Throws DhtException if the writer thread failed to write since the last call.
+     */
+    time_point sync(bool force = false);
+
+    /** Number of values held */
+    size_t size() const {
+        return index_.size();
+    }
+
+    static constexpr std::chrono::seconds SYNC_PERIOD {1};
+    static constexpr size_t MAX_PENDING_SIZE {1024 * 1024};
+    /** The log is not compacted below this size */
+    static constexpr uint64_t MIN_COMPACT_SIZE {1024 * 1024 * 4};
+
+private:
+    LogValueStore(const LogValueStore&) = delete;
+    LogValueStore& operator=(const LogValueStore&) = delete;
+
+    using Key = std::pair<InfoHash, Value::Id>;
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            return std::hash<InfoHash>()(k.first) ^ std::hash<Value::Id>()(k.second);
+        }
+    };
+
+    /** Latest stored version of a value */
+    struct Entry {
+        uint64_t offset;        // position of the value data in the log
+        uint32_t size;          // size of the value data
+        std::time_t created;
+        uint32_t hash;          // hash of the value data
+        int32_t seq;            // sequence number of a signed value, -1 if unknown
+    };
+    using Index = std::unordered_map<Key, Entry, KeyHash>;
+
+    /**
+     * Work of the writer thread: records to append, or a compaction
+     * of the log from a copy of the index.
+     */
+    struct Job {
+        Blob records {};
+        std::unique_ptr<Index> compact {};
+        /** Size of the log when the compaction was requested */
+        uint64_t log_size {0};
+    };
+
+    /** Result of a compaction, applied to the index by sync() */
+    struct Compaction {
+        uint64_t old_size {0};
+        uint64_t new_size {0};
+        /** New offset of the records copied, by old offset */
+        std::unordered_map<uint64_t, uint64_t> moved {};
+    };
+
+    void recover();
+    void append(uint8_t op, const Key& key, std::time_t created, const Blob& data = {});
+    Blob read(std::FILE* f, const Entry& e) const;
+    void openLog();
+
+    /* Called by the writer thread */
+    void work();
+    bool writeRecords(const Blob& records);
+    Compaction compact(const Index& index);
+
+    /* Called by sync() */
+    void applyCompaction(const Compaction& c);
+
+    time_point now() const {
+        return time_source_ ? time_source_() : clock::now();
+    }
+
+    const std::string path_;
+    const std::function<time_point()> time_source_;
+    Index index_ {};
+
+    /** Records waiting to be handed to the writer thread */
+    Blob pending_ {};
+    /** Size of the log, including pending records */
+    uint64_t log_size_ {0};
+    /** Size of the records of the index entries */
+    uint64_t live_size_ {0};
+    time_point last_sync_ {};
+    bool compacting_ {false};
+
+    /* Shared with the writer thread */
+    std::mutex mtx_ {};
+    std::condition_variable cv_ {};
+    std::condition_variable done_cv_ {};
+    std::deque<Job> jobs_ {};
+    std::unique_ptr<Compaction> compacted_ {};
+    bool compact_failed_ {false};
+    std::string error_ {};
+    bool stop_ {false};
+    /** A job is being run by the writer thread */
+    bool busy_ {false};
+
+    /* Owned by the writer thread once started */
+    std::FILE* log_ {nullptr};
+    /** Size of the log written and synced */
+    uint64_t synced_size_ {0};
+    std::thread writer_ {};
+};
+
+}
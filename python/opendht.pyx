@@ -121,7 +121,8 @@ cdef class Node(_WithID):
     def getAddr(self):
         return self._node.get().getAddrStr()
     def isExpired(self):
-        return self._node.get().isExpired()
+        # Nodes come from a DhtRunner, which uses the system clock.
+        return self._node.get().isExpired(cpp.clock_now())
 
 cdef class NodeEntry(_WithID):
     cdef cpp.pair[cpp.InfoHash, cpp.shared_ptr[cpp.Node]] _v
@@ -152,11 +153,13 @@ cdef class Value(object):
             return h
         def __set__(self, InfoHash h):
             self._value.get().recipient = h._infohash
+            self._value.get().invalidate()
     property data:
         def __get__(self):
             return string(<char*>self._value.get().data.data(), self._value.get().data.size())
         def __set__(self, bytes value):
             self._value.get().data = value
+            self._value.get().invalidate()
 
 cdef class NodeSetIter(object):
     cdef map[cpp.InfoHash, cpp.shared_ptr[cpp.Node]]* _nodes
@@ -77,13 +77,19 @@ cdef extern from "opendht/value.h" namespace "dht":
         InfoHash recipient
         vector[uint8_t] data
         string user_type
+        void invalidate()
+
+cdef extern from "opendht/utils.h":
+    cdef cppclass time_point "dht::time_point":
+        pass
+    time_point clock_now "dht::clock::now"()
 
 cdef extern from "opendht/dht.h" namespace "dht":
     cdef cppclass Node:
         Node() except +
         InfoHash getId() const
         string getAddrStr() const
-        bool isExpired() const
+        bool isExpired(time_point now) const
     ctypedef void (*ShutdownCallbackRaw)(void *user_data)
     ctypedef bool (*GetCallbackRaw)(shared_ptr[Value] values, void *user_data)
     ctypedef void (*DoneCallbackRaw)(bool done, vector[shared_ptr[Node]]* nodes, void *user_data)
@@ -0,0 +1,150 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#include "capture.h"
+
+#include <array>
+#include <cstring>
+
+namespace dht {
+
+static constexpr std::array<char, 8> CAPTURE_MAGIC {{'D', 'H', 'T', 'C', 'A', 'P', 'T', 'R'}};
+static constexpr uint32_t CAPTURE_VERSION {1};
+static constexpr size_t CAPTURE_HEADER_SIZE {CAPTURE_MAGIC.size() + 4 + HASH_LEN};
+// Record: time since the start of the capture in nanoseconds (64 bits),
+// address family (4 or 6), address, port (network order),
+// datagram size (32 bits), datagram.
+static constexpr size_t RECORD_MAX_HEADER_SIZE {8 + 1 + 16 + 2 + 4};
+// Larger than any datagram
+static constexpr uint32_t MAX_PACKET_SIZE {64 * 1024};
+
+CaptureWriter::CaptureWriter(const std::string& path, const InfoHash& node_id)
+ : path_(path), file_(std::fopen(path.c_str(), "wb")), start_(clock::now())
+{
+    if (not file_)
+        throw DhtException("Can't create capture file " + path);
+    std::array<uint8_t, CAPTURE_HEADER_SIZE> header;
+    std::copy(CAPTURE_MAGIC.begin(), CAPTURE_MAGIC.end(), header.begin());
+    writeBE(header.data() + CAPTURE_MAGIC.size(), CAPTURE_VERSION, 4);
+    std::copy(node_id.begin(), node_id.end(), header.begin() + CAPTURE_MAGIC.size() + 4);
+    if (std::fwrite(header.data(), 1, header.size(), file_) != header.size()) {
+        std::fclose(file_);
+        throw DhtException("Can't write capture file " + path);
+    }
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    std::fclose(file_);
+}
+
+void
+CaptureWriter::write(time_point t, const uint8_t* buf, size_t len, const sockaddr* from, socklen_t fromlen)
+{
+    if (len > MAX_PACKET_SIZE)
+        return;
+    std::array<uint8_t, RECORD_MAX_HEADER_SIZE> header;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t - start_).count();
+    writeBE(header.data(), std::max<int64_t>(ns, 0), 8);
+    size_t pos = 8;
+    if (from->sa_family == AF_INET and fromlen >= sizeof(sockaddr_in)) {
+        auto sin = (const sockaddr_in*)from;
+        header[pos++] = 4;
+        std::copy_n((const uint8_t*)&sin->sin_addr, 4, header.begin() + pos);
+        std::copy_n((const uint8_t*)&sin->sin_port, 2, header.begin() + pos + 4);
+        pos += 6;
+    } else if (from->sa_family == AF_INET6 and fromlen >= sizeof(sockaddr_in6)) {
+        auto sin6 = (const sockaddr_in6*)from;
+        header[pos++] = 6;
+        std::copy_n((const uint8_t*)&sin6->sin6_addr, 16, header.begin() + pos);
+        std::copy_n((const uint8_t*)&sin6->sin6_port, 2, header.begin() + pos + 16);
+        pos += 18;
+    } else
+        return;
+    writeBE(header.data() + pos, len, 4);
+    pos += 4;
+    if (std::fwrite(header.data(), 1, pos, file_) != pos
+     or std::fwrite(buf, 1, len, file_) != len)
+        throw DhtException("Can't write capture file " + path_);
+}
+
+void
+CaptureWriter::flush()
+{
+    if (std::fflush(file_) != 0)
+        throw DhtException("Can't write capture file " + path_);
+}
+
+CaptureReader::CaptureReader(const std::string& path) : file_(std::fopen(path.c_str(), "rb"))
+{
+    if (not file_)
+        throw DhtException("Can't open capture file " + path);
+    std::array<uint8_t, CAPTURE_HEADER_SIZE> header;
+    if (std::fread(header.data(), 1, header.size(), file_) != header.size()
+     or not std::equal(CAPTURE_MAGIC.begin(), CAPTURE_MAGIC.end(), (const char*)header.data())) {
+        std::fclose(file_);
+        throw DhtException("Not a capture file: " + path);
+    }
+    if (readBE(header.data() + CAPTURE_MAGIC.size(), 4) != CAPTURE_VERSION) {
+        std::fclose(file_);
+        throw DhtException("Unsupported capture file version: " + path);
+    }
+    std::copy_n(header.begin() + CAPTURE_MAGIC.size() + 4, HASH_LEN, node_id_.begin());
+}
+
+CaptureReader::~CaptureReader()
+{
+    std::fclose(file_);
+}
+
+bool
+CaptureReader::next(CapturedPacket& packet)
+{
+    std::array<uint8_t, RECORD_MAX_HEADER_SIZE> header;
+    if (std::fread(header.data(), 1, 9, file_) != 9)
+        return false;
+    packet.time = std::chrono::duration_cast<duration>(std::chrono::nanoseconds(readBE(header.data(), 8)));
+    auto family = header[8];
+    if (family != 4 and family != 6)
+        return false;
+    size_t addr_len = family == 4 ? 4 : 16;
+    if (std::fread(header.data() + 9, 1, addr_len + 2 + 4, file_) != addr_len + 2 + 4)
+        return false;
+    std::fill_n((uint8_t*)&packet.from, sizeof(packet.from), 0);
+    if (family == 4) {
+        auto sin = (sockaddr_in*)&packet.from;
+        sin->sin_family = AF_INET;
+        std::copy_n(header.begin() + 9, 4, (uint8_t*)&sin->sin_addr);
+        std::copy_n(header.begin() + 13, 2, (uint8_t*)&sin->sin_port);
+        packet.fromlen = sizeof(sockaddr_in);
+    } else {
+        auto sin6 = (sockaddr_in6*)&packet.from;
+        sin6->sin6_family = AF_INET6;
+        std::copy_n(header.begin() + 9, 16, (uint8_t*)&sin6->sin6_addr);
+        std::copy_n(header.begin() + 25, 2, (uint8_t*)&sin6->sin6_port);
+        packet.fromlen = sizeof(sockaddr_in6);
+    }
+    auto size = readBE(header.data() + 9 + addr_len + 2, 4);
+    if (size > MAX_PACKET_SIZE)
+        return false;
+    packet.data.resize(size);
+    return std::fread(packet.data.data(), 1, size, file_) == size;
+}
+
+}
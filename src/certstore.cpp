@@ -0,0 +1,316 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "certstore.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+
+namespace dht {
+
+constexpr size_t CertificateStore::MIN_COMPACT_ENTRIES;
+
+// Data file record: public key ID, certificate size (32 bits), certificate.
+static constexpr size_t RECORD_HEADER_SIZE {HASH_LEN + 4};
+// Index file entry: public key ID, record offset (64 bits).
+static constexpr size_t INDEX_ENTRY_SIZE {HASH_LEN + 8};
+// Sanity limit for a stored certificate chain.
+static constexpr uint32_t MAX_CERTIFICATE_SIZE {1024 * 1024};
+
+static void
+writeRecord(std::ostream& f, const InfoHash& id, const Blob& packed)
+{
+    std::array<uint8_t, RECORD_HEADER_SIZE> header;
+    std::copy(id.begin(), id.end(), header.begin());
+    writeBE(header.data() + HASH_LEN, packed.size(), 4);
+    f.write((const char*)header.data(), header.size());
+    f.write((const char*)packed.data(), packed.size());
+}
+
+static void
+writeIndexEntry(std::ostream& f, const InfoHash& id, uint64_t offset)
+{
+    std::array<uint8_t, INDEX_ENTRY_SIZE> entry;
+    std::copy(id.begin(), id.end(), entry.begin());
+    writeBE(entry.data() + HASH_LEN, offset, 8);
+    f.write((const char*)entry.data(), entry.size());
+}
+
+CertificateStore::CertificateStore(const std::string& path)
+ : path_(path), index_path_(path + ".idx")
+{
+    load();
+    writer_ = std::thread(&CertificateStore::work, this);
+}
+
+CertificateStore::~CertificateStore()
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    // Queued certificates are written first.
+    writer_.join();
+}
+
+void
+CertificateStore::load()
+{
+    std::ifstream f(index_path_, std::ios::binary);
+    std::array<uint8_t, INDEX_ENTRY_SIZE> entry;
+    while (f.read((char*)entry.data(), entry.size())) {
+        InfoHash id;
+        std::copy_n(entry.begin(), HASH_LEN, id.begin());
+        index_[id] = readBE(entry.data() + HASH_LEN, 8);
+        index_entries_++;
+    }
+    // A trailing partial entry (interrupted write) is dropped by compaction,
+    // so that the next entries stay aligned.
+    torn_ = f.gcount() != 0;
+}
+
+Blob
+CertificateStore::read(uint64_t offset, const InfoHash& pk_id) const
+{
+    std::ifstream f(path_, std::ios::binary);
+    if (not f.seekg(offset))
+        throw DhtException("Can't read certificate store");
+    std::array<uint8_t, RECORD_HEADER_SIZE> header;
+    if (not f.read((char*)header.data(), header.size()))
+        throw DhtException("Can't read certificate store");
+    if (not std::equal(pk_id.begin(), pk_id.end(), header.begin()))
+        throw DhtException("Corrupted certificate store");
+    auto size = readBE(header.data() + HASH_LEN, 4);
+    if (size > MAX_CERTIFICATE_SIZE)
+        throw DhtException("Corrupted certificate store");
+    Blob ret(size);
+    if (not f.read((char*)ret.data(), ret.size()))
+        throw DhtException("Can't read certificate store");
+    return ret;
+}
+
+std::vector<std::shared_ptr<crypto::Certificate>>
+CertificateStore::query(const InfoHash& pk_id)
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    try {
+        while (true) {
+            auto p = pending_.find(pk_id);
+            if (p != pending_.end())
+                return {std::make_shared<crypto::Certificate>(p->second)};
+            auto it = index_.find(pk_id);
+            if (it == index_.end())
+                return {};
+            auto offset = it->second;
+            auto generation = generation_;
+
+            // The file is read without the lock: records are checked against
+            // their key, and read again if the files were compacted meanwhile.
+            lck.unlock();
+            Blob packed;
+            try {
+                packed = read(offset, pk_id);
+            } catch (const std::exception& e) {
+                lck.lock();
+                if (generation_ != generation)
+                    continue;
+                throw;
+            }
+            return {std::make_shared<crypto::Certificate>(packed)};
+        }
+    } catch (const std::exception& e) {
+        return {};
+    }
+}
+
+void
+CertificateStore::store(const crypto::Certificate& crt)
+{
+    auto packed = crt.getPacked();
+    if (packed.empty() or packed.size() > MAX_CERTIFICATE_SIZE)
+        throw DhtException("Can't store certificate");
+    std::lock_guard<std::mutex> lck(mtx_);
+    pending_[crt.getId()] = std::move(packed);
+    cv_.notify_all();
+    if (not error_.empty()) {
+        auto error = std::move(error_);
+        error_.clear();
+        throw DhtException(error);
+    }
+}
+
+void
+CertificateStore::flush()
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    done_cv_.wait(lck, [this]() { return pending_.empty() and not busy_; });
+}
+
+size_t
+CertificateStore::size()
+{
+    std::lock_guard<std::mutex> lck(mtx_);
+    size_t n = index_.size();
+    for (const auto& p : pending_)
+        if (index_.find(p.first) == index_.end())
+            n++;
+    return n;
+}
+
+void
+CertificateStore::work()
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    while (true) {
+        cv_.wait(lck, [this]() { return stop_ or not pending_.empty(); });
+        if (pending_.empty())
+            return;
+        if (torn_ or index_entries_ > 2 * index_.size() + MIN_COMPACT_ENTRIES) {
+            try {
+                compact(lck);
+            } catch (const std::exception& e) {
+                error_ = e.what();
+            }
+            torn_ = false;
+        }
+
+        // The certificate stays pending, and can be queried, until written.
+        auto id = pending_.begin()->first;
+        auto packed = pending_.begin()->second;
+        auto it = index_.find(id);
+        bool known = it != index_.end();
+        uint64_t offset = known ? it->second : 0;
+        busy_ = true;
+        lck.unlock();
+
+        bool written = false;
+        std::string error;
+        try {
+            bool same = false;
+            if (known) {
+                try {
+                    same = read(offset, id) == packed;
+                } catch (const std::exception& e) {}
+            }
+            if (not same) {
+                offset = append(id, packed);
+                written = true;
+            }
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+
+        lck.lock();
+        busy_ = false;
+        if (written) {
+            index_[id] = offset;
+            index_entries_++;
+        }
+        if (not error.empty())
+            error_ = error;
+        // Unless replaced meanwhile
+        auto p = pending_.find(id);
+        if (p != pending_.end() and p->second == packed)
+            pending_.erase(p);
+        done_cv_.notify_all();
+    }
+}
+
+uint64_t
+CertificateStore::append(const InfoHash& id, const Blob& packed)
+{
+    // The record is written before its index entry,
+    // so that the index never points to missing data.
+    uint64_t offset;
+    {
+        std::ofstream f(path_, std::ios::binary | std::ios::app);
+        if (not f)
+            throw DhtException("Can't open certificate store");
+        f.seekp(0, std::ios::end);
+        offset = f.tellp();
+        writeRecord(f, id, packed);
+        if (not f.flush())
+            throw DhtException("Can't write certificate store");
+    }
+    {
+        std::ofstream f(index_path_, std::ios::binary | std::ios::app);
+        writeIndexEntry(f, id, offset);
+        if (not f.flush())
+            throw DhtException("Can't write certificate store index");
+    }
+    return offset;
+}
+
+void
+CertificateStore::compact(std::unique_lock<std::mutex>& lck)
+{
+    // Only the writer thread modifies the index and the files:
+    // they can be read without the lock until the new files replace them.
+    busy_ = true;
+    lck.unlock();
+    std::map<InfoHash, uint64_t> index;
+    const auto tmp_path = path_ + ".tmp";
+    const auto tmp_index_path = index_path_ + ".tmp";
+    bool ok;
+    {
+        std::ofstream data(tmp_path, std::ios::binary | std::ios::trunc);
+        std::ofstream idx(tmp_index_path, std::ios::binary | std::ios::trunc);
+        uint64_t offset = 0;
+        for (const auto& e : index_) {
+            Blob packed;
+            try {
+                packed = read(e.second, e.first);
+            } catch (const std::exception&) {
+                continue;
+            }
+            writeRecord(data, e.first, packed);
+            writeIndexEntry(idx, e.first, offset);
+            index[e.first] = offset;
+            offset += RECORD_HEADER_SIZE + packed.size();
+        }
+        ok = data.flush() and idx.flush();
+    }
+    lck.lock();
+    busy_ = false;
+    if (not ok) {
+        std::remove(tmp_path.c_str());
+        std::remove(tmp_index_path.c_str());
+        throw DhtException("Can't compact certificate store");
+    }
+    // Queries reading the old files meanwhile read them again.
+    generation_++;
+#ifdef _WIN32
+    std::remove(path_.c_str());
+    std::remove(index_path_.c_str());
+#endif
+    if (std::rename(tmp_path.c_str(), path_.c_str()) != 0
+     or std::rename(tmp_index_path.c_str(), index_path_.c_str()) != 0) {
+        // Records are checked against their key when read.
+        index_.clear();
+        index_entries_ = 0;
+        load();
+        throw DhtException("Can't compact certificate store");
+    }
+    index_ = std::move(index);
+    index_entries_ = index_.size();
+}
+
+}
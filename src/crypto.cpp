@@ -24,14 +24,19 @@ extern "C" {
 #include <gnutls/gnutls.h>
 #include <gnutls/abstract.h>
 #include <gnutls/x509.h>
+#include <gnutls/crypto.h>
 #include <nettle/gcm.h>
 #include <nettle/aes.h>
+#include <nettle/curve25519.h>
 }
 
 #include <random>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 #include <cassert>
+#include <mutex>
+#include <map>
 
 static std::uniform_int_distribution<uint8_t> rand_byte;
 
@@ -99,6 +104,18 @@ bool aesKeySizeGood(size_t key_size)
 #define GCM_DIGEST_SIZE GCM_BLOCK_SIZE
 #endif
 
+// Certificate extension holding the X25519 public key used for hybrid encryption.
+static constexpr const char* ENCRYPTION_KEY_OID = "2.25.2617156967431761569";
+
+// Prefix of hybrid-encrypted data, used to tell it apart from RSA-encrypted data.
+static constexpr std::array<uint8_t, 4> EC_CYPHER_MAGIC {{'d', 'h', 'e', 1}};
+static constexpr size_t EC_CYPHER_HEADER_SIZE = EC_CYPHER_MAGIC.size() + CURVE25519_SIZE;
+
+// Prefix of multi-recipient encrypted data.
+static constexpr std::array<uint8_t, 4> MULTI_CYPHER_MAGIC {{'d', 'h', 'm', 1}};
+
+static const std::string EC_SECRET_LABEL {"opendht x25519 secret"};
+
 Blob
 aesEncrypt(const Blob& data, const Blob& key)
 {
@@ -155,6 +172,156 @@ aesDecrypt(const Blob& data, const Blob& key)
     return ret;
 }
 
+/**
+ * Derive the AES-256 key from the X25519 shared secret,
+ * binding it to both public keys.
+ */
+static Blob
+ecDeriveKey(const uint8_t* shared, const uint8_t* ephemeral_pk, const uint8_t* recipient_pk)
+{
+    std::array<uint8_t, 3 * CURVE25519_SIZE> material;
+    std::copy_n(shared, CURVE25519_SIZE, material.begin());
+    std::copy_n(ephemeral_pk, CURVE25519_SIZE, material.begin() + CURVE25519_SIZE);
+    std::copy_n(recipient_pk, CURVE25519_SIZE, material.begin() + 2 * CURVE25519_SIZE);
+    Blob key(256/8);
+    if (gnutls_hash_fast(GNUTLS_DIG_SHA256, material.data(), material.size(), key.data()) != GNUTLS_E_SUCCESS)
+        throw CryptoException("Can't derive encryption key");
+    return key;
+}
+
+static bool
+isZero(const uint8_t* data, size_t size)
+{
+    uint8_t acc = 0;
+    for (size_t i = 0; i < size; i++)
+        acc |= data[i];
+    return acc == 0;
+}
+
+Blob
+ecEncrypt(const Blob& data, const Blob& public_key)
+{
+    if (public_key.size() != CURVE25519_SIZE)
+        throw CryptoException("Wrong X25519 public key size");
+
+    std::array<uint8_t, CURVE25519_SIZE> eph_sk, eph_pk, shared;
+    {
+        crypto::random_device rdev;
+        std::generate_n(eph_sk.begin(), eph_sk.size(), std::bind(rand_byte, std::ref(rdev)));
+    }
+    curve25519_mul_g(eph_pk.data(), eph_sk.data());
+    curve25519_mul(shared.data(), eph_sk.data(), public_key.data());
+    if (isZero(shared.data(), shared.size()))
+        throw CryptoException("Invalid X25519 public key");
+
+    auto data_encrypted = aesEncrypt(data, ecDeriveKey(shared.data(), eph_pk.data(), public_key.data()));
+
+    Blob ret;
+    ret.reserve(EC_CYPHER_HEADER_SIZE + data_encrypted.size());
+    ret.insert(ret.end(), EC_CYPHER_MAGIC.begin(), EC_CYPHER_MAGIC.end());
+    ret.insert(ret.end(), eph_pk.begin(), eph_pk.end());
+    ret.insert(ret.end(), data_encrypted.begin(), data_encrypted.end());
+    return ret;
+}
+
+template <size_t N>
+static bool
+hasMagic(const Blob& cypher, const std::array<uint8_t, N>& magic)
+{
+    return cypher.size() > magic.size() and std::equal(magic.begin(), magic.end(), cypher.begin());
+}
+
+/**
+ * Multi-recipient encrypted data:
+ * magic, recipient count (16 bits), then for each recipient
+ * its public key ID, key wrap size (16 bits) and key wrap,
+ * followed by the AES-GCM encrypted payload.
+ */
+struct KeyWrap {
+    InfoHash id;
+    const uint8_t* data;
+    size_t size;
+};
+
+static size_t
+readKeyWraps(const Blob& cypher, std::vector<KeyWrap>& wraps)
+{
+    size_t pos = MULTI_CYPHER_MAGIC.size();
+    if (cypher.size() < pos + 2)
+        throw DecryptError("Unexpected cipher length");
+    size_t n = (cypher[pos] << 8) | cypher[pos+1];
+    pos += 2;
+    wraps.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        if (cypher.size() < pos + HASH_LEN + 2)
+            throw DecryptError("Unexpected cipher length");
+        KeyWrap w;
+        std::copy_n(cypher.begin() + pos, HASH_LEN, w.id.begin());
+        pos += HASH_LEN;
+        w.size = (cypher[pos] << 8) | cypher[pos+1];
+        pos += 2;
+        if (cypher.size() < pos + w.size)
+            throw DecryptError("Unexpected cipher length");
+        w.data = cypher.data() + pos;
+        pos += w.size;
+        wraps.emplace_back(w);
+    }
+    return pos;
+}
+
+Blob
+multiEncrypt(const Blob& data, const std::vector<std::shared_ptr<Certificate>>& recipients)
+{
+    if (recipients.empty())
+        throw CryptoException("No recipient");
+    if (recipients.size() > std::numeric_limits<uint16_t>::max())
+        throw CryptoException("Too many recipients");
+
+    Blob key(256/8);
+    {
+        crypto::random_device rdev;
+        std::generate_n(key.begin(), key.size(), std::bind(rand_byte, std::ref(rdev)));
+    }
+
+    Blob ret(MULTI_CYPHER_MAGIC.begin(), MULTI_CYPHER_MAGIC.end());
+    ret.push_back(recipients.size() >> 8);
+    ret.push_back(recipients.size() & 0xff);
+    for (const auto& crt : recipients) {
+        if (not crt or not *crt)
+            throw CryptoException("Invalid recipient certificate");
+        auto id = crt->getId();
+        auto ec_key = crt->getEncryptionKey();
+        auto wrap = ec_key.empty() ? crt->getPublicKey().encrypt(key) : ecEncrypt(key, ec_key);
+        if (wrap.size() > std::numeric_limits<uint16_t>::max())
+            throw CryptoException("Key wrap too large");
+        ret.insert(ret.end(), id.begin(), id.end());
+        ret.push_back(wrap.size() >> 8);
+        ret.push_back(wrap.size() & 0xff);
+        ret.insert(ret.end(), wrap.begin(), wrap.end());
+    }
+    auto data_encrypted = aesEncrypt(data, key);
+    ret.insert(ret.end(), data_encrypted.begin(), data_encrypted.end());
+    return ret;
+}
+
+std::vector<InfoHash>
+getRecipients(const Blob& cypher)
+{
+    std::vector<InfoHash> ret;
+    if (not hasMagic(cypher, MULTI_CYPHER_MAGIC))
+        return ret;
+    std::vector<KeyWrap> wraps;
+    try {
+        readKeyWraps(cypher, wraps);
+    } catch (const DecryptError&) {
+        return ret;
+    }
+    ret.reserve(wraps.size());
+    for (const auto& w : wraps)
+        ret.emplace_back(w.id);
+    return ret;
+}
+
 PrivateKey::PrivateKey()
 {
 #if GNUTLS_VERSION_NUMBER < 0x030300
@@ -211,7 +378,7 @@ PrivateKey::PrivateKey(const Blob& import, const std::string& password)
     }
 }
 
-PrivateKey::PrivateKey(PrivateKey&& o) noexcept : key(o.key), x509_key(o.x509_key)
+PrivateKey::PrivateKey(PrivateKey&& o) noexcept : key(o.key), x509_key(o.x509_key), ec_keys(std::move(o.ec_keys))
 {
 #if GNUTLS_VERSION_NUMBER < 0x030300
     // gnutls_global_init already succeeded at least once here so no real need to check.
@@ -250,6 +417,7 @@ PrivateKey::operator=(PrivateKey&& o) noexcept
     }
     key = o.key; x509_key = o.x509_key;
     o.key = nullptr; o.x509_key = nullptr;
+    ec_keys = std::move(o.ec_keys);
     return *this;
 }
 
@@ -294,6 +462,22 @@ PrivateKey::decrypt(const Blob& cipher) const
         throw CryptoException("Must be an RSA key");
 
     unsigned cypher_block_sz = key_len / 8;
+    // RSA-encrypted data may start with the same bytes as other formats
+    if (cipher.size() > EC_CYPHER_HEADER_SIZE and hasMagic(cipher, EC_CYPHER_MAGIC)) {
+        try {
+            return ecDecrypt(cipher);
+        } catch (const DecryptError&) {
+            if (cipher.size() < cypher_block_sz)
+                throw;
+        }
+    } else if (hasMagic(cipher, MULTI_CYPHER_MAGIC)) {
+        try {
+            return multiDecrypt(cipher);
+        } catch (const DecryptError&) {
+            if (cipher.size() < cypher_block_sz)
+                throw;
+        }
+    }
     if (cipher.size() < cypher_block_sz)
         throw DecryptError("Unexpected cipher length");
     else if (cipher.size() == cypher_block_sz)
@@ -302,6 +486,74 @@ PrivateKey::decrypt(const Blob& cipher) const
     return aesDecrypt(Blob {cipher.begin() + cypher_block_sz, cipher.end()}, decryptBloc(cipher.data(), cypher_block_sz));
 }
 
+struct PrivateKey::EncryptionKeyPair {
+    std::array<uint8_t, CURVE25519_SIZE> secret;
+    std::array<uint8_t, CURVE25519_SIZE> pk;
+    ~EncryptionKeyPair() {
+        std::fill(secret.begin(), secret.end(), 0);
+    }
+};
+
+/* Derived on first use and then shared: the key pair is read
+   concurrently by the crypto workers. */
+std::shared_ptr<const PrivateKey::EncryptionKeyPair>
+PrivateKey::getEncryptionKeyPair() const
+{
+    if (auto keys = std::atomic_load(&ec_keys))
+        return keys;
+    if (!x509_key)
+        throw CryptoException("Can't derive encryption key: no private key set !");
+    size_t buf_sz = 8192;
+    Blob buffer(buf_sz);
+    int err = gnutls_x509_privkey_export(x509_key, GNUTLS_X509_FMT_DER, buffer.data(), &buf_sz);
+    if (err != GNUTLS_E_SUCCESS)
+        throw CryptoException(std::string("Can't export private key: ") + gnutls_strerror(err));
+    auto keys = std::make_shared<EncryptionKeyPair>();
+    err = gnutls_hmac_fast(GNUTLS_MAC_SHA256, buffer.data(), buf_sz, EC_SECRET_LABEL.data(), EC_SECRET_LABEL.size(), keys->secret.data());
+    std::fill(buffer.begin(), buffer.end(), 0);
+    if (err != GNUTLS_E_SUCCESS)
+        throw CryptoException(std::string("Can't derive encryption key: ") + gnutls_strerror(err));
+    curve25519_mul_g(keys->pk.data(), keys->secret.data());
+    std::shared_ptr<const EncryptionKeyPair> ret = std::move(keys);
+    std::atomic_store(&ec_keys, ret);
+    return ret;
+}
+
+Blob
+PrivateKey::getEncryptionKey() const
+{
+    auto keys = getEncryptionKeyPair();
+    return {keys->pk.begin(), keys->pk.end()};
+}
+
+Blob
+PrivateKey::ecDecrypt(const Blob& cipher) const
+{
+    auto keys = getEncryptionKeyPair();
+    std::array<uint8_t, CURVE25519_SIZE> shared;
+    const uint8_t* eph_pk = cipher.data() + EC_CYPHER_MAGIC.size();
+    curve25519_mul(shared.data(), keys->secret.data(), eph_pk);
+    if (isZero(shared.data(), shared.size()))
+        throw DecryptError("Invalid ephemeral key");
+    return aesDecrypt(Blob {cipher.begin() + EC_CYPHER_HEADER_SIZE, cipher.end()},
+                      ecDeriveKey(shared.data(), eph_pk, keys->pk.data()));
+}
+
+Blob
+PrivateKey::multiDecrypt(const Blob& cipher) const
+{
+    std::vector<KeyWrap> wraps;
+    size_t payload_pos = readKeyWraps(cipher, wraps);
+    const auto id = getPublicKey().getId();
+    for (const auto& w : wraps) {
+        if (w.id != id)
+            continue;
+        auto key = decrypt(Blob {w.data, w.data + w.size});
+        return aesDecrypt(Blob {cipher.begin() + payload_pos, cipher.end()}, key);
+    }
+    throw DecryptError("Not a recipient");
+}
+
 Blob
 PrivateKey::serialize(const std::string& password) const
 {
@@ -332,68 +584,205 @@ PrivateKey::getPublicKey() const
     return pk_ret;
 }
 
-PublicKey::PublicKey(const Blob& dat) : pk(nullptr)
+/**
+ * Public key data, shared by PublicKey instances.
+ * The gnutls key is imported from the packed (DER or PEM) key on first use.
+ * The key ID and packed form are computed once.
+ */
+struct PublicKey::KeyData {
+    KeyData(gnutls_pubkey_t k) : pk(k), parsed(true) {}
+    KeyData(const uint8_t* dat, size_t dat_size) : packed(dat, dat+dat_size) {}
+    ~KeyData() {
+        if (pk)
+            gnutls_pubkey_deinit(pk);
+    }
+
+    /**
+     * Get the shared key data for a packed key.
+     * Keys are interned: values from the same owner share a single key.
+     */
+    static std::shared_ptr<KeyData> intern(const uint8_t* dat, size_t dat_size);
+
+    gnutls_pubkey_t get() {
+        std::lock_guard<std::mutex> lck(mtx);
+        return parse();
+    }
+
+    InfoHash getId() {
+        std::lock_guard<std::mutex> lck(mtx);
+        if (not has_id) {
+            has_id = true;
+            auto k = parse();
+            size_t sz = id.size();
+            if (not k or gnutls_pubkey_get_key_id(k, 0, id.data(), &sz) != GNUTLS_E_SUCCESS || sz != id.size())
+                id = {};
+        }
+        return id;
+    }
+
+    int getError() {
+        std::lock_guard<std::mutex> lck(mtx);
+        parse();
+        return err;
+    }
+
+    // Must be called with mtx held.
+    gnutls_pubkey_t parse() {
+        if (not parsed) {
+            parsed = true;
+            gnutls_pubkey_init(&pk);
+            const gnutls_datum_t dat {(uint8_t*)packed.data(), (unsigned)packed.size()};
+            err = gnutls_pubkey_import(pk, &dat, GNUTLS_X509_FMT_PEM);
+            if (err != GNUTLS_E_SUCCESS)
+                err = gnutls_pubkey_import(pk, &dat, GNUTLS_X509_FMT_DER);
+            if (err != GNUTLS_E_SUCCESS) {
+                gnutls_pubkey_deinit(pk);
+                pk = nullptr;
+            }
+        }
+        return pk;
+    }
+
+    std::mutex mtx {};
+    Blob packed {};
+
+private:
+    gnutls_pubkey_t pk {};
+    int err {GNUTLS_E_SUCCESS};
+    bool parsed {false};
+    InfoHash id {};
+    bool has_id {false};
+};
+
+std::shared_ptr<PublicKey::KeyData>
+PublicKey::KeyData::intern(const uint8_t* dat, size_t dat_size)
 {
-    unpack(dat.data(), dat.size());
+    static constexpr size_t MIN_PURGE_SIZE {64};
+    static std::mutex table_mtx;
+    static std::map<Blob, std::weak_ptr<KeyData>> table;
+    static size_t purge_size {MIN_PURGE_SIZE};
+
+    Blob packed {dat, dat+dat_size};
+    std::lock_guard<std::mutex> lck(table_mtx);
+    auto& entry = table[packed];
+    if (auto key = entry.lock())
+        return key;
+    auto key = std::make_shared<KeyData>(dat, dat_size);
+    entry = key;
+
+    // Drop entries of keys that are not used anymore.
+    if (table.size() >= purge_size) {
+        for (auto it = table.begin(); it != table.end();) {
+            if (it->second.expired())
+                it = table.erase(it);
+            else
+                ++it;
+        }
+        purge_size = std::max(MIN_PURGE_SIZE, table.size() * 2);
+    }
+    return key;
 }
 
-PublicKey::~PublicKey()
+PublicKey::PublicKey(gnutls_pubkey_t k) : key_(k ? std::make_shared<KeyData>(k) : nullptr) {}
+
+PublicKey::PublicKey(const Blob& dat)
 {
-    if (pk) {
-        gnutls_pubkey_deinit(pk);
-        pk = nullptr;
-    }
+    unpack(dat.data(), dat.size());
 }
 
+PublicKey::~PublicKey() {}
+
 PublicKey&
 PublicKey::operator=(PublicKey&& o) noexcept
 {
-    if (pk)
-        gnutls_pubkey_deinit(pk);
-    pk = o.pk;
-    o.pk = nullptr;
+    key_ = std::move(o.key_);
     return *this;
 }
 
+bool
+PublicKey::operator==(const PublicKey& o) const
+{
+    return key_ == o.key_ or (key_ and o.key_ and getId() == o.getId());
+}
+
+gnutls_pubkey_t
+PublicKey::get() const
+{
+    return key_ ? key_->get() : nullptr;
+}
+
 void
 PublicKey::pack(Blob& b) const
 {
-    std::vector<uint8_t> tmp(2048);
-    size_t sz = tmp.size();
-    int err = gnutls_pubkey_export(pk, GNUTLS_X509_FMT_DER, tmp.data(), &sz);
-    if (err != GNUTLS_E_SUCCESS)
-        throw CryptoException(std::string("Could not export public key: ") + gnutls_strerror(err));
-    tmp.resize(sz);
-    b.insert(b.end(), tmp.begin(), tmp.end());
+    if (not key_)
+        throw CryptoException("Could not export public key: no key set");
+    std::lock_guard<std::mutex> lck(key_->mtx);
+    if (key_->packed.empty()) {
+        std::vector<uint8_t> tmp(2048);
+        size_t sz = tmp.size();
+        int err = gnutls_pubkey_export(key_->parse(), GNUTLS_X509_FMT_DER, tmp.data(), &sz);
+        if (err != GNUTLS_E_SUCCESS)
+            throw CryptoException(std::string("Could not export public key: ") + gnutls_strerror(err));
+        tmp.resize(sz);
+        key_->packed = std::move(tmp);
+    }
+    b.insert(b.end(), key_->packed.begin(), key_->packed.end());
 }
 
 void
 PublicKey::unpack(const uint8_t* data, size_t data_size)
 {
-    if (pk)
-        gnutls_pubkey_deinit(pk);
-    gnutls_pubkey_init(&pk);
-    const gnutls_datum_t dat {(uint8_t*)data, (unsigned)data_size};
-    int err = gnutls_pubkey_import(pk, &dat, GNUTLS_X509_FMT_PEM);
-    if (err != GNUTLS_E_SUCCESS)
-        err = gnutls_pubkey_import(pk, &dat, GNUTLS_X509_FMT_DER);
+    auto key = KeyData::intern(data, data_size);
+    int err = key->getError();
     if (err != GNUTLS_E_SUCCESS)
         throw CryptoException(std::string("Could not read public key: ") + gnutls_strerror(err));
+    key_ = std::move(key);
+}
+
+/**
+ * Cheap check that dat holds a PEM key, or a single DER structure:
+ * malformed keys are rejected without parsing them.
+ */
+static bool
+isWellFormedKey(const uint8_t* dat, size_t dat_size)
+{
+    static const std::string PEM_BEGIN {"-----BEGIN "};
+    if (dat_size > PEM_BEGIN.size() and std::equal(PEM_BEGIN.begin(), PEM_BEGIN.end(), (const char*)dat))
+        return true;
+    // DER SEQUENCE, with a length covering exactly the rest of the data
+    if (dat_size < 2 or dat[0] != 0x30)
+        return false;
+    size_t len = dat[1], header = 2;
+    if (len & 0x80) {
+        size_t n = len & 0x7f;
+        if (n == 0 or n > 4 or dat_size < 2 + n)
+            return false;
+        len = readBE(dat + 2, n);
+        header += n;
+    }
+    return header + len == dat_size;
 }
 
 void
 PublicKey::msgpack_unpack(msgpack::object o)
 {
-    if (o.type == msgpack::type::BIN)
-        unpack((const uint8_t*)o.via.bin.ptr, o.via.bin.size);
-    else {
+    // Only keep the packed key: it is parsed on first use.
+    if (o.type == msgpack::type::BIN) {
+        auto dat = (const uint8_t*)o.via.bin.ptr;
+        if (not isWellFormedKey(dat, o.via.bin.size))
+            throw CryptoException("Could not read public key: malformed key");
+        key_ = KeyData::intern(dat, o.via.bin.size);
+    } else {
         Blob dat = unpackBlob(o);
-        unpack(dat.data(), dat.size());
+        if (not isWellFormedKey(dat.data(), dat.size()))
+            throw CryptoException("Could not read public key: malformed key");
+        key_ = KeyData::intern(dat.data(), dat.size());
     }
 }
 
 bool
 PublicKey::checkSignature(const Blob& data, const Blob& signature) const {
+    auto pk = get();
     if (!pk)
         return false;
     const gnutls_datum_t sig {(uint8_t*)signature.data(), (unsigned)signature.size()};
@@ -407,7 +796,7 @@ PublicKey::encryptBloc(const uint8_t* src, size_t src_size, uint8_t* dst, size_t
 {
     const gnutls_datum_t key_dat {(uint8_t*)src, (unsigned)src_size};
     gnutls_datum_t encrypted;
-    auto err = gnutls_pubkey_encrypt_data(pk, 0, &key_dat, &encrypted);
+    auto err = gnutls_pubkey_encrypt_data(get(), 0, &key_dat, &encrypted);
     if (err != GNUTLS_E_SUCCESS)
         throw CryptoException(std::string("Can't encrypt data: ") + gnutls_strerror(err));
     if (encrypted.size != dst_size)
@@ -419,6 +808,7 @@ PublicKey::encryptBloc(const uint8_t* src, size_t src_size, uint8_t* dst, size_t
 Blob
 PublicKey::encrypt(const Blob& data) const
 {
+    auto pk = get();
     if (!pk)
         throw CryptoException("Can't read public key !");
 
@@ -459,11 +849,7 @@ PublicKey::encrypt(const Blob& data) const
 InfoHash
 PublicKey::getId() const
 {
-    InfoHash id;
-    size_t sz = id.size();
-    if (gnutls_pubkey_get_key_id(pk, 0, id.data(), &sz) != GNUTLS_E_SUCCESS || sz != id.size())
-        return {};
-    return id;
+    return key_ ? key_->getId() : InfoHash();
 }
 
 Certificate::Certificate(const Blob& certData) : cert(nullptr)
@@ -645,6 +1031,19 @@ Certificate::getAltNames() const
     return names;
 }
 
+Blob
+Certificate::getEncryptionKey() const
+{
+    // DER-encoded octet string
+    std::array<uint8_t, CURVE25519_SIZE + 2> ext;
+    size_t ext_sz = ext.size();
+    unsigned critical;
+    int err = gnutls_x509_crt_get_extension_by_oid(cert, ENCRYPTION_KEY_OID, 0, ext.data(), &ext_sz, &critical);
+    if (err != GNUTLS_E_SUCCESS or ext_sz != ext.size() or ext[0] != 0x04 or ext[1] != CURVE25519_SIZE)
+        return {};
+    return {ext.begin() + 2, ext.end()};
+}
+
 bool
 Certificate::isCA() const
 {
@@ -725,6 +1124,15 @@ generateIdentity(const std::string& name, crypto::Identity ca, unsigned key_leng
     gnutls_x509_crt_set_dn_by_oid(cert, GNUTLS_OID_X520_COMMON_NAME, 0, name.data(), name.length());
     gnutls_x509_crt_set_dn_by_oid(cert, GNUTLS_OID_LDAP_UID, 0, uid_str.data(), uid_str.length());
 
+    // Publish the X25519 key used for hybrid encryption
+    {
+        auto ec_key = shared_key->getEncryptionKey();
+        Blob ext {0x04, (uint8_t)ec_key.size()};
+        ext.insert(ext.end(), ec_key.begin(), ec_key.end());
+        if (gnutls_x509_crt_set_extension_by_oid(cert, ENCRYPTION_KEY_OID, ext.data(), ext.size(), 0) != GNUTLS_E_SUCCESS)
+            std::cerr << "Error when setting certificate encryption key" << std::endl;
+    }
+
     {
         random_device rdev;
         std::uniform_int_distribution<uint64_t> dist{};
@@ -42,45 +42,34 @@ extern "C" {
 #include <algorithm>
 #include <random>
 #include <sstream>
+#include <fstream>
+#include <set>
+#include <thread>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <io.h>
+#include <sys/stat.h>
+#endif
 
 #ifndef MSG_CONFIRM
 #define MSG_CONFIRM 0
 #endif
 
 #ifdef _WIN32
-
-static bool
-set_nonblocking(int fd, int nonblocking)
-{
-    unsigned long mode = !!nonblocking;
-    int rc = ioctlsocket(fd, FIONBIO, &mode);
-    return rc == 0;
-}
-
 extern const char *inet_ntop(int, const void *, char *, socklen_t);
-
-#else
-
-static bool
-set_nonblocking(int fd, int nonblocking)
-{
-    int rc = fcntl(fd, F_GETFL, 0);
-    if (rc < 0)
-        return false;
-    rc = fcntl(fd, F_SETFL, nonblocking?(rc | O_NONBLOCK):(rc & ~O_NONBLOCK));
-    return !(rc < 0);
-}
-
 #endif
 
 #define WANT4 1
 #define WANT6 2
 
-static std::mt19937 rd {dht::crypto::random_device{}()};
 static std::uniform_int_distribution<uint8_t> rand_byte;
 
 static const uint8_t v4prefix[16] = {
@@ -161,6 +150,104 @@ constexpr std::chrono::seconds Dht::LISTEN_EXPIRE_TIME;
 constexpr std::chrono::seconds Dht::REANNOUNCE_MARGIN;
 constexpr std::chrono::seconds Dht::UDP_REPLY_TIME;
 constexpr long unsigned Dht::MAX_REQUESTS_PER_SEC;
+constexpr unsigned Dht::IMPORT_PINGS;
+constexpr std::chrono::milliseconds Dht::IMPORT_PING_PERIOD;
+constexpr size_t Dht::DEFAULT_STORAGE_LIMIT;
+constexpr size_t Dht::DEFAULT_STORAGE_LIMIT_PER_IP;
+constexpr size_t Dht::PHASE_COUNT;
+constexpr std::chrono::milliseconds Dht::DEFAULT_PHASE_BUDGET;
+constexpr std::chrono::milliseconds Dht::DEFAULT_MAINTENANCE_BUDGET;
+
+// Upper bounds of histogram buckets, durations being in seconds.
+static const std::vector<double> RTT_BUCKETS {.001, .0025, .005, .01, .025, .05, .1, .25, .5, 1, 2.5};
+static const std::vector<double> GET_BUCKETS {.01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10, 30, 60};
+static const std::vector<double> CALLBACK_BUCKETS {.00001, .0001, .001, .01, .1, 1};
+static const std::vector<double> HOPS_BUCKETS {0, 1, 2, 3, 4, 5, 6, 8, 10, 15};
+static const std::vector<double> PHASE_BUCKETS {.00001, .0001, .001, .01, .1, 1};
+
+static const std::array<const char*, Dht::PHASE_COUNT> PHASE_NAMES {{
+    "process_message", "rotate_secrets", "expire_buckets", "expire_storage", "expire_searches",
+    "search_step", "bucket_maintenance", "neighbourhood_maintenance", "storage_maintenance", "storage_sync"
+}};
+
+/**
+ * Metrics updated by the Dht.
+ * They are registered once, and then updated through these references
+ * without looking them up in the registry.
+ */
+struct Dht::Metrics {
+    enum Request { PING = 0, FIND, GET, PUT, LISTEN, REQUEST_COUNT };
+    enum Drop {
+        DROP_REJECTED = 0,      /* martian address */
+        DROP_BLACKLISTED,
+        DROP_MALFORMED,
+        DROP_SELF,
+        DROP_RATE_LIMITED,
+        DROP_WRONG_TOKEN,
+        DROP_COUNT
+    };
+
+    Metrics(metrics::Registry& r) :
+        bytes_received(r.counter("dht_received_bytes_total", "Bytes received")),
+        bytes_sent(r.counter("dht_sent_bytes_total", "Bytes sent")),
+        get_time(r.histogram("dht_get_duration_seconds", "Duration of completed get operations", GET_BUCKETS)),
+        get_hops(r.histogram("dht_get_hops", "Replies followed to reach the closest node of completed get operations", HOPS_BUCKETS)),
+        get_callback_time(r.histogram("dht_callback_duration_seconds", "Time spent in user callbacks", CALLBACK_BUCKETS, {{"callback", "get"}})),
+        done_callback_time(r.histogram("dht_callback_duration_seconds", "Time spent in user callbacks", CALLBACK_BUCKETS, {{"callback", "done"}})),
+        storage_keys(r.gauge("dht_storage_keys", "Keys stored")),
+        storage_values(r.gauge("dht_storage_values", "Values stored")),
+        storage_bytes(r.gauge("dht_storage_bytes", "Size of the values stored"))
+    {
+        static const std::array<const char*, 7> MESSAGE_TYPES {{"error", "reply", "ping", "find", "get", "put", "listen"}};
+        static const std::array<const char*, REQUEST_COUNT> REQUESTS {{"ping", "find", "get", "put", "listen"}};
+        static const std::array<const char*, DROP_COUNT> DROPS {{"rejected", "blacklisted", "malformed", "self", "rate_limited", "wrong_token"}};
+        for (size_t i = 0; i < MESSAGE_TYPES.size(); i++) {
+            received[i] = &r.counter("dht_received_messages_total", "Messages received, by type", {{"type", MESSAGE_TYPES[i]}});
+            sent[i] = &r.counter("dht_sent_messages_total", "Messages sent, by type", {{"type", MESSAGE_TYPES[i]}});
+        }
+        for (size_t i = 0; i < REQUESTS.size(); i++)
+            rtt[i] = &r.histogram("dht_rtt_seconds", "Round-trip time of requests, by type", RTT_BUCKETS, {{"request", REQUESTS[i]}});
+        for (size_t i = 0; i < DROPS.size(); i++)
+            dropped[i] = &r.counter("dht_dropped_messages_total", "Messages dropped, by reason", {{"reason", DROPS[i]}});
+        for (size_t i = 0; i < PHASE_NAMES.size(); i++)
+            phases[i] = &r.histogram("dht_periodic_phase_seconds", "Time spent in the phases of periodic", PHASE_BUCKETS, {{"phase", PHASE_NAMES[i]}});
+        for (size_t i = 0; i < ERROR_CODES.size(); i++) {
+            received_errors[i] = &r.counter("dht_received_errors_total", "Error messages received, by code", {{"code", ERROR_CODES[i]}});
+            sent_errors[i] = &r.counter("dht_sent_errors_total", "Error messages sent, by code", {{"code", ERROR_CODES[i]}});
+        }
+    }
+
+    void replied(Request type, const std::shared_ptr<Node>& n) {
+        if (n and n->last_rtt != duration::zero())
+            rtt[type]->observe(n->last_rtt);
+    }
+
+    /* Error messages, labelled by code. Codes not used by the protocol are grouped. */
+    static constexpr std::array<const char*, 3> ERROR_CODES {{"203", "401", "other"}};
+    metrics::Counter& error(bool is_sent, uint16_t code) {
+        size_t i = code == 203 ? 0 : (code == 401 ? 1 : 2);
+        return *(is_sent ? sent_errors : received_errors)[i];
+    }
+
+    std::array<metrics::Counter*, 7> received;   /* by MessageType */
+    std::array<metrics::Counter*, 7> sent;
+    metrics::Counter& bytes_received;
+    metrics::Counter& bytes_sent;
+    std::array<metrics::Counter*, DROP_COUNT> dropped;
+    std::array<metrics::Counter*, 3> received_errors;    /* by ERROR_CODES */
+    std::array<metrics::Counter*, 3> sent_errors;
+    std::array<metrics::Histogram*, REQUEST_COUNT> rtt;
+    std::array<metrics::Histogram*, PHASE_COUNT> phases;    /* by Phase */
+    metrics::Histogram& get_time;
+    metrics::Histogram& get_hops;
+    metrics::Histogram& get_callback_time;
+    metrics::Histogram& done_callback_time;
+    metrics::Gauge& storage_keys;
+    metrics::Gauge& storage_values;
+    metrics::Gauge& storage_bytes;
+};
+
+constexpr std::array<const char*, 3> Dht::Metrics::ERROR_CODES;
 
 void
 Dht::setLoggers(LogMethod&& error, LogMethod&& warn, LogMethod&& debug)
@@ -203,16 +290,7 @@ Dht::shutdown(ShutdownCallback cb) {
 bool
 Dht::isRunning(sa_family_t af) const
 {
-    switch (af) {
-    case 0:
-        return dht_socket  >= 0 ||  dht_socket6 >= 0;
-    case AF_INET:
-        return dht_socket  >= 0;
-    case AF_INET6:
-        return dht_socket6 >= 0;
-    default:
-        return false;
-    }
+    return transport and transport->supports(af);
 }
 
 bool
@@ -249,8 +327,32 @@ Dht::isMartian(const sockaddr *sa, socklen_t len)
     }
 }
 
+bool
+Dht::isLoopback(const sockaddr *sa, socklen_t len)
+{
+    if (!sa || len < sizeof(sockaddr_in))
+        return false;
+
+    switch(sa->sa_family) {
+    case AF_INET: {
+        auto sin = (const sockaddr_in*)sa;
+        const uint8_t *address = (const uint8_t*)&sin->sin_addr;
+        return sin->sin_port != 0 and address[0] == 127;
+    }
+    case AF_INET6: {
+        if (len < sizeof(sockaddr_in6))
+            return false;
+        auto sin6 = (const sockaddr_in6*)sa;
+        const uint8_t *address = (const uint8_t*)&sin6->sin6_addr;
+        return sin6->sin6_port != 0 and memcmp(address, zeroes.data(), 15) == 0 and address[15] == 1;
+    }
+    default:
+        return false;
+    }
+}
+
 std::shared_ptr<Node>
-Dht::Bucket::randomNode()
+Dht::Bucket::randomNode(std::mt19937& rd)
 {
     if (nodes.empty())
         return nullptr;
@@ -262,7 +364,7 @@ Dht::Bucket::randomNode()
 }
 
 InfoHash
-Dht::RoutingTable::randomId(const Dht::RoutingTable::const_iterator& it) const
+Dht::RoutingTable::randomId(const Dht::RoutingTable::const_iterator& it, std::mt19937& rd) const
 {
     int bit1 = it->first.lowbit();
     int bit2 = std::next(it) != end() ? std::next(it)->first.lowbit() : -1;
@@ -428,6 +530,11 @@ Node::received(time_point now, bool answer)
 {
     time = now;
     if (answer) {
+        last_rtt = duration::zero();
+        if (reply_time < pinged_time and pinged_time + MAX_RESPONSE_TIME >= now) {
+            last_rtt = now - pinged_time;
+            rtt = rtt == duration::zero() ? last_rtt : (rtt * 7 + last_rtt) / 8;
+        }
         pinged = 0;
         reply_time = now;
     }
@@ -648,7 +755,7 @@ Dht::reportedAddr(const sockaddr *sa, socklen_t sa_len)
 std::shared_ptr<Node>
 Dht::newNode(const InfoHash& id, const sockaddr *sa, socklen_t salen, int confirm, const sockaddr* addr, socklen_t addr_length)
 {
-    if (id == myid || isMartian(sa, salen) || isNodeBlacklisted(sa, salen))
+    if (id == myid || isRejected(sa, salen) || isNodeBlacklisted(sa, salen))
         return nullptr;
 
     auto& list = sa->sa_family == AF_INET ? buckets : buckets6;
@@ -800,7 +907,7 @@ Dht::Search::removeExpiredNode(time_point now)
    target.  We just got a new candidate, insert it at the right spot or
    discard it. */
 bool
-Dht::Search::insertNode(std::shared_ptr<Node> node, time_point now, const Blob& token)
+Dht::Search::insertNode(std::shared_ptr<Node> node, time_point now, const Blob& token, unsigned hops)
 {
     if (node->ss.ss_family != af) {
         //DHT_DEBUG("Attempted to insert node in the wrong family.");
@@ -842,6 +949,7 @@ Dht::Search::insertNode(std::shared_ptr<Node> node, time_point now, const Blob&
 
         //bool synced = isSynced(now);
         n = nodes.insert(n, SearchNode(node));
+        n->hops = hops;
         node->time = now;
         new_search_node = true;
         /*if (synced) {
@@ -912,6 +1020,8 @@ Dht::searchSendGetValues(Search& sr, SearchNode* pn, bool update)
         n->node->pinged, print_dt(now-n->getStatus.request_time));
 
     sendGetValues((sockaddr*)&n->node->ss, n->node->sslen, TransId {TransPrefix::GET_VALUES, sr.tid}, sr.id, -1, n->node->reply_time >= now - UDP_REPLY_TIME);
+    if (sr.trace)
+        sr.trace->requestSent(SearchTrace::Request::Get, n->node->id, n->node->getAddrStr(), now);
     n->getStatus.request_time = now;
     pinged(*n->node);
     if (n->node->pinged > 1 and not n->candidate) {
@@ -928,6 +1038,8 @@ Dht::searchStep(Search& sr)
 {
     DHT_DEBUG("[search %s IPv%c] step", sr.id.toString().c_str(), sr.af == AF_INET ? '4' : '6');
     sr.step_time = now;
+    if (sr.trace)
+        sr.trace->checkTimeouts(now, Node::MAX_RESPONSE_TIME);
 
     /* Check if the first TARGET_NODES (8) live nodes have replied. */
     if (sr.isSynced(now)) {
@@ -936,8 +1048,16 @@ Dht::searchStep(Search& sr)
             // Call callbacks when done
             for (auto b = sr.callbacks.begin(); b != sr.callbacks.end();) {
                 if (sr.isDone(*b, now)) {
-                    if (b->done_cb)
+                    metrics->get_time.observe(now - b->start);
+                    if (not sr.nodes.empty())
+                        metrics->get_hops.observe(sr.nodes.front().hops);
+                    if (sr.trace)
+                        sr.trace->operationDone(SearchTrace::Request::Get, true, now);
+                    if (b->done_cb) {
+                        auto t = clock::now();
                         b->done_cb(true, sr.getNodes());
+                        metrics->done_callback_time.observe(clock::now() - t);
+                    }
                     b = sr.callbacks.erase(b);
                 }
                 else
@@ -965,6 +1085,8 @@ Dht::searchStep(Search& sr)
                     //std::cout << "Sending listen to " << n.node->id << " " << print_addr(n.node->ss, n.node->sslen) << std::endl;
 
                     sendListen((sockaddr*)&n.node->ss, n.node->sslen, TransId {TransPrefix::LISTEN, sr.tid}, sr.id, n.token, n.node->reply_time >= now - UDP_REPLY_TIME);
+                    if (sr.trace)
+                        sr.trace->requestSent(SearchTrace::Request::Listen, n.node->id, n.node->getAddrStr(), now);
                     n.pending = true;
                     n.listenStatus.request_time = now;
                 }
@@ -983,7 +1105,14 @@ Dht::searchStep(Search& sr)
             if (in) {
                 DHT_WARN("[search %s IPv%c] [value %lu] storing locally",
                     sr.id.toString().c_str(), sr.af == AF_INET ? '4' : '6', vid);
-                storageStore(sr.id, a.value);
+                // The caller may still modify the announced value:
+                // an immutable copy is stored, so that stored values can be shared.
+                auto st = findStorage(sr.id);
+                auto old = st ? st->getById(vid) : nullptr;
+                if (old and *old->data == *a.value)
+                    storageStore(sr.id, old->data);
+                else
+                    storageStore(sr.id, std::make_shared<Value>(*a.value));
             }
             for (auto& n : sr.nodes) {
                 if (not n.isSynced(now) or (n.candidate and t >= TARGET_NODES))
@@ -1001,6 +1130,8 @@ Dht::searchStep(Search& sr)
                             TransId {TransPrefix::ANNOUNCE_VALUES, sr.tid},
                             sr.id, *a.value, a.created, n.token,
                             n.node->reply_time >= now - UDP_REPLY_TIME);
+                    if (sr.trace)
+                        sr.trace->requestSent(SearchTrace::Request::Put, n.node->id, n.node->getAddrStr(), now);
                     if (a_status == n.acked.end()) {
                         n.acked[vid] = { now };
                     } else {
@@ -1051,6 +1182,13 @@ Dht::searchStep(Search& sr)
                     // Listening or announcing requires keeping the cluster up to date.
                     sr.done = true;
                 }
+                if (sr.trace) {
+                    for (size_t i = 0; i < sr.callbacks.size(); i++)
+                        sr.trace->operationDone(SearchTrace::Request::Get, false, now);
+                    for (const auto& a : sr.announce)
+                        if (a.callback)
+                            sr.trace->operationDone(SearchTrace::Request::Put, false, now);
+                }
                 {
                     auto get_cbs = std::move(sr.callbacks);
                     for (const auto& g : get_cbs) {
@@ -1342,17 +1480,9 @@ Dht::Search::refill(const RoutingTable& r, time_point now) {
     return added;
 }
 
-/* Start a search. */
 Dht::Search*
-Dht::search(const InfoHash& id, sa_family_t af, GetCallback callback, DoneCallback done_callback, Value::Filter filter)
+Dht::getSearch(const InfoHash& id, sa_family_t af)
 {
-    if (!isRunning(af)) {
-        DHT_ERROR("[search %s IPv%c] unsupported protocol", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
-        if (done_callback)
-            done_callback(false, {});
-        return nullptr;
-    }
-
     auto sr = std::find_if (searches.begin(), searches.end(), [id,af](const Search& s) {
         return s.id == id && s.af == af;
     });
@@ -1373,16 +1503,39 @@ Dht::search(const InfoHash& id, sa_family_t af, GetCallback callback, DoneCallba
         sr->expired = false;
         sr->nodes.clear();
         sr->nodes.reserve(SEARCH_NODES+1);
+        sr->trace.reset();
         DHT_WARN("[search %s IPv%c] new search", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
     }
+    if (search_tracing and not sr->trace)
+        sr->trace = std::make_shared<SearchTrace>(id, af, now);
+    return &(*sr);
+}
 
-    if (callback)
+/* Start a search. */
+Dht::Search*
+Dht::search(const InfoHash& id, sa_family_t af, GetCallback callback, DoneCallback done_callback, Value::Filter filter)
+{
+    if (!isRunning(af)) {
+        DHT_ERROR("[search %s IPv%c] unsupported protocol", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
+        if (done_callback)
+            done_callback(false, {});
+        return nullptr;
+    }
+
+    auto sr = getSearch(id, af);
+    if (!sr)
+        return nullptr;
+
+    if (callback) {
         sr->callbacks.push_back({.start=now, .filter=filter, .get_cb=callback, .done_cb=done_callback});
+        if (sr->trace)
+            sr->trace->operationStarted(SearchTrace::Request::Get, now);
+    }
 
     bootstrapSearch(*sr);
     searchStep(*sr);
     search_time = now;
-    return &(*sr);
+    return sr;
 }
 
 void
@@ -1428,15 +1581,17 @@ Dht::announce(const InfoHash& id, sa_family_t af, std::shared_ptr<Value> value,
             a_sr->callback = callback;
         }
     }
+    if (sr->trace)
+        sr->trace->operationStarted(SearchTrace::Request::Put, now);
     auto tm = sr->getNextStepTime(types, now);
     if (tm < search_time) {
-        DHT_ERROR("[search %s IPv%c] search_time is now in %lfs", sr->id.toString().c_str(), (sr->af == AF_INET) ? '4' : '6', print_dt(tm-clock::now()));
+        DHT_ERROR("[search %s IPv%c] search_time is now in %lfs", sr->id.toString().c_str(), (sr->af == AF_INET) ? '4' : '6', print_dt(tm-now));
         search_time = tm;
     }/* else {
         DHT_DEBUG("search_time NOT changed to %ld (in %lf - actual in %lf)",
             tm.time_since_epoch().count(),
-            print_dt(tm-clock::now()),
-            print_dt(search_time-clock::now()));
+            print_dt(tm-now),
+            print_dt(search_time-now));
     }*/
 }
 
@@ -1445,7 +1600,7 @@ Dht::listenTo(const InfoHash& id, sa_family_t af, GetCallback cb, Value::Filter
 {
     if (!isRunning(af))
         return 0;
-       // DHT_ERROR("[search %s IPv%c] search_time is now in %lfs", sr->id.toString().c_str(), (sr->af == AF_INET) ? '4' : '6', print_dt(tm-clock::now()));
+       // DHT_ERROR("[search %s IPv%c] search_time is now in %lfs", sr->id.toString().c_str(), (sr->af == AF_INET) ? '4' : '6', print_dt(tm-now));
 
     //DHT_WARN("listenTo %s", id.toString().c_str());
     auto sri = std::find_if (searches.begin(), searches.end(), [id,af](const Search& s) {
@@ -1458,6 +1613,8 @@ Dht::listenTo(const InfoHash& id, sa_family_t af, GetCallback cb, Value::Filter
     sr->done = false;
     auto token = ++sr->listener_token;
     sr->listeners.emplace(token, LocalListener{f, cb});
+    if (sr->trace)
+        sr->trace->operationStarted(SearchTrace::Request::Listen, now);
     search_time = std::min(search_time, sr->getNextStepTime(types, now));
     return token;
 }
@@ -1465,7 +1622,7 @@ Dht::listenTo(const InfoHash& id, sa_family_t af, GetCallback cb, Value::Filter
 size_t
 Dht::listen(const InfoHash& id, GetCallback cb, Value::Filter f)
 {
-    now = clock::now();
+    now = getTime();
 
     auto vals = std::make_shared<std::map<Value::Id, std::shared_ptr<Value>>>();
     auto token = ++listener_token;
@@ -1495,6 +1652,7 @@ Dht::listen(const InfoHash& id, GetCallback cb, Value::Filter f)
     size_t tokenlocal = 0;
     if (!st && store.size() < MAX_HASHES) {
         store.push_back(Storage {id, now});
+        metrics->storage_keys.set(store.size());
         st = &store.back();
     }
     if (st) {
@@ -1530,7 +1688,7 @@ Dht::listen(const InfoHash& id, GetCallback cb, Value::Filter f)
 bool
 Dht::cancelListen(const InfoHash& id, size_t token)
 {
-    now = clock::now();
+    now = getTime();
 
     auto it = listeners.find(token);
     if (it == listeners.end()) {
@@ -1556,13 +1714,15 @@ Dht::cancelListen(const InfoHash& id, size_t token)
 void
 Dht::put(const InfoHash& id, std::shared_ptr<Value> val, DoneCallback callback, time_point created)
 {
-    now = clock::now();
+    now = getTime();
 
     if (val->id == Value::INVALID_ID) {
         crypto::random_device rdev;
         std::uniform_int_distribution<Value::Id> rand_id {};
         val->id = rand_id(rdev);
     }
+    // Announced values are sent many times: encode them once.
+    val->memoize();
 
     DHT_DEBUG("put: adding %s -> %s", id.toString().c_str(), val->toString().c_str());
 
@@ -1599,7 +1759,7 @@ struct OpStatus {
 void
 Dht::get(const InfoHash& id, GetCallback getcb, DoneCallback donecb, Value::Filter filter)
 {
-    now = clock::now();
+    now = getTime();
 
     auto status = std::make_shared<OpStatus>();
     auto status4 = std::make_shared<OpStatus>();
@@ -1672,8 +1832,8 @@ std::shared_ptr<Value>
 Dht::getLocalById(const InfoHash& id, const Value::Id& vid) const
 {
     if (auto s = findStorage(id)) {
-        for (auto& v : s->values)
-            if (v.data->id == vid) return v.data;
+        if (auto v = s->getById(vid))
+            return v->data;
     }
     return {};
 }
@@ -1725,6 +1885,29 @@ Dht::cancelPut(const InfoHash& id, const Value::Id& vid)
     return canceled;
 }
 
+void
+Dht::failPut(const InfoHash& id, Value::Id vid)
+{
+    std::vector<DoneCallback> callbacks;
+    for (auto& sr : searches) {
+        if (sr.id != id)
+            continue;
+        for (auto it = sr.announce.begin(); it != sr.announce.end();) {
+            if (it->value and it->value->id == vid) {
+                if (it->callback)
+                    callbacks.emplace_back(std::move(it->callback));
+                if (sr.trace)
+                    sr.trace->operationDone(SearchTrace::Request::Put, false, now);
+                it = sr.announce.erase(it);
+            } else
+                ++it;
+        }
+    }
+    // Callbacks may put again.
+    for (auto& cb : callbacks)
+        cb(false, {});
+}
+
 /* A struct storage stores all the stored peer addresses for a given info
    hash. */
 
@@ -1763,8 +1946,25 @@ Dht::storageChanged(Storage& st, ValueStorage& v)
     }
 }
 
+/* The source of a stored value is its IP address, without the port. */
+static std::string
+getStorageSource(const sockaddr* sa, socklen_t salen)
+{
+    if (not sa)
+        return {};
+    if (sa->sa_family == AF_INET and salen >= sizeof(sockaddr_in)) {
+        const auto& addr = ((const sockaddr_in*)sa)->sin_addr;
+        return {(const char*)&addr, sizeof(addr)};
+    } else if (sa->sa_family == AF_INET6 and salen >= sizeof(sockaddr_in6)) {
+        const auto& addr = ((const sockaddr_in6*)sa)->sin6_addr;
+        return {(const char*)&addr, sizeof(addr)};
+    }
+    return {};
+}
+
 Dht::ValueStorage*
-Dht::storageStore(const InfoHash& id, const std::shared_ptr<Value>& value, time_point created)
+Dht::storageStore(const InfoHash& id, const std::shared_ptr<Value>& value, time_point created,
+                  const sockaddr* from, socklen_t fromlen)
 {
     created = std::min(created, now);
     Storage *st = findStorage(id);
@@ -1772,29 +1972,300 @@ Dht::storageStore(const InfoHash& id, const std::shared_ptr<Value>& value, time_
         if (store.size() >= MAX_HASHES)
             return nullptr;
         store.push_back(Storage {id, now});
+        metrics->storage_keys.set(store.size());
         st = &store.back();
     }
 
-    auto it = std::find_if (st->values.begin(), st->values.end(), [&](const ValueStorage& vr) {
-        return vr.data == value || vr.data->id == value->id;
-    });
-    if (it != st->values.end()) {
-        /* Already there, only need to refresh */
-        it->time = created;
-        if (it->data != value) {
-            DHT_DEBUG("Updating %s -> %s", id.toString().c_str(), value->toString().c_str());
-            it->data = value;
-            storageChanged(*st, *it);
+    auto old = st->getById(value->id);
+    if (old and old->data == value) {
+        old->time = created;
+        if (storage_backend)
+            storage_backend->refresh(id, value->id, created);
+        return old;
+    }
+    size_t size = value->size();
+    size_t old_size = old ? old->size : 0;
+    auto source = getStorageSource(from, fromlen);
+
+    if (not source.empty()) {
+        auto ss = source_store_size.find(source);
+        size_t source_size = ss == source_store_size.end() ? 0 : ss->second;
+        if (old and old->source == source)
+            source_size -= old_size;
+        if (source_size + size > max_store_size_per_ip) {
+            DHT_WARN("Rejecting value at %s: storage limit reached for %s.", id.toString().c_str(), print_addr(from, fromlen).c_str());
+            return nullptr;
         }
-        return &*it;
-    } else {
-        DHT_DEBUG("Storing %s -> %s", id.toString().c_str(), value->toString().c_str());
-        if (st->values.size() >= MAX_VALUES)
+    }
+
+    if (size > old_size) {
+        // Make room, without evicting the value being replaced.
+        auto vid = value->id;
+        const auto& type = getType(value->type);
+        if (type.max_store_size) {
+            auto tid = value->type;
+            auto ts = total_type_size.find(tid);
+            size_t type_size = ts == total_type_size.end() ? 0 : ts->second;
+            if (old and old->data->type == tid)
+                type_size -= old_size;
+            if (type_size + size > type.max_store_size) {
+                // Free some more to avoid evicting for every new value.
+                size_t target = type.max_store_size / 10 * 9;
+                evictValues(type_size, target > size ? target - size : 0, {id, vid}, &type);
+            }
+        }
+        if (total_store_size - old_size + size > max_store_size) {
+            size_t target = max_store_size / 10 * 9;
+            evictValues(total_store_size - old_size, target > size ? target - size : 0, {id, vid});
+        }
+        if (total_store_size - old_size + size > max_store_size) {
+            DHT_WARN("Rejecting value at %s: storage full.", id.toString().c_str());
             return nullptr;
-        st->values.emplace_back(value, created);
-        storageChanged(*st, st->values.back());
-        return &st->values.back();
+        }
+        // eviction may have moved stored values
+        old = st->getById(value->id);
+    }
+
+    std::shared_ptr<Value> old_value;
+    std::string old_source;
+    if (old) {
+        old_value = old->data;
+        old_source = old->source;
+    }
+    auto stored = st->store(value, created, MAX_VALUES);
+    if (stored.second) {
+        if (old_value) {
+            ValueStorage removed {old_value, created};
+            removed.source = std::move(old_source);
+            removed.size = old_size;
+            updateStorageSize(removed, false);
+        }
+        stored.first->source = std::move(source);
+        updateStorageSize(*stored.first, true);
+        if (storage_backend)
+            storage_backend->store(id, *value, stored.first->time);
+
+        DHT_DEBUG("Storing %s -> %s", id.toString().c_str(), value->toString().c_str());
+        storageChanged(*st, *stored.first);
     }
+    return stored.first;
+}
+
+void
+Dht::updateStorageSize(const ValueStorage& v, bool added)
+{
+    if (not v.data)
+        return;
+    auto size = v.size;
+    metrics->storage_values.add(added ? 1 : -1);
+    if (added) {
+        total_store_size += size;
+        total_type_size[v.data->type] += size;
+        if (not v.source.empty())
+            source_store_size[v.source] += size;
+        metrics->storage_bytes.set(total_store_size);
+        return;
+    }
+    total_store_size -= size;
+    metrics->storage_bytes.set(total_store_size);
+    auto ts = total_type_size.find(v.data->type);
+    if (ts != total_type_size.end() and (ts->second -= size) == 0)
+        total_type_size.erase(ts);
+    if (not v.source.empty()) {
+        auto ss = source_store_size.find(v.source);
+        if (ss != source_store_size.end() and (ss->second -= size) == 0)
+            source_store_size.erase(ss);
+    }
+}
+
+void
+Dht::storageValueRemoved(const InfoHash& id, const ValueStorage& v)
+{
+    updateStorageSize(v, false);
+    if (storage_backend and v.data)
+        storage_backend->remove(id, v.data->id);
+}
+
+void
+Dht::setStorageBackend(std::unique_ptr<ValueStore>&& backend)
+{
+    storage_backend.reset();
+    if (not backend)
+        return;
+    std::vector<std::pair<InfoHash, Value::Id>> rejected;
+    size_t loaded = 0;
+    backend->load([&](const InfoHash& key, std::shared_ptr<Value> value, time_point created) {
+        if (auto vs = storageStore(key, value, created)) {
+            vs->time = created;
+            loaded++;
+        } else
+            rejected.emplace_back(key, value->id);
+    });
+    for (const auto& r : rejected)
+        backend->remove(r.first, r.second);
+    DHT_DEBUG("Loaded %lu stored values, %lu rejected.", loaded, rejected.size());
+    storage_backend = std::move(backend);
+}
+
+/* Values are evicted by increasing score: the remaining lifetime,
+   weighted by the popularity of their key and divided by their size.
+   Values about to expire, unpopular or large go first. */
+size_t
+Dht::evictValues(size_t size, size_t target, const std::pair<InfoHash, Value::Id>& keep, const ValueType* type)
+{
+    if (size <= target)
+        return 0;
+
+    struct Candidate {
+        double score;
+        size_t storage;
+        Value::Id id;
+        size_t size;
+    };
+    std::vector<Candidate> candidates;
+    for (size_t i = 0; i < store.size(); i++) {
+        const auto& st = store[i];
+        if (type and st.type_size.find(type->id) == st.type_size.end())
+            continue;
+        for (const auto& v : st.values) {
+            if (not v.data or (type and v.data->type != type->id))
+                continue;
+            if (v.data->id == keep.second and st.id == keep.first)
+                continue;
+            auto ttl = std::chrono::duration_cast<std::chrono::seconds>(v.time + getType(v.data->type).expiration - now).count();
+            auto vsize = v.size;
+            double score = std::max<double>(ttl, 0) * (1 + st.hits) / (1 + vsize);
+            candidates.push_back({score, i, v.data->id, vsize});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.score < b.score;
+    });
+
+    std::map<size_t, std::set<Value::Id>> evicted;
+    size_t freed = 0;
+    for (const auto& c : candidates) {
+        if (size - freed <= target)
+            break;
+        evicted[c.storage].insert(c.id);
+        freed += c.size;
+    }
+    for (const auto& e : evicted) {
+        auto& st = store[e.first];
+        st.removeIf([&](const ValueStorage& v) {
+            if (not v.data or e.second.find(v.data->id) == e.second.end())
+                return false;
+            storageValueRemoved(st.id, v);
+            evicted_values++;
+            evicted_size += v.size;
+            return true;
+        });
+    }
+    if (freed)
+        DHT_WARN("Evicted %lu bytes of values (%lu stored).", freed, total_store_size);
+    return freed;
+}
+
+size_t
+Dht::trimStorage(size_t max_size)
+{
+    return evictValues(total_store_size, max_size);
+}
+
+Dht::StorageStats
+Dht::getStorageStats() const
+{
+    StorageStats stats;
+    stats.keys = store.size();
+    for (const auto& st : store)
+        stats.values += st.values.size();
+    stats.size = total_store_size;
+    stats.max_size = max_store_size;
+    stats.type_size = total_type_size;
+    stats.sources = source_store_size.size();
+    stats.evicted_values = evicted_values;
+    stats.evicted_size = evicted_size;
+    return stats;
+}
+
+std::string
+Dht::StorageStats::toString() const
+{
+    std::stringstream ss;
+    ss << "Storage: " << keys << " keys, " << values << " values, "
+       << size << " / " << max_size << " bytes, " << sources << " sources" << std::endl;
+    for (const auto& t : type_size)
+        ss << "   type " << t.first << ": " << t.second << " bytes" << std::endl;
+    ss << "Evicted: " << evicted_values << " values, " << evicted_size << " bytes" << std::endl;
+    return ss.str();
+}
+
+Dht::ValueStorage*
+Dht::Storage::getById(Value::Id vid)
+{
+    auto it = values_index.find(vid);
+    return it != values_index.end() ? &values[it->second] : nullptr;
+}
+
+std::pair<Dht::ValueStorage*, bool>
+Dht::Storage::store(const std::shared_ptr<Value>& value, time_point created, size_t max_values)
+{
+    if (auto vs = getById(value->id)) {
+        /* Already there, only need to refresh */
+        vs->time = created;
+        if (vs->data == value)
+            return {vs, false};
+        removeSize(*vs);
+        vs->data = value;
+        vs->size = value->size();
+        addSize(*vs);
+        return {vs, true};
+    }
+    if (values.size() >= max_values)
+        return {nullptr, false};
+    values_index[value->id] = values.size();
+    values.emplace_back(value, created);
+    addSize(values.back());
+    return {&values.back(), true};
+}
+
+size_t
+Dht::Storage::removeIf(const std::function<bool(const ValueStorage&)>& remove)
+{
+    // put elements to remove at the end with std::partition,
+    // and then remove them with std::vector::erase.
+    auto end = std::partition(values.begin(), values.end(), [&](const ValueStorage& v) {
+        return not remove(v);
+    });
+    size_t removed = std::distance(end, values.end());
+    if (not removed)
+        return 0;
+    for (auto it = end; it != values.end(); ++it)
+        if (it->data)
+            removeSize(*it);
+    values.erase(end, values.end());
+
+    // positions changed
+    values_index.clear();
+    for (size_t i = 0; i < values.size(); i++)
+        values_index[values[i].data->id] = i;
+    return removed;
+}
+
+void
+Dht::Storage::addSize(const ValueStorage& v)
+{
+    total_size += v.size;
+    type_size[v.data->type] += v.size;
+}
+
+void
+Dht::Storage::removeSize(const ValueStorage& v)
+{
+    total_size -= v.size;
+    auto ts = type_size.find(v.data->type);
+    if (ts != type_size.end() and (ts->second -= v.size) == 0)
+        type_size.erase(ts);
 }
 
 void
@@ -1805,6 +2276,7 @@ Dht::storageAddListener(const InfoHash& id, const InfoHash& node, const sockaddr
         if (store.size() >= MAX_HASHES)
             return;
         store.push_back(Storage {id, now});
+        metrics->storage_keys.set(store.size());
         st = &store.back();
     }
     sa_family_t af = from->sa_family;
@@ -1819,11 +2291,16 @@ Dht::storageAddListener(const InfoHash& id, const InfoHash& node, const sockaddr
         l->refresh(from, fromlen, tid, now);
 }
 
-void
-Dht::expireStorage()
+bool
+Dht::expireStorage(time_point deadline)
 {
-    auto i = store.begin();
-    while (i != store.end()) {
+    auto i = store.begin() + std::min(expire_storage_pos, store.size());
+    for (unsigned n = 0; i != store.end(); n++) {
+        // At least one key is expired by each call.
+        if (n and clock::now() >= deadline) {
+            expire_storage_pos = i - store.begin();
+            return false;
+        }
         // put elements to remove at the end with std::partition,
         // and then remove them with std::vector::erase.
         i->listeners.erase(
@@ -1838,26 +2315,30 @@ Dht::expireStorage()
                 }),
             i->listeners.end());
 
-        i->values.erase(
-            std::partition(i->values.begin(), i->values.end(),
-                [&](const ValueStorage& v)
-                {
-                    if (!v.data) return false; // should not happen
-                    const auto& type = getType(v.data->type);
-                    bool expired = v.time + type.expiration < now;
-                    if (expired)
-                        DHT_DEBUG("Discarding expired value %s", v.data->toString().c_str());
-                    return !expired;
-                }),
-            i->values.end());
+        i->removeIf([&](const ValueStorage& v)
+        {
+            if (!v.data) return true; // should not happen
+            const auto& type = getType(v.data->type);
+            bool expired = v.time + type.expiration < now;
+            if (expired) {
+                DHT_DEBUG("Discarding expired value %s", v.data->toString().c_str());
+                storageValueRemoved(i->id, v);
+            }
+            return expired;
+        });
 
         if ((i->values.empty() && i->listeners.empty()) || (!i->want4 && !i->want6)) {
             DHT_DEBUG("Discarding expired value %s", i->id.toString().c_str());
+            for (const auto& v : i->values)
+                storageValueRemoved(i->id, v);
             i = store.erase(i);
+            metrics->storage_keys.set(store.size());
         }
         else
             ++i;
     }
+    expire_storage_pos = 0;
+    return true;
 }
 
 void
@@ -2100,7 +2581,7 @@ Dht::getStorageLog() const
     using namespace std::chrono;
     std::stringstream out;
     for (const auto& st : store) {
-        out << "Storage " << st.id << " " << st.listeners.size() << " list., " << st.values.size() << " values:" << std::endl;
+        out << "Storage " << st.id << " " << st.listeners.size() << " list., " << st.values.size() << " values (" << st.total_size << " bytes):" << std::endl;
         for (const auto& l : st.listeners) {
             out << "   " << "Listener " << l.id << " " << print_addr((sockaddr*)&l.ss, l.sslen);
             auto since = duration_cast<seconds>(now - l.time);
@@ -2139,24 +2620,49 @@ Dht::getSearchesLog(sa_family_t af) const
     return out.str();
 }
 
+void
+Dht::setSearchTracing(bool enabled)
+{
+    search_tracing = enabled;
+    if (not enabled)
+        for (auto& sr : searches)
+            sr.trace.reset();
+}
+
+std::vector<SearchTrace>
+Dht::getSearchTraces() const
+{
+    std::vector<SearchTrace> ret;
+    for (const auto& sr : searches)
+        if (sr.trace)
+            ret.emplace_back(*sr.trace);
+    return ret;
+}
+
+Dht::Dht() : metrics_registry(std::make_shared<metrics::Registry>()), metrics(new Metrics(*metrics_registry))
+{}
+
 Dht::Dht(int s, int s6, Config config)
- : dht_socket(s), dht_socket6(s6), myid(config.node_id), is_bootstrap(config.is_bootstrap),
-   now(clock::now()), mybucket_grow_time(now), mybucket6_grow_time(now)
+ : Dht(std::unique_ptr<Transport>(new UdpTransport(s, s6)), config)
+{}
+
+Dht::Dht(std::unique_ptr<Transport>&& t, Config config)
+ : transport(std::move(t)), time_source(config.time_source),
+   rd(config.random_seed ? config.random_seed : crypto::random_device{}()),
+   myid(config.node_id), is_bootstrap(config.is_bootstrap), allow_loopback(config.allow_loopback),
+   max_store_size(config.max_store_size ? config.max_store_size : DEFAULT_STORAGE_LIMIT),
+   max_store_size_per_ip(config.max_store_size_per_ip ? config.max_store_size_per_ip : DEFAULT_STORAGE_LIMIT_PER_IP),
+   now(getTime()), mybucket_grow_time(now), mybucket6_grow_time(now),
+   metrics_registry(std::make_shared<metrics::Registry>()), metrics(new Metrics(*metrics_registry))
 {
-    if (s < 0 && s6 < 0)
+    if (not isRunning())
         return;
 
-    if (s >= 0) {
+    if (isRunning(AF_INET))
         buckets = {Bucket {AF_INET}};
-        if (!set_nonblocking(s, 1))
-            throw DhtException("Can't set socket to non-blocking mode");
-    }
 
-    if (s6 >= 0) {
+    if (isRunning(AF_INET6))
         buckets6 = {Bucket {AF_INET6}};
-        if (!set_nonblocking(s6, 1))
-            throw DhtException("Can't set socket to non-blocking mode");
-    }
 
     search_id = std::uniform_int_distribution<decltype(search_id)>{}(rd);
 
@@ -2173,6 +2679,9 @@ Dht::Dht(int s, int s6, Config config)
     expireBuckets(buckets);
     expireBuckets(buckets6);
 
+    if (not config.storage_path.empty())
+        setStorageBackend(std::unique_ptr<ValueStore>(new LogValueStore(config.storage_path, time_source)));
+
     DHT_DEBUG("DHT initialised with node ID %s", myid.toString().c_str());
 }
 
@@ -2218,8 +2727,8 @@ Dht::neighbourhoodMaintenance(RoutingTable& list)
 
     /* Since our node-id is the same in both DHTs, it's probably
        profitable to query both families. */
-    want_t want = dht_socket >= 0 && dht_socket6 >= 0 ? (WANT4 | WANT6) : -1;
-    auto n = q->randomNode();
+    want_t want = isRunning(AF_INET) && isRunning(AF_INET6) ? (WANT4 | WANT6) : -1;
+    auto n = q->randomNode(rd);
     if (n) {
         DHT_DEBUG("[find %s IPv%c] sending find for neighborhood maintenance.", id.toString().c_str(), q->af == AF_INET6 ? '6' : '4');
         sendFindNode((sockaddr*)&n->ss, n->sslen,
@@ -2242,7 +2751,7 @@ Dht::bucketMaintenance(RoutingTable& list)
             /* This bucket hasn't seen any positive confirmation for a long
                time.  Pick a random id in this bucket's range, and send
                a request to a random node. */
-            InfoHash id = list.randomId(b);
+            InfoHash id = list.randomId(b, rd);
             auto q = b;
             /* If the bucket is empty, we try to fill it from a neighbour.
                We also sometimes do it gratuitiously to recover from
@@ -2255,11 +2764,11 @@ Dht::bucketMaintenance(RoutingTable& list)
                     q = r;
             }
 
-            auto n = q->randomNode();
+            auto n = q->randomNode(rd);
             if (n) {
                 want_t want = -1;
 
-                if (dht_socket >= 0 && dht_socket6 >= 0) {
+                if (isRunning(AF_INET) && isRunning(AF_INET6)) {
                     auto otherbucket = findBucket(id, q->af == AF_INET ? AF_INET6 : AF_INET);
                     if (otherbucket && otherbucket->nodes.size() < TARGET_NODES)
                         /* The corresponding bucket in the other family
@@ -2332,16 +2841,20 @@ Dht::maintainStorage(InfoHash id, bool force, DoneCallback donecb) {
 }
 
 void
-Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, socklen_t fromlen)
+Dht::processMessage(const uint8_t *buf, size_t buflen, const SharedBlob& packet, const sockaddr *from, socklen_t fromlen)
 {
     if (buflen == 0)
         return;
+    metrics->bytes_received.add(buflen);
 
-    if (isMartian(from, fromlen))
+    if (isRejected(from, fromlen)) {
+        metrics->dropped[Metrics::DROP_REJECTED]->add();
         return;
+    }
 
     if (isNodeBlacklisted(from, fromlen)) {
         DHT_DEBUG("Received packet from blacklisted node.");
+        metrics->dropped[Metrics::DROP_BLACKLISTED]->add();
         return;
     }
 
@@ -2349,18 +2862,22 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
 
     ParsedMessage msg;
     try {
-        msgpack::unpacked msg_res = msgpack::unpack((const char*)buf, buflen);
-        msg.msgpack_unpack(msg_res.get());
+        // Parsed values copy what they need from buf, or share packet:
+        // buf outlives msg_res.
+        msgpack::unpacked msg_res = unpackMsgNoCopy(buf, buflen);
+        msg.msgpack_unpack(msg_res.get(), now, packet);
         if (msg.type != MessageType::Error && msg.id == zeroes)
             throw DhtException("no or invalid InfoHash");
     } catch (const std::exception& e) {
         DHT_WARN("Can't process message of size %lu: %s.", buflen, e.what());
         DHT_DEBUG.logPrintable(buf, buflen);
+        metrics->dropped[Metrics::DROP_MALFORMED]->add();
         return;
     }
 
     if (msg.id == myid) {
         DHT_DEBUG("Received message from self.");
+        metrics->dropped[Metrics::DROP_SELF]->add();
         return;
     }
 
@@ -2368,15 +2885,18 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
         /* Rate limit requests. */
         if (!rateLimit()) {
             DHT_WARN("Dropping request due to rate limiting.");
+            metrics->dropped[Metrics::DROP_RATE_LIMITED]->add();
             return;
         }
     }
+    metrics->received[(size_t)msg.type]->add();
 
     //std::cout << "Message from " << id << " IPv" << (from->sa_family==AF_INET?'4':'6') << std::endl;
     uint16_t ttid = 0;
 
     switch (msg.type) {
     case MessageType::Error:
+        metrics->error(false, msg.error_code).add();
         if (msg.tid.length != 4) return;
         if (msg.error_code == 401 && msg.id != zeroes && (msg.tid.matches(TransPrefix::ANNOUNCE_VALUES, &ttid) || msg.tid.matches(TransPrefix::LISTEN, &ttid))) {
             auto esr = findSearch(ttid, from->sa_family);
@@ -2412,7 +2932,8 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
         }
         if (msg.tid.matches(TransPrefix::PING)) {
             DHT_DEBUG("[node %s %s] Pong!", msg.id.toString().c_str(), print_addr(from, fromlen).c_str());
-            newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
+            auto n = newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
+            metrics->replied(Metrics::PING, n);
         } else if (msg.tid.matches(TransPrefix::FIND_NODE) or msg.tid.matches(TransPrefix::GET_VALUES)) {
             bool gp = false;
             Search *sr = nullptr;
@@ -2430,6 +2951,15 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                 n = newNode(msg.id, from, fromlen, 1);
             } else {
                 n = newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
+                metrics->replied(gp ? Metrics::GET : Metrics::FIND, n);
+                std::vector<InfoHash> learned;
+                unsigned hops = 1;
+                if (sr)
+                    for (const auto& sn : sr->nodes)
+                        if (sn.node == n) {
+                            hops = sn.hops + 1;
+                            break;
+                        }
                 for (unsigned i = 0; i < msg.nodes4.size() / 26; i++) {
                     uint8_t *ni = msg.nodes4.data() + i * 26;
                     const InfoHash& ni_id = *reinterpret_cast<InfoHash*>(ni);
@@ -2442,7 +2972,8 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     memcpy(&sin.sin_port, ni + ni_id.size() + 4, 2);
                     auto sn = newNode(ni_id, (sockaddr*)&sin, sizeof(sin), 0);
                     if (sn && sr && sr->af == AF_INET) {
-                        sr->insertNode(sn, now);
+                        if (sr->insertNode(sn, now, {}, hops) and sr->trace)
+                            learned.emplace_back(sn->id);
                     }
                 }
                 for (unsigned i = 0; i < msg.nodes6.size() / 38; i++) {
@@ -2457,9 +2988,13 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     memcpy(&sin6.sin6_port, ni + HASH_LEN + 16, 2);
                     auto sn = newNode(*ni_id, (sockaddr*)&sin6, sizeof(sin6), 0);
                     if (sn && sr && sr->af == AF_INET6) {
-                        sr->insertNode(sn, now);
+                        if (sr->insertNode(sn, now, {}, hops) and sr->trace)
+                            learned.emplace_back(sn->id);
                     }
                 }
+                if (sr and sr->trace and n)
+                    sr->trace->replyReceived(SearchTrace::Request::Get, n->id, n->getAddrStr(), now,
+                        std::move(learned), msg.values.size());
                 if (sr) {
                     /* Since we received a reply, the number of
                        requests in flight has decreased.  Let's push
@@ -2478,6 +3013,18 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     DHT_DEBUG("[search %s IPv%c] found %u values",
                         sr->id.toString().c_str(), sr->af == AF_INET ? '4' : '6',
                         msg.values.size());
+                    // Nodes would refuse values we announce if they store a newer version.
+                    for (const auto& v : msg.values) {
+                        auto a = std::find_if(sr->announce.begin(), sr->announce.end(), [&](const Announce& a) {
+                            return a.value and a.value->id == v->id;
+                        });
+                        if (a != sr->announce.end() and isOutdated(sr->id, *a->value, *v)) {
+                            DHT_WARN("[search %s IPv%c] [value %lu] a newer version is stored, failing put",
+                                sr->id.toString().c_str(), sr->af == AF_INET ? '4' : '6', v->id);
+                            failPut(sr->id, v->id);
+                        }
+                    }
+                    auto t = clock::now();
                     for (auto& cb : sr->callbacks) {
                         if (!cb.get_cb) continue;
                         std::vector<std::shared_ptr<Value>> tmp;
@@ -2499,6 +3046,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     }
                     for (auto& l : tmp_lists)
                         l.first(l.second);
+                    metrics->get_callback_time.observe(clock::now() - t);
                 }
                 // Force to recompute the next step time
                 if (sr->isSynced(now))
@@ -2515,6 +3063,9 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     msg.values.size());
 
                 auto n = newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
+                metrics->replied(Metrics::PUT, n);
+                if (sr->trace and n)
+                    sr->trace->replyReceived(SearchTrace::Request::Put, n->id, n->getAddrStr(), now);
                 for (auto& sn : sr->nodes)
                     if (sn.node == n) {
                         auto it = sn.acked.emplace(msg.value_id, SearchNode::RequestStatus{});
@@ -2532,8 +3083,12 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     auto type = getType(a.value->type);
                     if (sr->isAnnounced(msg.value_id, type, now)) {
                         if (a.callback) {
+                            if (sr->trace)
+                                sr->trace->operationDone(SearchTrace::Request::Put, true, now);
+                            auto t = clock::now();
                             a.callback(true, sr->getNodes());
                             a.callback = nullptr;
+                            metrics->done_callback_time.observe(clock::now() - t);
                         }
                         if (a.created + type.expiration < now) {
                             return true;
@@ -2551,6 +3106,9 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                 newNode(msg.id, from, fromlen, 1);
             } else {
                 auto n = newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
+                metrics->replied(Metrics::LISTEN, n);
+                if (sr->trace and n)
+                    sr->trace->replyReceived(SearchTrace::Request::Listen, n->id, n->getAddrStr(), now);
                 for (auto& sn : sr->nodes)
                     if (sn.node == n) {
                         sn.listenStatus.reply_time = now;
@@ -2588,6 +3146,8 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
         } else {
             Storage* st = findStorage(msg.info_hash);
             Blob ntoken = makeToken(from, false);
+            if (st)
+                st->hits++;
             if (st && st->values.size() > 0) {
                  DHT_DEBUG("[node %s %s] sending %u values.", msg.id.toString().c_str(), print_addr(from, fromlen).c_str(), st->values.size());
                  sendClosestNodes(from, fromlen, msg.tid, msg.info_hash, msg.want, ntoken, st->values);
@@ -2608,10 +3168,11 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
             sendError(from, fromlen, msg.tid, 203, "Put with no info_hash");
             break;
         }
-        if (!tokenMatch(msg.token, from)) {
+        if (check_tokens and !tokenMatch(msg.token, from)) {
             DHT_WARN("[node %s %s] incorrect token %s for 'put'.",
                 msg.id.toString().c_str(), print_addr(from, fromlen).c_str(),
                 msg.info_hash.toString().c_str(), to_hex(msg.token.data(), msg.token.size()).c_str());
+            metrics->dropped[Metrics::DROP_WRONG_TOKEN]->add();
             sendError(from, fromlen, msg.tid, 401, "Put with wrong token", true);
             break;
         }
@@ -2631,7 +3192,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                 const auto& type = getType(lv->type);
                 if (type.editPolicy(msg.info_hash, lv, vc, msg.id, from, fromlen)) {
                     DHT_DEBUG("Editing value of type %s belonging to %s at %s.", type.name.c_str(), v->owner.getId().toString().c_str(), msg.info_hash.toString().c_str());
-                    storageStore(msg.info_hash, vc, msg.created);
+                    storageStore(msg.info_hash, vc, msg.created, from, fromlen);
                 } else {
                     DHT_WARN("Rejecting edition of type %s belonging to %s at %s because of storage policy.", type.name.c_str(), v->owner.getId().toString().c_str(), msg.info_hash.toString().c_str());
                 }
@@ -2640,7 +3201,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                 const auto& type = getType(vc->type);
                 if (type.storePolicy(msg.info_hash, vc, msg.id, from, fromlen)) {
                     DHT_DEBUG("Storing value of type %s belonging to %s at %s.", type.name.c_str(), v->owner.getId().toString().c_str(), msg.info_hash.toString().c_str());
-                    storageStore(msg.info_hash, vc, msg.created);
+                    storageStore(msg.info_hash, vc, msg.created, from, fromlen);
                 } else {
                     DHT_WARN("Rejecting storage of type %s belonging to %s at %s because of storage policy.", type.name.c_str(), v->owner.getId().toString().c_str(), msg.info_hash.toString().c_str());
                 }
@@ -2660,10 +3221,11 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
             sendError(from, fromlen, msg.tid, 203, "Listen with no info_hash");
             break;
         }
-        if (!tokenMatch(msg.token, from)) {
+        if (check_tokens and !tokenMatch(msg.token, from)) {
             DHT_WARN("[node %s %s] incorrect token %s for 'listen'.",
                 msg.id.toString().c_str(), print_addr(from, fromlen).c_str(),
                 msg.info_hash.toString().c_str(), to_hex(msg.token.data(), msg.token.size()).c_str());
+            metrics->dropped[Metrics::DROP_WRONG_TOKEN]->add();
             sendError(from, fromlen, msg.tid, 401, "Listen with wrong token", true);
             break;
         }
@@ -2680,28 +3242,65 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
 time_point
 Dht::periodic(const uint8_t *buf, size_t buflen,
              const sockaddr *from, socklen_t fromlen)
+{
+    return runPeriodic(buf, buflen, {}, from, fromlen);
+}
+
+time_point
+Dht::periodic(const SharedBlob& packet, const sockaddr *from, socklen_t fromlen)
+{
+    return runPeriodic(packet.data(), packet.size(), packet, from, fromlen);
+}
+
+time_point
+Dht::runPeriodic(const uint8_t *buf, size_t buflen, const SharedBlob& packet,
+                const sockaddr *from, socklen_t fromlen)
 {
     using namespace std::chrono;
-    now = clock::now();
+    now = getTime();
+    // Phases are timed with the real clock, even if the Dht time is provided.
+    auto t = clock::now();
+
+    runPendingCompletions();
+    processMessage(buf, buflen, packet, from, fromlen);
+    t = phaseDone(Phase::ProcessMessage, t);
 
-    processMessage(buf, buflen, from, fromlen);
+    // Maintenance jobs stop at the deadline and resume at the next call,
+    // so that a call can't hold the incoming messages for long.
+    const auto deadline = maintenance_budget == duration::zero() ? time_point::max() : t + maintenance_budget;
 
-    if (now >= rotate_secrets_time)
+    if (now >= rotate_secrets_time) {
         rotateSecrets();
+        t = phaseDone(Phase::RotateSecrets, t);
+    }
 
     if (now >= expire_stuff_time) {
         expireBuckets(buckets);
         expireBuckets(buckets6);
-        expireStorage();
+        t = phaseDone(Phase::ExpireBuckets, t);
         expireSearches();
+        t = phaseDone(Phase::ExpireSearches, t);
+        expiring_storage = true;
+    }
+
+    if (expiring_storage) {
+        expiring_storage = not expireStorage(deadline);
+        t = phaseDone(Phase::ExpireStorage, t);
     }
 
     if (now > search_time) {
         search_time = time_point::max();
+        unsigned stepped = 0;
         for (auto& sr : searches) {
             auto step = sr.getNextStepTime(types, now);
             if (step <= now) {
+                if (stepped and clock::now() >= deadline) {
+                    // step the remaining searches at the next call
+                    search_time = now;
+                    break;
+                }
                 searchStep(sr);
+                stepped++;
                 step = sr.getNextStepTime(types, now);
             }
             search_time = std::min(search_time, step);
@@ -2710,6 +3309,7 @@ Dht::periodic(const uint8_t *buf, size_t buflen,
             DHT_DEBUG("next search time : (none)");
         else
             DHT_DEBUG("next search time : %lf s%s", print_dt(search_time-now), (search_time < now)?" (ASAP)":"");*/
+        t = phaseDone(Phase::SearchStep, t);
     }
 
     if (now >= confirm_nodes_time) {
@@ -2721,12 +3321,14 @@ Dht::periodic(const uint8_t *buf, size_t buflen,
 
         soon |= bucketMaintenance(buckets);
         soon |= bucketMaintenance(buckets6);
+        t = phaseDone(Phase::BucketMaintenance, t);
 
         if (!soon) {
             if (mybucket_grow_time >= now - seconds(150))
                 soon |= neighbourhoodMaintenance(buckets);
             if (mybucket6_grow_time >= now - seconds(150))
                 soon |= neighbourhoodMaintenance(buckets6);
+            t = phaseDone(Phase::NeighbourhoodMaintenance, t);
         }
 
         /* In order to maintain all buckets' age within 600 seconds, worst
@@ -2739,18 +3341,74 @@ Dht::periodic(const uint8_t *buf, size_t buflen,
         confirm_nodes_time = now + time_dis(rd);
     }
 
+    if (now >= import_ping_time) {
+        sendImportPings();
+        t = phaseDone(Phase::BucketMaintenance, t);
+    }
+
     //data persistence
     time_point storage_maintenance_time = time_point::max();
+    unsigned maintained = 0;
     for (auto &str : store) {
         if (now > str.maintenance_time) {
+            if (maintained and clock::now() >= deadline) {
+                // maintain the remaining keys at the next call
+                storage_maintenance_time = now;
+                break;
+            }
             maintainStorage(str.id);
+            maintained++;
             str.maintenance_time = now + MAX_STORAGE_MAINTENANCE_EXPIRE_TIME;
 
         }
         storage_maintenance_time = std::min(storage_maintenance_time, str.maintenance_time);
     }
+    t = phaseDone(Phase::StorageMaintenance, t);
+
+    if (storage_backend) {
+        try {
+            storage_maintenance_time = std::min(storage_maintenance_time, storage_backend->sync());
+        } catch (const std::exception& e) {
+            DHT_ERROR("Can't write stored values: %s", e.what());
+        }
+        phaseDone(Phase::StorageSync, t);
+    }
+
+    if (expiring_storage)
+        return now;
+    return std::min({confirm_nodes_time, search_time, storage_maintenance_time, import_ping_time});
+}
+
+time_point
+Dht::phaseDone(Phase p, time_point start)
+{
+    auto end = clock::now();
+    auto d = end - start;
+    auto& st = phase_stats[(size_t)p];
+    st.calls++;
+    st.total += d;
+    st.max = std::max(st.max, d);
+    metrics->phases[(size_t)p]->observe(d);
+    if (phase_budget != duration::zero() and d > phase_budget) {
+        DHT_WARN("Slow periodic phase %s: %lf s (budget %lf s)", getPhaseName(p), print_dt(d), print_dt(phase_budget));
+        end = clock::now();
+    }
+    return end;
+}
 
-    return std::min(confirm_nodes_time, std::min(search_time, storage_maintenance_time));
+const char*
+Dht::getPhaseName(Phase p)
+{
+    return PHASE_NAMES[(size_t)p];
+}
+
+std::array<Dht::PhaseStats, Dht::PHASE_COUNT>
+Dht::getPhaseStats(bool reset)
+{
+    auto ret = phase_stats;
+    if (reset)
+        phase_stats = {};
+    return ret;
 }
 
 std::vector<Dht::ValuesExport>
@@ -2806,8 +3464,8 @@ Dht::importValues(const std::vector<ValuesExport>& import)
                     DHT_DEBUG("Discarding expired value at %s", h.first.toString().c_str());
                     continue;
                 }
-                auto st = storageStore(h.first, std::make_shared<Value>(std::move(tmp_val)));
-                st->time = val_time;
+                if (auto st = storageStore(h.first, std::make_shared<Value>(std::move(tmp_val))))
+                    st->time = val_time;
             }
         } catch (const std::exception&) {
             DHT_ERROR("Error reading values at %s", h.first.toString().c_str());
@@ -2817,43 +3475,583 @@ Dht::importValues(const std::vector<ValuesExport>& import)
 }
 
 
+// Snapshot file: header, then one record per value.
+// Header: magic, version (32 bits), record header size (32 bits), value count (64 bits).
+// Record: key, creation time (64 bits), value size (32 bits), packed value.
+// Readers skip record header fields they don't know, added by later versions.
+static constexpr std::array<char, 8> SNAPSHOT_MAGIC {{'D', 'H', 'T', 'V', 'A', 'L', 'S', '\0'}};
+static constexpr uint32_t SNAPSHOT_VERSION {1};
+static constexpr size_t SNAPSHOT_HEADER_SIZE {SNAPSHOT_MAGIC.size() + 4 + 4 + 8};
+static constexpr size_t SNAPSHOT_RECORD_HEADER_SIZE {HASH_LEN + 8 + 4};
+// Snapshots are written by chunks of this size.
+static constexpr size_t SNAPSHOT_BUFFER_SIZE {1024 * 1024};
+// Below this number of values, snapshots are decoded by a single thread.
+static constexpr size_t SNAPSHOT_PARALLEL_MIN {4096};
+
+static void
+writeAll(int fd, const Blob& b)
+{
+    size_t pos = 0;
+    while (pos < b.size()) {
+        auto n = ::write(fd, b.data() + pos, b.size() - pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw DhtException(std::string("Can't write snapshot: ") + strerror(errno));
+        }
+        pos += n;
+    }
+}
+
+Dht::ValuesSnapshot
+Dht::snapshotValues() const
+{
+    ValuesSnapshot snapshot;
+    size_t n = 0;
+    for (const auto& h : store)
+        n += h.values.size();
+    snapshot.values.reserve(n);
+    for (const auto& h : store)
+        for (const auto& v : h.values)
+            snapshot.values.push_back({h.id, v.data, to_time_t(v.time, now)});
+    return snapshot;
+}
+
+void
+Dht::ValuesSnapshot::write(int fd) const
+{
+    Blob buffer;
+    buffer.reserve(SNAPSHOT_BUFFER_SIZE + MAX_VALUE_SIZE);
+    buffer.insert(buffer.end(), SNAPSHOT_MAGIC.begin(), SNAPSHOT_MAGIC.end());
+    buffer.resize(SNAPSHOT_HEADER_SIZE);
+    writeBE(buffer.data() + SNAPSHOT_MAGIC.size(), SNAPSHOT_VERSION, 4);
+    writeBE(buffer.data() + SNAPSHOT_MAGIC.size() + 4, SNAPSHOT_RECORD_HEADER_SIZE, 4);
+    writeBE(buffer.data() + SNAPSHOT_MAGIC.size() + 8, values.size(), 8);
+
+    std::array<uint8_t, SNAPSHOT_RECORD_HEADER_SIZE> header;
+    for (const auto& e : values) {
+        auto pos = buffer.size();
+        buffer.resize(pos + header.size());
+        {
+            BlobWriter w {buffer};
+            msgpack::packer<BlobWriter> pk(&w);
+            e.value->msgpack_pack(pk);
+        }
+        std::copy(e.key.begin(), e.key.end(), header.begin());
+        writeBE(header.data() + HASH_LEN, (int64_t)e.created, 8);
+        writeBE(header.data() + HASH_LEN + 8, buffer.size() - pos - header.size(), 4);
+        std::copy(header.begin(), header.end(), buffer.begin() + pos);
+        if (buffer.size() >= SNAPSHOT_BUFFER_SIZE) {
+            writeAll(fd, buffer);
+            buffer.clear();
+        }
+    }
+    writeAll(fd, buffer);
+}
+
+void
+Dht::ValuesSnapshot::write(const std::string& path) const
+{
+    auto tmp_path = path + ".tmp";
+#ifndef _WIN32
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+#else
+    int fd = _open(tmp_path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#endif
+    if (fd < 0)
+        throw DhtException("Can't open snapshot " + tmp_path);
+    try {
+        write(fd);
+#ifndef _WIN32
+        if (fsync(fd) != 0)
+            throw DhtException("Can't write snapshot " + tmp_path);
+        close(fd);
+#else
+        _close(fd);
+#endif
+    } catch (...) {
+#ifndef _WIN32
+        close(fd);
+#else
+        _close(fd);
+#endif
+        std::remove(tmp_path.c_str());
+        throw;
+    }
+#ifdef _WIN32
+    std::remove(path.c_str());
+#endif
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        throw DhtException("Can't write snapshot " + path);
+    }
+}
+
+size_t
+Dht::importValues(const std::string& path)
+{
+    now = getTime();
+    // Map the file in memory: values are decoded in place.
+    const uint8_t* dat;
+    size_t size;
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw DhtException("Can't open snapshot " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw DhtException("Can't read snapshot " + path);
+    }
+    size = st.st_size;
+    void* map = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+        throw DhtException("Can't read snapshot " + path);
+    std::unique_ptr<void, std::function<void(void*)>> unmap {map, [size](void* p) { munmap(p, size); }};
+    dat = (const uint8_t*)map;
+#else
+    Blob file;
+    {
+        std::ifstream f(path, std::ios::binary);
+        if (not f)
+            throw DhtException("Can't open snapshot " + path);
+        file = {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+    }
+    dat = file.data();
+    size = file.size();
+#endif
+
+    if (size < SNAPSHOT_HEADER_SIZE or not std::equal(SNAPSHOT_MAGIC.begin(), SNAPSHOT_MAGIC.end(), (const char*)dat))
+        throw DhtException("Not a value snapshot: " + path);
+    auto version = readBE(dat + SNAPSHOT_MAGIC.size(), 4);
+    auto record_header_size = readBE(dat + SNAPSHOT_MAGIC.size() + 4, 4);
+    auto count = readBE(dat + SNAPSHOT_MAGIC.size() + 8, 8);
+    if (version < 1 or record_header_size < SNAPSHOT_RECORD_HEADER_SIZE)
+        throw DhtException("Unsupported snapshot version: " + path);
+
+    // Locate records, then decode them in parallel.
+    struct Record {
+        InfoHash key;
+        time_point created;
+        const uint8_t* data;
+        size_t size;
+        std::shared_ptr<Value> value;
+    };
+    std::vector<Record> records;
+    records.reserve(std::min<uint64_t>(count, size / record_header_size));
+    size_t pos = SNAPSHOT_HEADER_SIZE;
+    while (pos + record_header_size <= size) {
+        Record r;
+        std::copy_n(dat + pos, HASH_LEN, r.key.begin());
+        r.created = from_time_t((int64_t)readBE(dat + pos + HASH_LEN, 8), now);
+        r.size = readBE(dat + pos + HASH_LEN + 8, 4);
+        r.data = dat + pos + record_header_size;
+        if (r.size > size - pos - record_header_size)
+            break;
+        pos += record_header_size + r.size;
+        records.emplace_back(std::move(r));
+    }
+    if (records.size() != count)
+        DHT_WARN("Snapshot %s is truncated: %lu of %lu values.", path.c_str(), records.size(), (unsigned long)count);
+
+    auto decode = [&records](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            auto& r = records[i];
+            try {
+                auto msg = unpackMsgNoCopy(r.data, r.size);
+                r.value = std::make_shared<Value>(msg.get());
+            } catch (const std::exception&) {}
+        }
+    };
+    unsigned threads = records.size() >= SNAPSHOT_PARALLEL_MIN ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+    std::vector<std::thread> workers;
+    size_t chunk = (records.size() + threads - 1) / threads;
+    for (unsigned t = 1; t < threads; t++)
+        workers.emplace_back(decode, std::min(records.size(), t * chunk), std::min(records.size(), (t + 1) * chunk));
+    decode(0, std::min(records.size(), chunk));
+    for (auto& w : workers)
+        w.join();
+
+    size_t imported = 0, invalid = 0;
+    for (const auto& r : records) {
+        if (not r.value) {
+            invalid++;
+            continue;
+        }
+        if (r.created + getType(r.value->type).expiration < now)
+            continue;
+        if (auto vs = storageStore(r.key, r.value, r.created)) {
+            vs->time = r.created;
+            imported++;
+        }
+    }
+    if (invalid)
+        DHT_ERROR("Can't read %lu values from snapshot %s", invalid, path.c_str());
+    DHT_DEBUG("Imported %lu of %lu values from snapshot %s", imported, records.size(), path.c_str());
+    return imported;
+}
+
+
+// Node file: magic, version (32 bits), then one record per node.
+// Record: node ID, address family (8 bits, 4 or 6), address, port (16 bits).
+static constexpr std::array<char, 8> NODES_MAGIC {{'D', 'H', 'T', 'N', 'O', 'D', 'E', 'S'}};
+static constexpr uint32_t NODES_VERSION {1};
+static constexpr size_t NODES_HEADER_SIZE {NODES_MAGIC.size() + 4};
+
+void
+saveNodes(const std::string& path, const std::vector<NodeExport>& nodes)
+{
+    Blob dat;
+    dat.reserve(NODES_HEADER_SIZE + nodes.size() * (HASH_LEN + 1 + 16 + 2));
+    dat.insert(dat.end(), NODES_MAGIC.begin(), NODES_MAGIC.end());
+    dat.resize(NODES_HEADER_SIZE);
+    writeBE(dat.data() + NODES_MAGIC.size(), NODES_VERSION, 4);
+    for (const auto& n : nodes) {
+        const uint8_t* addr;
+        size_t addr_len;
+        in_port_t port;
+        if (n.ss.ss_family == AF_INET) {
+            auto sin = (const sockaddr_in*)&n.ss;
+            addr = (const uint8_t*)&sin->sin_addr;
+            addr_len = 4;
+            port = sin->sin_port;
+        } else if (n.ss.ss_family == AF_INET6) {
+            auto sin6 = (const sockaddr_in6*)&n.ss;
+            addr = (const uint8_t*)&sin6->sin6_addr;
+            addr_len = 16;
+            port = sin6->sin6_port;
+        } else
+            continue;
+        dat.insert(dat.end(), n.id.begin(), n.id.end());
+        dat.push_back(addr_len == 4 ? 4 : 6);
+        dat.insert(dat.end(), addr, addr + addr_len);
+        // port is kept in network byte order
+        dat.insert(dat.end(), (const uint8_t*)&port, (const uint8_t*)&port + 2);
+    }
+
+    auto tmp_path = path + ".tmp";
+    {
+        std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+        if (not f.write((const char*)dat.data(), dat.size()) or not f.flush())
+            throw DhtException("Can't write nodes to " + tmp_path);
+    }
+#ifdef _WIN32
+    std::remove(path.c_str());
+#endif
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+        throw DhtException("Can't write nodes to " + path);
+}
+
+std::vector<NodeExport>
+loadNodes(const std::string& path)
+{
+    std::ifstream f(path, std::ios::binary);
+    if (not f)
+        return {};
+    Blob dat {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+    if (dat.size() < NODES_HEADER_SIZE or not std::equal(NODES_MAGIC.begin(), NODES_MAGIC.end(), (const char*)dat.data()))
+        throw DhtException("Not a node file: " + path);
+    if (readBE(dat.data() + NODES_MAGIC.size(), 4) != NODES_VERSION)
+        throw DhtException("Unsupported node file version: " + path);
+
+    std::vector<NodeExport> nodes;
+    size_t pos = NODES_HEADER_SIZE;
+    // A trailing partial record (interrupted write) is ignored.
+    while (pos + HASH_LEN + 1 <= dat.size()) {
+        NodeExport n {};
+        std::copy_n(dat.begin() + pos, HASH_LEN, n.id.begin());
+        auto family = dat[pos + HASH_LEN];
+        pos += HASH_LEN + 1;
+        size_t addr_len = family == 4 ? 4 : 16;
+        if (family != 4 and family != 6)
+            break;
+        if (pos + addr_len + 2 > dat.size())
+            break;
+        if (family == 4) {
+            auto sin = (sockaddr_in*)&n.ss;
+            sin->sin_family = AF_INET;
+            std::copy_n(dat.begin() + pos, 4, (uint8_t*)&sin->sin_addr);
+            std::copy_n(dat.begin() + pos + 4, 2, (uint8_t*)&sin->sin_port);
+            n.sslen = sizeof(sockaddr_in);
+        } else {
+            auto sin6 = (sockaddr_in6*)&n.ss;
+            sin6->sin6_family = AF_INET6;
+            std::copy_n(dat.begin() + pos, 16, (uint8_t*)&sin6->sin6_addr);
+            std::copy_n(dat.begin() + pos + 16, 2, (uint8_t*)&sin6->sin6_port);
+            n.sslen = sizeof(sockaddr_in6);
+        }
+        pos += addr_len + 2;
+        nodes.push_back(n);
+    }
+    return nodes;
+}
+
+/* Searches are exported as an array of
+   [id, address family (4 or 6), listening, nodes, announces], with
+   nodes: [[compact node info, [[value id, last announce ack time]...]]...]
+   announces: [[creation time, value]...] */
+Blob
+Dht::exportSearches() const
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    size_t n = std::count_if(searches.begin(), searches.end(), [](const Search& sr) {
+        return not sr.announce.empty() or not sr.listeners.empty();
+    });
+    pk.pack_array(n);
+    for (const auto& sr : searches) {
+        if (sr.announce.empty() and sr.listeners.empty())
+            continue;
+        pk.pack_array(5);
+        pk.pack(sr.id);
+        pk.pack(sr.af == AF_INET ? 4 : 6);
+        pk.pack(not sr.listeners.empty());
+
+        size_t nn = std::count_if(sr.nodes.begin(), sr.nodes.end(), [&](const SearchNode& sn) {
+            return not sn.node->isExpired(now);
+        });
+        pk.pack_array(nn);
+        for (const auto& sn : sr.nodes) {
+            if (sn.node->isExpired(now))
+                continue;
+            pk.pack_array(2);
+            uint8_t buf[HASH_LEN + 18];
+            size_t len = HASH_LEN;
+            std::copy(sn.node->id.begin(), sn.node->id.end(), buf);
+            if (sr.af == AF_INET) {
+                auto sin = (const sockaddr_in*)&sn.node->ss;
+                memcpy(buf + len, &sin->sin_addr, 4);
+                memcpy(buf + len + 4, &sin->sin_port, 2);
+                len += 6;
+            } else {
+                auto sin6 = (const sockaddr_in6*)&sn.node->ss;
+                memcpy(buf + len, &sin6->sin6_addr, 16);
+                memcpy(buf + len + 16, &sin6->sin6_port, 2);
+                len += 18;
+            }
+            pk.pack_bin(len);
+            pk.pack_bin_body((const char*)buf, len);
+
+            size_t na = std::count_if(sn.acked.begin(), sn.acked.end(), [](const SearchNode::AnnounceStatusMap::value_type& a) {
+                return a.second.reply_time != time_point::min();
+            });
+            pk.pack_array(na);
+            for (const auto& a : sn.acked) {
+                if (a.second.reply_time == time_point::min())
+                    continue;
+                pk.pack_array(2);
+                pk.pack(a.first);
+                pk.pack((int64_t)to_time_t(a.second.reply_time, now));
+            }
+        }
+
+        pk.pack_array(sr.announce.size());
+        for (const auto& a : sr.announce) {
+            pk.pack_array(2);
+            pk.pack((int64_t)to_time_t(a.created, now));
+            a.value->msgpack_pack(pk);
+        }
+    }
+    return {buffer.data(), buffer.data()+buffer.size()};
+}
+
+/* Imported searches start from their last known nodes rather than from
+   the routing table, and values acknowledged by a node are only announced
+   to it again when they are about to expire. */
+size_t
+Dht::importSearches(const Blob& dat)
+{
+    now = getTime();
+    size_t imported = 0;
+    try {
+        auto msg = unpackMsg(dat);
+        auto srarr = msg.get();
+        if (srarr.type != msgpack::type::ARRAY)
+            throw msgpack::type_error();
+        for (unsigned i = 0; i < srarr.via.array.size; i++) {
+            auto& o = srarr.via.array.ptr[i];
+            if (o.type != msgpack::type::ARRAY or o.via.array.size < 5)
+                throw msgpack::type_error();
+            InfoHash id {o.via.array.ptr[0]};
+            sa_family_t af = o.via.array.ptr[1].as<unsigned>() == 4 ? AF_INET : AF_INET6;
+            bool listening = o.via.array.ptr[2].as<bool>();
+            auto& nodes = o.via.array.ptr[3];
+            auto& announces = o.via.array.ptr[4];
+            if (nodes.type != msgpack::type::ARRAY or announces.type != msgpack::type::ARRAY)
+                throw msgpack::type_error();
+            if (not isRunning(af))
+                continue;
+            auto sr = getSearch(id, af);
+            if (not sr)
+                continue;
+
+            for (unsigned j = 0; j < nodes.via.array.size; j++) {
+                auto& no = nodes.via.array.ptr[j];
+                if (no.type != msgpack::type::ARRAY or no.via.array.size < 2 or no.via.array.ptr[1].type != msgpack::type::ARRAY)
+                    throw msgpack::type_error();
+                auto ni = unpackBlob(no.via.array.ptr[0]);
+                if (ni.size() != HASH_LEN + (af == AF_INET ? 6 : 18))
+                    throw msgpack::type_error();
+                InfoHash nid;
+                std::copy_n(ni.begin(), HASH_LEN, nid.begin());
+                sockaddr_storage ss;
+                socklen_t sslen;
+                std::fill_n((uint8_t*)&ss, sizeof(ss), 0);
+                if (af == AF_INET) {
+                    auto sin = (sockaddr_in*)&ss;
+                    sin->sin_family = AF_INET;
+                    memcpy(&sin->sin_addr, ni.data() + HASH_LEN, 4);
+                    memcpy(&sin->sin_port, ni.data() + HASH_LEN + 4, 2);
+                    sslen = sizeof(sockaddr_in);
+                } else {
+                    auto sin6 = (sockaddr_in6*)&ss;
+                    sin6->sin6_family = AF_INET6;
+                    memcpy(&sin6->sin6_addr, ni.data() + HASH_LEN, 16);
+                    memcpy(&sin6->sin6_port, ni.data() + HASH_LEN + 16, 2);
+                    sslen = sizeof(sockaddr_in6);
+                }
+                auto node = newNode(nid, (sockaddr*)&ss, sslen, 0);
+                if (not node)
+                    continue;
+                sr->insertNode(node, now);
+                auto sn = std::find_if(sr->nodes.begin(), sr->nodes.end(), [&](const SearchNode& sn) {
+                    return sn.node == node;
+                });
+                if (sn == sr->nodes.end())
+                    continue;
+                auto& acked = no.via.array.ptr[1];
+                for (unsigned k = 0; k < acked.via.array.size; k++) {
+                    auto& ao = acked.via.array.ptr[k];
+                    if (ao.type != msgpack::type::ARRAY or ao.via.array.size < 2)
+                        throw msgpack::type_error();
+                    auto vid = ao.via.array.ptr[0].as<Value::Id>();
+                    sn->acked[vid] = {TIME_INVALID, from_time_t(ao.via.array.ptr[1].as<int64_t>(), now)};
+                }
+            }
+
+            for (unsigned j = 0; j < announces.via.array.size; j++) {
+                auto& ao = announces.via.array.ptr[j];
+                if (ao.type != msgpack::type::ARRAY or ao.via.array.size < 2)
+                    throw msgpack::type_error();
+                auto created = from_time_t(ao.via.array.ptr[0].as<int64_t>(), now);
+                auto value = std::make_shared<Value>(ao.via.array.ptr[1]);
+                if (created + getType(value->type).expiration < now)
+                    continue;
+                auto a = std::find_if(sr->announce.begin(), sr->announce.end(), [&](const Announce& a) {
+                    return a.value->id == value->id;
+                });
+                if (a == sr->announce.end())
+                    sr->announce.emplace_back(Announce {value, created, {}});
+            }
+
+            bootstrapSearch(*sr);
+            if (sr->announce.empty() and sr->listeners.empty()) {
+                // Keep the nodes of listen-only searches until listening resumes.
+                sr->done = true;
+                sr->step_time = now;
+            } else
+                search_time = std::min(search_time, sr->getNextStepTime(types, now));
+            DHT_DEBUG("[search %s IPv%c] imported with %lu nodes, %lu puts%s", id.toString().c_str(), af == AF_INET ? '4' : '6',
+                sr->nodes.size(), sr->announce.size(), listening ? ", was listened" : "");
+            imported++;
+        }
+    } catch (const std::exception& e) {
+        DHT_ERROR("Error importing searches: %s", e.what());
+    }
+    return imported;
+}
+
+/* Nodes of every bucket are exported, including nodes that replied once
+   but are not good anymore: they are likely to be back after a restart.
+   Within a bucket, good nodes come first, then by round-trip time
+   (unknown last) and by most recent reply. */
 std::vector<NodeExport>
 Dht::exportNodes()
 {
     std::vector<NodeExport> nodes;
+    std::vector<std::shared_ptr<Node>> bucket_nodes;
+    auto exportBucket = [&](const Bucket& b) {
+        bucket_nodes.clear();
+        for (const auto& n : b.nodes)
+            if (n->reply_time != time_point::min() and not n->isExpired(now))
+                bucket_nodes.push_back(n);
+        std::sort(bucket_nodes.begin(), bucket_nodes.end(), [this](const std::shared_ptr<Node>& a, const std::shared_ptr<Node>& b) {
+            bool ag = a->isGood(now), bg = b->isGood(now);
+            if (ag != bg)
+                return ag;
+            if (a->rtt != b->rtt)
+                return b->rtt == duration::zero() or (a->rtt != duration::zero() and a->rtt < b->rtt);
+            return a->reply_time > b->reply_time;
+        });
+        for (const auto& n : bucket_nodes)
+            nodes.push_back(n->exportNode());
+    };
     const auto b4 = buckets.findBucket(myid);
-    if (b4 != buckets.end()) {
-        for (auto& n : b4->nodes)
-            if (n->isGood(now))
-                nodes.push_back(n->exportNode());
-    }
+    if (b4 != buckets.end())
+        exportBucket(*b4);
     const auto b6 = buckets6.findBucket(myid);
-    if (b6 != buckets6.end()) {
-        for (auto& n : b6->nodes)
-            if (n->isGood(now))
-                nodes.push_back(n->exportNode());
-    }
-    for (auto b = buckets.begin(); b != buckets.end(); ++b) {
-        if (b == b4) continue;
-        for (auto& n : b->nodes)
-            if (n->isGood(now))
-                nodes.push_back(n->exportNode());
-    }
-    for (auto b = buckets6.begin(); b != buckets6.end(); ++b) {
-        if (b == b6) continue;
-        for (auto& n : b->nodes)
-            if (n->isGood(now))
-                nodes.push_back(n->exportNode());
-    }
+    if (b6 != buckets6.end())
+        exportBucket(*b6);
+    for (auto b = buckets.begin(); b != buckets.end(); ++b)
+        if (b != b4)
+            exportBucket(*b);
+    for (auto b = buckets6.begin(); b != buckets6.end(); ++b)
+        if (b != b6)
+            exportBucket(*b);
     return nodes;
 }
 
+size_t
+Dht::importNodes(const std::vector<NodeExport>& import)
+{
+    now = getTime();
+    size_t inserted = 0;
+    for (const auto& n : import) {
+        auto sa = (const sockaddr*)&n.ss;
+        if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
+            continue;
+        if (newNode(n.id, sa, n.sslen, 0))
+            inserted++;
+    }
+
+    /* Validate the whole routing table rather than waiting for bucket
+       maintenance, pinging a few nodes at a time from periodic. */
+    import_pings.clear();
+    for (auto list : {&buckets, &buckets6})
+        for (auto& b : *list)
+            for (auto& n : b.nodes)
+                if (not n->isGood(now) and not n->isMessagePending(now))
+                    import_pings.emplace_back(n);
+    if (not import_pings.empty())
+        import_ping_time = now;
+    DHT_DEBUG("Imported %lu of %lu nodes, %lu to ping.", inserted, import.size(), import_pings.size());
+    return inserted;
+}
+
+void
+Dht::sendImportPings()
+{
+    unsigned pinged = 0;
+    while (pinged < IMPORT_PINGS and not import_pings.empty()) {
+        auto n = import_pings.front().lock();
+        import_pings.pop_front();
+        // Skip nodes dropped or heard from meanwhile
+        if (not n or n->isGood(now) or n->isMessagePending(now) or n->isExpired(now))
+            continue;
+        sendPing((sockaddr*)&n->ss, n->sslen, TransId {TransPrefix::PING});
+        n->requested(now);
+        pinged++;
+    }
+    import_ping_time = import_pings.empty() ? time_point::max() : now + IMPORT_PING_PERIOD;
+}
+
 bool
 Dht::insertNode(const InfoHash& id, const sockaddr *sa, socklen_t salen)
 {
     if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
         return false;
-    now = clock::now();
+    now = getTime();
     auto n = newNode(id, sa, salen, 0);
     return !!n;
 }
@@ -2887,17 +4085,10 @@ Dht::send(const char *buf, size_t len, int flags, const sockaddr *sa, socklen_t
         return -1;
     }
 
-    int s;
-    if (sa->sa_family == AF_INET)
-        s = dht_socket;
-    else if (sa->sa_family == AF_INET6)
-        s = dht_socket6;
-    else
-        s = -1;
-
-    if (s < 0)
+    if (not transport)
         return -1;
-    return sendto(s, buf, len, flags, sa, salen);
+    metrics->bytes_sent.add(len);
+    return transport->send((const uint8_t*)buf, len, flags, sa, salen);
 }
 
 int
@@ -2917,6 +4108,7 @@ Dht::sendPing(const sockaddr *sa, socklen_t salen, TransId tid)
     pk.pack(std::string("v")); pk.pack(my_v);
 
     out_stats.ping++;
+    metrics->sent[(size_t)MessageType::Ping]->add();
 
     return send(buffer.data(), buffer.size(), 0, sa, salen);
 }
@@ -2937,6 +4129,8 @@ Dht::sendPong(const sockaddr *sa, socklen_t salen, TransId tid)
     pk.pack(std::string("y")); pk.pack(std::string("r"));
     pk.pack(std::string("v")); pk.pack(my_v);
 
+    metrics->sent[(size_t)MessageType::Reply]->add();
+
     return send(buffer.data(), buffer.size(), 0, sa, salen);
 }
 
@@ -2965,6 +4159,7 @@ Dht::sendFindNode(const sockaddr *sa, socklen_t salen, TransId tid,
     pk.pack(std::string("v")); pk.pack(my_v);
 
     out_stats.find++;
+    metrics->sent[(size_t)MessageType::FindNode]->add();
 
     return send(buffer.data(), buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
@@ -3027,6 +4222,8 @@ Dht::sendNodesValues(const sockaddr *sa, socklen_t salen, TransId tid,
     pk.pack(std::string("y")); pk.pack(std::string("r"));
     pk.pack(std::string("v")); pk.pack(my_v);
 
+    metrics->sent[(size_t)MessageType::Reply]->add();
+
     return send(buffer.data(), buffer.size(), 0, sa, salen);
 }
 
@@ -3156,6 +4353,7 @@ Dht::sendGetValues(const sockaddr *sa, socklen_t salen,
     pk.pack(std::string("v")); pk.pack(my_v);
 
     out_stats.get++;
+    metrics->sent[(size_t)MessageType::GetValues]->add();
 
     return send(buffer.data(), buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
@@ -3180,6 +4378,7 @@ Dht::sendListen(const sockaddr* sa, socklen_t salen, TransId tid,
     pk.pack(std::string("v")); pk.pack(my_v);
 
     out_stats.listen++;
+    metrics->sent[(size_t)MessageType::Listen]->add();
 
     return send(buffer.data(), buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
@@ -3200,6 +4399,8 @@ Dht::sendListenConfirmation(const sockaddr* sa, socklen_t salen, TransId tid)
     pk.pack(std::string("y")); pk.pack(std::string("r"));
     pk.pack(std::string("v")); pk.pack(my_v);
 
+    metrics->sent[(size_t)MessageType::Reply]->add();
+
     return send(buffer.data(), buffer.size(), 0, sa, salen);
 }
 
@@ -3218,7 +4419,7 @@ Dht::sendAnnounceValue(const sockaddr *sa, socklen_t salen, TransId tid,
       pk.pack(std::string("values")); pk.pack_array(1); pk.pack(value);
       if (created < now) {
           pk.pack(std::string("c"));
-          pk.pack(to_time_t(created));
+          pk.pack(to_time_t(created, now));
       }
       pk.pack(std::string("token"));  pk.pack(token);
 
@@ -3229,6 +4430,7 @@ Dht::sendAnnounceValue(const sockaddr *sa, socklen_t salen, TransId tid,
     pk.pack(std::string("v")); pk.pack(my_v);
 
     out_stats.put++;
+    metrics->sent[(size_t)MessageType::AnnounceValue]->add();
 
     return send(buffer.data(), buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
@@ -3250,6 +4452,8 @@ Dht::sendValueAnnounced(const sockaddr *sa, socklen_t salen, TransId tid, Value:
     pk.pack(std::string("y")); pk.pack(std::string("r"));
     pk.pack(std::string("v")); pk.pack(my_v);
 
+    metrics->sent[(size_t)MessageType::Reply]->add();
+
     return send(buffer.data(), buffer.size(), 0, sa, salen);
 }
 
@@ -3275,6 +4479,9 @@ Dht::sendError(const sockaddr *sa, socklen_t salen, TransId tid, uint16_t code,
     pk.pack(std::string("y")); pk.pack(std::string("e"));
     pk.pack(std::string("v")); pk.pack(my_v);
 
+    metrics->sent[(size_t)MessageType::Error]->add();
+    metrics->error(true, code).add();
+
     return send(buffer.data(), buffer.size(), 0, sa, salen);
 }
 
@@ -3293,7 +4500,7 @@ findMapValue(msgpack::object& map, const std::string& key) {
 }
 
 void
-Dht::ParsedMessage::msgpack_unpack(msgpack::object msg)
+Dht::ParsedMessage::msgpack_unpack(msgpack::object msg, time_point now, const SharedBlob& source)
 {
     auto y = findMapValue(msg, "y");
     auto a = findMapValue(msg, "a");
@@ -3336,7 +4543,7 @@ Dht::ParsedMessage::msgpack_unpack(msgpack::object msg)
         nodes4 = unpackBlob(*rnodes4);
 
     if (auto rcreated = findMapValue(req, "c"))
-        created = from_time_t(rcreated->as<std::time_t>());
+        created = from_time_t(rcreated->as<std::time_t>(), now);
 
     if (auto rnodes6 = findMapValue(req, "n6"))
         nodes6 = unpackBlob(*rnodes6);
@@ -3368,7 +4575,7 @@ Dht::ParsedMessage::msgpack_unpack(msgpack::object msg)
             throw msgpack::type_error();
         for (size_t i = 0; i < rvalues->via.array.size; i++)
             try {
-                values.emplace_back(std::make_shared<Value>(rvalues->via.array.ptr[i]));
+                values.emplace_back(std::make_shared<Value>(rvalues->via.array.ptr[i], source));
             } catch (const std::exception& e) {
                 //DHT_WARN("Error reading value: %s", e.what());
             }
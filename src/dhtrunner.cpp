@@ -32,6 +32,26 @@
 
 namespace dht {
 
+/** Sends through the sockets of a runner, counting sent datagrams */
+class CountingTransport : public UdpTransport {
+public:
+    CountingTransport(int s, int s6, std::atomic<uint64_t>& packets, std::atomic<uint64_t>& bytes)
+     : UdpTransport(s, s6), packets_(packets), bytes_(bytes) {}
+
+    int send(const uint8_t* buf, size_t len, int flags, const sockaddr* to, socklen_t tolen) {
+        int rc = UdpTransport::send(buf, len, flags, to, tolen);
+        if (rc > 0) {
+            packets_++;
+            bytes_ += rc;
+        }
+        return rc;
+    }
+
+private:
+    std::atomic<uint64_t>& packets_;
+    std::atomic<uint64_t>& bytes_;
+};
+
 DhtRunner::DhtRunner()
 {
 #ifdef _WIN32
@@ -90,6 +110,8 @@ DhtRunner::run(const sockaddr_in* local4, const sockaddr_in6* local6, DhtRunner:
             cv.wait_until(lk, wakeup, [this]() {
                 if (not running)
                     return true;
+                if (dht_ and dht_->hasCryptoCompletions())
+                    return true;
                 {
                     std::lock_guard<std::mutex> lck(sock_mtx);
                     if (not rcv.empty())
@@ -126,19 +148,23 @@ DhtRunner::join()
         dht_thread.join();
     if (rcv_thread.joinable())
         rcv_thread.join();
+    stopCapture();
     {
         std::lock_guard<std::mutex> lck(storage_mtx);
         pending_ops = decltype(pending_ops)();
         pending_ops_prio = decltype(pending_ops_prio)();
     }
+    std::unique_ptr<SecureDht> dht;
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
-        dht_.reset();
+        dht = std::move(dht_);
         status4 = Dht::Status::Disconnected;
         status6 = Dht::Status::Disconnected;
         bound4 = {};
         bound6 = {};
     }
+    // Destroyed without dht_mtx: crypto workers may need it to notify.
+    dht.reset();
 }
 
 time_point
@@ -176,9 +202,8 @@ DhtRunner::loop_()
     }
     if (not received.empty()) {
         for (const auto& pck : received) {
-            auto& buf = pck.first;
             auto& from = pck.second;
-            wakeup = dht_->periodic(buf.data(), buf.size()-1, (sockaddr*)&from.first, from.second);
+            wakeup = dht_->periodic(pck.first, (sockaddr*)&from.first, from.second);
         }
         received.clear();
     } else {
@@ -236,7 +261,19 @@ DhtRunner::doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::C
     }
 #endif
 
-    dht_ = std::unique_ptr<SecureDht>(new SecureDht {s4, s6, config});
+    packets_in = 0;
+    bytes_in = 0;
+    packets_out = 0;
+    bytes_out = 0;
+    dht_ = std::unique_ptr<SecureDht>(new SecureDht {
+        std::unique_ptr<Transport>(new CountingTransport(s4, s6, packets_out, bytes_out)), config
+    });
+    // Notify under dht_mtx, so that the wakeup can't be lost between
+    // the evaluation of the wait predicate and the wait.
+    dht_->setOnCryptoCompletion([this]() {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        cv.notify_all();
+    });
 
     rcv_thread = std::thread([this,s4,s6]() {
         try {
@@ -274,9 +311,22 @@ DhtRunner::doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::C
                     else
                         break;
                     if (rc > 0) {
+                        packets_in++;
+                        bytes_in += rc;
+                        {
+                            std::lock_guard<std::mutex> lck(capture_mtx);
+                            if (capture) {
+                                try {
+                                    capture->write(clock::now(), buf, rc, (sockaddr*)&from, fromlen);
+                                } catch (const std::exception& e) {
+                                    std::cerr << "Capture stopped: " << e.what() << std::endl;
+                                    capture.reset();
+                                }
+                            }
+                        }
                         {
                             std::lock_guard<std::mutex> lck(sock_mtx);
-                            rcv.emplace_back(Blob {buf, buf+rc+1}, std::make_pair(from, fromlen));
+                            rcv.emplace_back(SharedBlob {buf, (size_t)rc}, std::make_pair(from, fromlen));
                         }
                         cv.notify_all();
                     }
@@ -418,6 +468,17 @@ DhtRunner::putEncrypted(const std::string& key, InfoHash to, Value&& value, Dht:
     putEncrypted(InfoHash::get(key), to, std::forward<Value>(value), cb);
 }
 
+void
+DhtRunner::putEncrypted(InfoHash hash, const std::vector<InfoHash>& to, Value&& value, Dht::DoneCallback cb)
+{
+    std::lock_guard<std::mutex> lck(storage_mtx);
+    auto sv = std::make_shared<Value>(std::move(value));
+    pending_ops.emplace([=](SecureDht& dht) {
+        dht.putEncrypted(hash, to, sv, cb);
+    });
+    cv.notify_all();
+}
+
 std::vector<std::pair<sockaddr_storage, socklen_t>>
 DhtRunner::getAddrInfo(const char* host, const char* service)
 {
@@ -465,8 +526,17 @@ DhtRunner::bootstrap(const std::vector<NodeExport>& nodes)
 {
     std::lock_guard<std::mutex> lck(storage_mtx);
     pending_ops_prio.emplace([=](SecureDht& dht) {
-        for (auto& node : nodes)
-            dht.insertNode(node);
+        dht.importNodes(nodes);
+    });
+    cv.notify_all();
+}
+
+void
+DhtRunner::importSearches(const Blob& searches)
+{
+    std::lock_guard<std::mutex> lck(storage_mtx);
+    pending_ops_prio.emplace([=](SecureDht& dht) {
+        dht.importSearches(searches);
     });
     cv.notify_all();
 }
@@ -481,6 +551,16 @@ DhtRunner::connectivityChanged()
     cv.notify_all();
 }
 
+void
+DhtRunner::trimStorage(size_t max_size)
+{
+    std::lock_guard<std::mutex> lck(storage_mtx);
+    pending_ops_prio.emplace([=](SecureDht& dht) {
+        dht.trimStorage(max_size);
+    });
+    cv.notify_all();
+}
+
 void
 DhtRunner::findCertificate(InfoHash hash, std::function<void(const std::shared_ptr<crypto::Certificate>)> cb) {
     std::lock_guard<std::mutex> lck(storage_mtx);
@@ -0,0 +1,187 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+namespace dht {
+namespace metrics {
+
+constexpr double Histogram::SUM_SCALE;
+
+Histogram::Histogram(std::vector<double> bounds)
+ : bounds_(std::move(bounds)), counts_(new std::atomic<uint64_t>[bounds_.size() + 1])
+{
+    for (size_t i = 0; i <= bounds_.size(); i++)
+        counts_[i] = 0;
+}
+
+void
+Histogram::observe(double v)
+{
+    auto b = std::lower_bound(bounds_.begin(), bounds_.end(), v) - bounds_.begin();
+    counts_[b].fetch_add(1, std::memory_order_relaxed);
+    if (v > 0)
+        sum_.fetch_add(v * SUM_SCALE, std::memory_order_relaxed);
+}
+
+std::vector<uint64_t>
+Histogram::getCounts() const
+{
+    std::vector<uint64_t> ret(bounds_.size() + 1);
+    for (size_t i = 0; i < ret.size(); i++)
+        ret[i] = counts_[i].load(std::memory_order_relaxed);
+    return ret;
+}
+
+double
+Histogram::getSum() const
+{
+    return sum_.load(std::memory_order_relaxed) / SUM_SCALE;
+}
+
+Registry::Series&
+Registry::getSeries(const std::string& name, const std::string& help, const std::string& type, const Labels& labels)
+{
+    auto& family = families_[name];
+    if (family.type.empty()) {
+        family.help = help;
+        family.type = type;
+    } else if (family.type != type)
+        throw DhtException("Metric " + name + " registered with another type");
+    for (auto& s : family.series)
+        if (s.labels == labels)
+            return s;
+    family.series.emplace_back();
+    family.series.back().labels = labels;
+    return family.series.back();
+}
+
+Counter&
+Registry::counter(const std::string& name, const std::string& help, const Labels& labels)
+{
+    std::lock_guard<std::mutex> lck(mtx_);
+    auto& s = getSeries(name, help, "counter", labels);
+    if (not s.counter)
+        s.counter.reset(new Counter);
+    return *s.counter;
+}
+
+Gauge&
+Registry::gauge(const std::string& name, const std::string& help, const Labels& labels)
+{
+    std::lock_guard<std::mutex> lck(mtx_);
+    auto& s = getSeries(name, help, "gauge", labels);
+    if (not s.gauge)
+        s.gauge.reset(new Gauge);
+    return *s.gauge;
+}
+
+Histogram&
+Registry::histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds, const Labels& labels)
+{
+    std::lock_guard<std::mutex> lck(mtx_);
+    auto& s = getSeries(name, help, "histogram", labels);
+    if (not s.histogram)
+        s.histogram.reset(new Histogram(bounds));
+    return *s.histogram;
+}
+
+static std::string
+formatNumber(double v)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.9g", v);
+    return buf;
+}
+
+static void
+writeLabels(std::ostream& out, const Labels& labels, const std::string& le = {})
+{
+    if (labels.empty() and le.empty())
+        return;
+    out << '{';
+    bool first = true;
+    auto write = [&](const std::string& name, const std::string& value) {
+        if (not first)
+            out << ',';
+        first = false;
+        out << name << "=\"";
+        for (char c : value) {
+            if (c == '\\' or c == '"')
+                out << '\\' << c;
+            else if (c == '\n')
+                out << "\\n";
+            else
+                out << c;
+        }
+        out << '"';
+    };
+    for (const auto& l : labels)
+        write(l.first, l.second);
+    if (not le.empty())
+        write("le", le);
+    out << '}';
+}
+
+std::string
+Registry::toPrometheus() const
+{
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lck(mtx_);
+    for (const auto& f : families_) {
+        const auto& name = f.first;
+        out << "# HELP " << name << ' ' << f.second.help << '\n';
+        out << "# TYPE " << name << ' ' << f.second.type << '\n';
+        for (const auto& s : f.second.series) {
+            if (s.counter) {
+                out << name;
+                writeLabels(out, s.labels);
+                out << ' ' << s.counter->get() << '\n';
+            } else if (s.gauge) {
+                out << name;
+                writeLabels(out, s.labels);
+                out << ' ' << s.gauge->get() << '\n';
+            } else if (s.histogram) {
+                const auto& bounds = s.histogram->getBounds();
+                auto counts = s.histogram->getCounts();
+                uint64_t total = 0;
+                for (size_t i = 0; i < counts.size(); i++) {
+                    total += counts[i];
+                    out << name << "_bucket";
+                    writeLabels(out, s.labels, i < bounds.size() ? formatNumber(bounds[i]) : "+Inf");
+                    out << ' ' << total << '\n';
+                }
+                out << name << "_sum";
+                writeLabels(out, s.labels);
+                out << ' ' << formatNumber(s.histogram->getSum()) << '\n';
+                out << name << "_count";
+                writeLabels(out, s.labels);
+                out << ' ' << total << '\n';
+            }
+        }
+    }
+    return out.str();
+}
+
+}
+}
@@ -0,0 +1,135 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#include "searchtrace.h"
+
+#include <cstdio>
+#include <sstream>
+
+namespace dht {
+
+constexpr size_t SearchTrace::MAX_EVENTS;
+
+static const char*
+toString(SearchTrace::EventType t)
+{
+    switch (t) {
+    case SearchTrace::EventType::Start:   return "start";
+    case SearchTrace::EventType::Request: return "request";
+    case SearchTrace::EventType::Reply:   return "reply";
+    case SearchTrace::EventType::Timeout: return "timeout";
+    case SearchTrace::EventType::Done:    return "done";
+    case SearchTrace::EventType::Failed:  return "failed";
+    }
+    return "";
+}
+
+static const char*
+toString(SearchTrace::Request r)
+{
+    switch (r) {
+    case SearchTrace::Request::None:   return "";
+    case SearchTrace::Request::Get:    return "get";
+    case SearchTrace::Request::Put:    return "put";
+    case SearchTrace::Request::Listen: return "listen";
+    }
+    return "";
+}
+
+void
+SearchTrace::add(Event&& e)
+{
+    if (events.size() >= MAX_EVENTS) {
+        dropped++;
+        return;
+    }
+    events.emplace_back(std::move(e));
+}
+
+void
+SearchTrace::operationStarted(Request r, time_point now)
+{
+    add({now - start, EventType::Start, r});
+}
+
+void
+SearchTrace::operationDone(Request r, bool ok, time_point now)
+{
+    add({now - start, ok ? EventType::Done : EventType::Failed, r});
+}
+
+void
+SearchTrace::requestSent(Request r, const InfoHash& node, std::string addr, time_point now)
+{
+    // A request sent again before its timeout replaces the pending one.
+    pending_[{node, r}] = now;
+    add({now - start, EventType::Request, r, node, std::move(addr)});
+}
+
+void
+SearchTrace::replyReceived(Request r, const InfoHash& node, std::string addr, time_point now,
+        std::vector<InfoHash>&& learned, unsigned values)
+{
+    pending_.erase({node, r});
+    add({now - start, EventType::Reply, r, node, std::move(addr), std::move(learned), values});
+}
+
+void
+SearchTrace::checkTimeouts(time_point now, duration timeout)
+{
+    for (auto p = pending_.begin(); p != pending_.end();) {
+        if (p->second + timeout < now) {
+            add({p->second + timeout - start, EventType::Timeout, p->first.second, p->first.first});
+            p = pending_.erase(p);
+        } else
+            ++p;
+    }
+}
+
+std::string
+SearchTrace::toJson() const
+{
+    std::ostringstream out;
+    auto sid = id.toString();
+    char t[32];
+    for (const auto& e : events) {
+        std::snprintf(t, sizeof(t), "%.6f", std::chrono::duration<double>(e.time).count());
+        out << "{\"search\":\"" << sid << "\",\"af\":" << (af == AF_INET ? 4 : 6)
+            << ",\"t\":" << t << ",\"event\":\"" << toString(e.type) << '"';
+        if (e.request != Request::None)
+            out << ",\"request\":\"" << toString(e.request) << '"';
+        if (e.node != InfoHash())
+            out << ",\"node\":\"" << e.node << '"';
+        if (not e.addr.empty())
+            out << ",\"addr\":\"" << e.addr << '"';
+        if (e.type == EventType::Reply) {
+            out << ",\"values\":" << e.values << ",\"learned\":[";
+            for (size_t i = 0; i < e.learned.size(); i++)
+                out << (i ? ",\"" : "\"") << e.learned[i] << '"';
+            out << ']';
+        }
+        out << "}\n";
+    }
+    if (dropped)
+        out << "{\"search\":\"" << sid << "\",\"af\":" << (af == AF_INET ? 4 : 6)
+            << ",\"event\":\"dropped\",\"count\":" << dropped << "}\n";
+    return out.str();
+}
+
+}
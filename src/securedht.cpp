@@ -28,10 +28,28 @@ extern "C" {
 #include <gnutls/x509.h>
 }
 
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
 #include <random>
+#include <thread>
 
 namespace dht {
 
+/**
+ * Recipient of a value encrypted for several recipients.
+ */
+static InfoHash
+recipientsHash(const std::vector<InfoHash>& recipients)
+{
+    Blob ids;
+    ids.reserve(recipients.size() * HASH_LEN);
+    for (const auto& r : recipients)
+        ids.insert(ids.end(), r.begin(), r.end());
+    return InfoHash::get(ids);
+}
+
 Dht::Config& getConfig(SecureDht::Config& conf)
 {
     auto& c = conf.node_config;
@@ -44,12 +62,146 @@ Dht::Config& getConfig(SecureDht::Config& conf)
     return c;
 }
 
+/* Sequence number log record: key, value id (64 bits), sequence number (16 bits). */
+static constexpr size_t SEQ_RECORD_SIZE {HASH_LEN + 8 + 2};
+
+static void
+writeSeqRecord(std::ostream& f, const InfoHash& h, Value::Id id, uint16_t seq)
+{
+    std::array<uint8_t, SEQ_RECORD_SIZE> rec;
+    std::copy(h.begin(), h.end(), rec.begin());
+    writeBE(rec.data() + HASH_LEN, id, 8);
+    writeBE(rec.data() + HASH_LEN + 8, seq, 2);
+    f.write((const char*)rec.data(), rec.size());
+}
+
+/**
+ * Writes published sequence numbers to the log from its own thread,
+ * appending the records queued meanwhile at once,
+ * and compacting the log when it grows too much.
+ */
+class SecureDht::SeqLog {
+public:
+    using Seqs = std::map<std::pair<InfoHash, Value::Id>, uint16_t>;
+
+    SeqLog(const std::string& path, Seqs seqs, size_t records)
+     : path_(path), seqs_(std::move(seqs)), records_(records), writer_(&SeqLog::work, this) {}
+
+    ~SeqLog() {
+        {
+            std::lock_guard<std::mutex> lck(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        // Queued records are written first.
+        writer_.join();
+    }
+
+    /**
+     * Queue the record to be written.
+     * Returns the error of a previous write, if any.
+     */
+    std::string record(const InfoHash& hash, Value::Id id, uint16_t seq) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        pending_.emplace_back(std::make_pair(hash, id), seq);
+        cv_.notify_all();
+        auto error = std::move(error_);
+        error_.clear();
+        return error;
+    }
+
+private:
+    SeqLog(const SeqLog&) = delete;
+    SeqLog& operator=(const SeqLog&) = delete;
+
+    void work() {
+        std::unique_lock<std::mutex> lck(mtx_);
+        while (true) {
+            cv_.wait(lck, [this]() { return stop_ or not pending_.empty(); });
+            if (pending_.empty())
+                return;
+            auto batch = std::move(pending_);
+            pending_.clear();
+            lck.unlock();
+            std::string error;
+            try {
+                write(batch);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            lck.lock();
+            if (not error.empty())
+                error_ = error;
+        }
+    }
+
+    /* Called by the writer thread, without the lock */
+    void write(const std::vector<Seqs::value_type>& batch) {
+        for (const auto& r : batch)
+            seqs_[r.first] = r.second;
+        if (records_ + batch.size() > 2 * seqs_.size() + MIN_COMPACT_RECORDS) {
+            const auto tmp_path = path_ + ".tmp";
+            bool ok;
+            {
+                std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+                for (const auto& ps : seqs_)
+                    writeSeqRecord(f, ps.first.first, ps.first.second, ps.second);
+                ok = (bool)f.flush();
+            }
+            if (ok and std::rename(tmp_path.c_str(), path_.c_str()) == 0) {
+                records_ = seqs_.size();
+                return;
+            }
+            std::remove(tmp_path.c_str());
+        }
+        std::ofstream f(path_, std::ios::binary | std::ios::app);
+        for (const auto& r : batch)
+            writeSeqRecord(f, r.first.first, r.first.second, r.second);
+        if (not f.flush())
+            throw DhtException("Can't write sequence numbers to " + path_);
+        records_ += batch.size();
+    }
+
+    /** The log is compacted when it holds more than this many replaced records */
+    static constexpr size_t MIN_COMPACT_RECORDS {64};
+
+    const std::string path_;
+    /** Modified by the writer thread only */
+    Seqs seqs_;
+    size_t records_;
+
+    std::mutex mtx_ {};
+    std::condition_variable cv_ {};
+    std::vector<Seqs::value_type> pending_ {};
+    std::string error_ {};
+    bool stop_ {false};
+    std::thread writer_;
+};
+
+constexpr size_t SecureDht::SeqLog::MIN_COMPACT_RECORDS;
+
+SecureDht::SecureDht() {}
+
 SecureDht::SecureDht(int s, int s6, SecureDht::Config conf)
-: Dht(s, s6, getConfig(conf)), key_(conf.id.first), certificate_(conf.id.second)
+: SecureDht(std::unique_ptr<Transport>(new UdpTransport(s, s6)), conf)
+{}
+
+SecureDht::SecureDht(std::unique_ptr<Transport>&& transport, SecureDht::Config conf)
+: Dht(std::move(transport), getConfig(conf)), key_(conf.id.first), certificate_(conf.id.second),
+  publicKey_(key_ ? key_->getPublicKey() : crypto::PublicKey {})
 {
-    if (s < 0 && s6 < 0)
+    if (not isRunning())
         return;
 
+    if (conf.crypto_threads)
+        cryptoPool_.reset(new ThreadPool(conf.crypto_threads));
+
+    if (not conf.certificate_store_path.empty())
+        certStore_.reset(new CertificateStore(conf.certificate_store_path));
+
+    if (not conf.seq_store_path.empty())
+        loadPublishedSeqs(conf.seq_store_path);
+
 #if GNUTLS_VERSION_NUMBER < 0x030300
     int rc = gnutls_global_init();
     if (rc != GNUTLS_E_SUCCESS)
@@ -66,7 +218,7 @@ SecureDht::SecureDht(int s, int s6, SecureDht::Config conf)
 
     if (certificate_) {
         auto certId = certificate_->getPublicKey().getId();
-        if (key_ and certId != key_->getPublicKey().getId())
+        if (key_ and certId != getId())
             throw DhtException("SecureDht: provided certificate doesn't match private key.");
 
         Dht::put(certId, Value {
@@ -84,6 +236,12 @@ SecureDht::SecureDht(int s, int s6, SecureDht::Config conf)
 
 SecureDht::~SecureDht()
 {
+    // Pending operations are run and their callbacks called with a failure.
+    if (cryptoPool_) {
+        stopping_ = true;
+        cryptoPool_->stop();
+        cryptoPool_->runCompletions();
+    }
 #if GNUTLS_VERSION_NUMBER < 0x030300
     gnutls_global_deinit();
 #endif
@@ -129,16 +287,37 @@ SecureDht::secureType(ValueType&& type)
     return type;
 }
 
+constexpr unsigned SecureDht::MAX_CERTIFICATES;
+constexpr std::chrono::minutes SecureDht::CERTIFICATE_NOT_FOUND_TTL;
+
 const std::shared_ptr<crypto::Certificate>
 SecureDht::getCertificate(const InfoHash& node) const
 {
     if (node == getId())
         return certificate_;
-    auto it = nodesCertificates_.find(node);
-    if (it == nodesCertificates_.end())
+    auto it = nodesCertificatesIndex_.find(node);
+    if (it == nodesCertificatesIndex_.end())
         return nullptr;
     else
-        return it->second;
+        return it->second->second;
+}
+
+void
+SecureDht::cacheCertificate(const InfoHash& node, const std::shared_ptr<crypto::Certificate>& cert)
+{
+    missingCertificates_.erase(node);
+    auto it = nodesCertificatesIndex_.find(node);
+    if (it != nodesCertificatesIndex_.end()) {
+        it->second->second = cert;
+        nodesCertificates_.splice(nodesCertificates_.begin(), nodesCertificates_, it->second);
+        return;
+    }
+    nodesCertificates_.emplace_front(node, cert);
+    nodesCertificatesIndex_.emplace(node, nodesCertificates_.begin());
+    while (nodesCertificates_.size() > MAX_CERTIFICATES) {
+        nodesCertificatesIndex_.erase(nodesCertificates_.back().first);
+        nodesCertificates_.pop_back();
+    }
 }
 
 const std::shared_ptr<crypto::Certificate>
@@ -153,12 +332,9 @@ SecureDht::registerCertificate(const InfoHash& node, const Blob& data)
     InfoHash h = crt->getPublicKey().getId();
     if (node == h) {
         DHT_DEBUG("Registering public key for %s", h.toString().c_str());
-        auto it = nodesCertificates_.find(h);
-        if (it == nodesCertificates_.end())
-            std::tie(it, std::ignore) = nodesCertificates_.emplace(h, std::move(crt));
-        else
-            it->second = std::move(crt);
-        return it->second;
+        cacheCertificate(h, crt);
+        persistCertificate(*crt);
+        return crt;
     } else {
         DHT_DEBUG("Certificate %s for node %s does not match node id !", h.toString().c_str(), node.toString().c_str());
         return nullptr;
@@ -168,90 +344,207 @@ SecureDht::registerCertificate(const InfoHash& node, const Blob& data)
 void
 SecureDht::registerCertificate(std::shared_ptr<crypto::Certificate>& cert)
 {
-    if (cert)
-        nodesCertificates_[cert->getId()] = cert;
+    if (cert) {
+        cacheCertificate(cert->getId(), cert);
+        persistCertificate(*cert);
+    }
 }
 
 void
-SecureDht::findCertificate(const InfoHash& node, std::function<void(const std::shared_ptr<crypto::Certificate>)> cb)
+SecureDht::persistCertificate(const crypto::Certificate& cert)
 {
-    std::shared_ptr<crypto::Certificate> b = getCertificate(node);
-    if (b && *b) {
+    if (not certStore_)
+        return;
+    try {
+        certStore_->store(cert);
+    } catch (const std::exception& e) {
+        DHT_WARN("Can't store certificate: %s", e.what());
+    }
+}
+
+void
+SecureDht::onCertificateFound(const InfoHash& node, const std::shared_ptr<crypto::Certificate>& cert)
+{
+    auto q = pendingCertificateQueries_.find(node);
+    if (q == pendingCertificateQueries_.end())
+        return;
+    auto cbs = std::move(q->second);
+    pendingCertificateQueries_.erase(q);
+    for (const auto& cb : cbs)
+        if (cb)
+            cb(cert);
+}
+
+void
+SecureDht::findCertificate(const InfoHash& node, CertificateCallback cb)
+{
+    if (node == getId()) {
+        if (cb)
+            cb(certificate_);
+        return;
+    }
+    auto it = nodesCertificatesIndex_.find(node);
+    if (it != nodesCertificatesIndex_.end() and it->second->second and *it->second->second) {
         DHT_DEBUG("Using public key from cache for %s", node.toString().c_str());
+        nodesCertificates_.splice(nodesCertificates_.begin(), nodesCertificates_, it->second);
         if (cb)
-            cb(b);
+            cb(it->second->second);
         return;
     }
+    auto m = missingCertificates_.find(node);
+    if (m != missingCertificates_.end()) {
+        if (m->second > getTime()) {
+            DHT_DEBUG("Public key for %s was recently not found", node.toString().c_str());
+            if (cb)
+                cb(nullptr);
+            return;
+        }
+        missingCertificates_.erase(m);
+    }
     if (localQueryMethod_) {
         auto res = localQueryMethod_(node);
         if (not res.empty()) {
             DHT_DEBUG("Registering public key from local store for %s", node.toString().c_str());
-            nodesCertificates_.emplace(node, res.front());
+            cacheCertificate(node, res.front());
+            if (cb)
+                cb(res.front());
+            return;
+        }
+    }
+    if (certStore_) {
+        auto res = certStore_->query(node);
+        if (not res.empty()) {
+            DHT_DEBUG("Registering public key from certificate store for %s", node.toString().c_str());
+            cacheCertificate(node, res.front());
             if (cb)
                 cb(res.front());
             return;
         }
     }
 
+    // Join a lookup in progress
+    auto q = pendingCertificateQueries_.find(node);
+    if (q != pendingCertificateQueries_.end()) {
+        q->second.emplace_back(cb);
+        return;
+    }
+    pendingCertificateQueries_[node].emplace_back(cb);
+
     auto found = std::make_shared<bool>(false);
-    Dht::get(node, [cb,node,found,this](const std::vector<std::shared_ptr<Value>>& vals) {
+    Dht::get(node, [node,found,this](const std::vector<std::shared_ptr<Value>>& vals) {
         if (*found)
             return false;
         for (const auto& v : vals) {
             if (auto cert = registerCertificate(node, v->data)) {
                 *found = true;
                 DHT_DEBUG("Found public key for %s", node.toString().c_str());
-                if (cb)
-                    cb(cert);
+                onCertificateFound(node, cert);
                 return false;
             }
         }
         return true;
-    }, [cb,found](bool) {
-        if (!*found and cb)
-            cb(nullptr);
+    }, [node,found,this](bool) {
+        if (*found)
+            return;
+        auto now = getTime();
+        if (missingCertificates_.size() >= MAX_CERTIFICATES) {
+            for (auto it = missingCertificates_.begin(); it != missingCertificates_.end();) {
+                if (it->second <= now)
+                    it = missingCertificates_.erase(it);
+                else
+                    ++it;
+            }
+            if (missingCertificates_.size() >= MAX_CERTIFICATES)
+                missingCertificates_.erase(missingCertificates_.begin());
+        }
+        missingCertificates_[node] = now + CERTIFICATE_NOT_FOUND_TTL;
+        onCertificateFound(node, nullptr);
     }, Value::TypeFilter(CERTIFICATE_TYPE));
 }
 
+void
+SecureDht::runCrypto(ThreadPool::Task&& task, ThreadPool::Task&& completion)
+{
+    if (cryptoPool_)
+        cryptoPool_->run(std::move(task), std::move(completion));
+    else {
+        task();
+        completion();
+    }
+}
+
+std::vector<std::shared_ptr<Value>>
+SecureDht::checkValues(const std::vector<std::shared_ptr<Value>>& values)
+{
+    std::vector<std::shared_ptr<Value>> tmpvals {};
+    for (const auto& v : values) {
+        // Decrypt encrypted values
+        if (v->isEncrypted()) {
+            if (not key_)
+                continue;
+            try {
+                // decrypt() checks that we are a recipient
+                tmpvals.push_back(std::make_shared<Value>(decrypt(*v)));
+            } catch (const std::exception& e) {
+                DHT_WARN("Could not decrypt value %s : %s", v->toString().c_str(), e.what());
+            }
+        }
+        // Check signed values
+        else if (v->isSigned()) {
+            if (v->owner.checkSignature(v->getToSign(), v->signature))
+                tmpvals.push_back(v);
+            else
+                DHT_WARN("Signature verification failed for %s", v->toString().c_str());
+        }
+        // Forward normal values
+        else
+            tmpvals.push_back(v);
+    }
+    return tmpvals;
+}
 
 Dht::GetCallback
-SecureDht::getCallbackFilter(GetCallback cb, Value::Filter&& filter)
+SecureDht::getCallbackFilter(GetCallback cb, Value::Filter&& filter, std::shared_ptr<CryptoGetState> state)
 {
+    if (not cryptoPool_ or not state) {
+        return [=](const std::vector<std::shared_ptr<Value>>& values) {
+            auto tmpvals = checkValues(values);
+            if (filter)
+                tmpvals.erase(std::remove_if(tmpvals.begin(), tmpvals.end(), [&](const std::shared_ptr<Value>& v) {
+                    return not filter(*v);
+                }), tmpvals.end());
+            if (cb && not tmpvals.empty())
+                return cb(tmpvals);
+            return true;
+        };
+    }
+
+    // Values are checked by the crypto pool, then filtered and forwarded from the DHT thread.
     return [=](const std::vector<std::shared_ptr<Value>>& values) {
-        std::vector<std::shared_ptr<Value>> tmpvals {};
-        for (const auto& v : values) {
-            // Decrypt encrypted values
-            if (v->isEncrypted()) {
-                if (not key_)
-                    continue;
-                try {
-                    Value decrypted_val (decrypt(*v));
-                    if (decrypted_val.recipient == getId()) {
-                        if (not filter or filter(decrypted_val))
-                            tmpvals.push_back(std::make_shared<Value>(std::move(decrypted_val)));
-                    }
-                    // Ignore values belonging to other people
-                } catch (const std::exception& e) {
-                    DHT_WARN("Could not decrypt value %s : %s", v->toString().c_str(), e.what());
-                }
-            }
-            // Check signed values
-            else if (v->isSigned()) {
-                if (v->owner.checkSignature(v->getToSign(), v->signature)) {
-                    if (not filter  or filter(*v))
-                        tmpvals.push_back(v);
-                }
-                else
-                    DHT_WARN("Signature verification failed for %s", v->toString().c_str());
+        if (state->stop)
+            return false;
+        state->pending++;
+        auto checked = std::make_shared<std::vector<std::shared_ptr<Value>>>();
+        runCrypto([=]() {
+            *checked = checkValues(values);
+        }, [=]() {
+            state->pending--;
+            if (stopping_ or (state->listen_token and not isListening(state->listen_token)))
+                state->stop = true;
+            if (not state->stop) {
+                if (filter)
+                    checked->erase(std::remove_if(checked->begin(), checked->end(), [&](const std::shared_ptr<Value>& v) {
+                        return not filter(*v);
+                    }), checked->end());
+                if (cb and not checked->empty() and not cb(*checked))
+                    state->stop = true;
             }
-            // Forward normal values
-            else {
-                if (not filter or filter(*v))
-                    tmpvals.push_back(v);
+            if (state->pending == 0 and state->done) {
+                auto done = std::move(state->done);
+                state->done = {};
+                done();
             }
-        }
-        if (cb && not tmpvals.empty())
-            return cb(tmpvals);
+        });
         return true;
     };
 }
@@ -259,13 +552,35 @@ SecureDht::getCallbackFilter(GetCallback cb, Value::Filter&& filter)
 void
 SecureDht::get(const InfoHash& id, GetCallback cb, DoneCallback donecb, Value::Filter&& f)
 {
-    Dht::get(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), donecb);
+    if (not cryptoPool_) {
+        Dht::get(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), donecb);
+        return;
+    }
+    // The done callback is delayed until all values have been checked.
+    auto state = std::make_shared<CryptoGetState>();
+    Dht::get(id, getCallbackFilter(cb, std::forward<Value::Filter>(f), state),
+        [state,donecb](bool ok, const std::vector<std::shared_ptr<Node>>& nodes) {
+            if (state->pending == 0) {
+                if (donecb)
+                    donecb(ok, nodes);
+            } else
+                state->done = [=]() {
+                    if (donecb)
+                        donecb(ok, nodes);
+                };
+        });
 }
 
 size_t
 SecureDht::listen(const InfoHash& id, GetCallback cb, Value::Filter&& f)
 {
-    return Dht::listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)));
+    if (not cryptoPool_)
+        return Dht::listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)));
+    // Values checked after the listener was cancelled are dropped.
+    auto state = std::make_shared<CryptoGetState>();
+    auto token = Dht::listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f), state));
+    state->listen_token = token;
+    return token;
 }
 
 void
@@ -276,13 +591,32 @@ SecureDht::putSigned(const InfoHash& hash, std::shared_ptr<Value> val, DoneCallb
         val->id = rand_id(rdev);
     }
 
+    // The value is signed by a crypto worker: use a copy,
+    // since val may already be announced and sent by the DHT thread.
+    // val gets the sequence number, owner and signature once signed.
+    auto v = std::make_shared<Value>(*val);
+
     // Check if we are already announcing a value
-    auto p = getPut(hash, val->id);
-    if (p && val->seq <= p->seq) {
+    auto p = getPut(hash, v->id);
+    if (p && v->seq <= p->seq) {
         DHT_DEBUG("Found previous value being announced.");
-        val->seq = p->seq + 1;
+        v->seq = p->seq + 1;
     }
 
+    // Use the sequence number we last published, if known
+    auto s = publishedSeqs_.find({hash, v->id});
+    if (s == publishedSeqs_.end()) {
+        fetchSeqAndPut(hash, v, val, callback);
+        return;
+    }
+    if (v->seq <= s->second)
+        v->seq = s->second + 1;
+    signAndPut(hash, v, val, callback);
+}
+
+void
+SecureDht::fetchSeqAndPut(const InfoHash& hash, std::shared_ptr<Value> val, std::shared_ptr<Value> orig, DoneCallback callback)
+{
     // Check if data already exists on the dht
     get(hash,
         [val,this] (const std::vector<std::shared_ptr<Value>>& vals) {
@@ -297,14 +631,110 @@ SecureDht::putSigned(const InfoHash& hash, std::shared_ptr<Value> val, DoneCallb
             }
             return true;
         },
-        [hash,val,this,callback] (bool /* ok */) {
-            sign(*val);
-            put(hash, val, callback);
+        [hash,val,orig,this,callback] (bool /* ok */) {
+            signAndPut(hash, val, orig, callback);
         },
         Value::IdFilter(val->id)
     );
 }
 
+bool
+SecureDht::isOutdated(const InfoHash& key, const Value& announced, const Value& found)
+{
+    if (not announced.isSigned() or not found.isSigned() or found.owner != announced.owner)
+        return false;
+    if (found.seq < announced.seq or (found.seq == announced.seq and found.getToSign() == announced.getToSign()))
+        return false;
+    if (not found.owner.checkSignature(found.getToSign(), found.signature))
+        return false;
+    if (found.owner.getId() == getId())
+        outdatedSeqs_[{key, found.id}] = found.seq;
+    return true;
+}
+
+void
+SecureDht::signAndPut(const InfoHash& hash, std::shared_ptr<Value> val, std::shared_ptr<Value> orig, DoneCallback callback, bool retry)
+{
+    auto error = std::make_shared<std::string>();
+    runCrypto([=]() {
+        try {
+            sign(*val);
+        } catch (const std::exception& e) {
+            *error = e.what();
+        }
+    }, [=]() {
+        if (stopping_ or not error->empty()) {
+            if (not error->empty())
+                DHT_ERROR("Error signing data: %s", error->c_str());
+            if (callback)
+                callback(false, {});
+            return;
+        }
+        if (orig) {
+            orig->seq = val->seq;
+            orig->owner = val->owner;
+            orig->signature = val->signature;
+            orig->invalidate();
+        }
+        recordPublishedSeq(hash, val->id, val->seq);
+        put(hash, val, [=](bool ok, const std::vector<std::shared_ptr<Node>>& nodes) {
+            auto o = outdatedSeqs_.find({hash, val->id});
+            if (o == outdatedSeqs_.end()) {
+                if (callback)
+                    callback(ok, nodes);
+                return;
+            }
+            auto seq = o->second;
+            outdatedSeqs_.erase(o);
+            if (ok or not retry) {
+                if (callback)
+                    callback(ok, nodes);
+                return;
+            }
+            // Our sequence number was outdated (value edited from elsewhere):
+            // retry once after the one found online, without looking it up again.
+            DHT_WARN("Signed put failed: sequence number %u is outdated, retrying after %u.", val->seq, seq);
+            auto v = std::make_shared<Value>(*val);
+            v->seq = seq + 1;
+            signAndPut(hash, v, orig, callback, false);
+        });
+    });
+}
+
+void
+SecureDht::loadPublishedSeqs(const std::string& path)
+{
+    std::ifstream f(path, std::ios::binary);
+    std::array<uint8_t, SEQ_RECORD_SIZE> rec;
+    size_t records = 0;
+    while (f.read((char*)rec.data(), rec.size())) {
+        InfoHash h;
+        std::copy_n(rec.begin(), HASH_LEN, h.begin());
+        Value::Id id = readBE(rec.data() + HASH_LEN, 8);
+        uint16_t seq = readBE(rec.data() + HASH_LEN + 8, 2);
+        publishedSeqs_[{h, id}] = seq;
+        records++;
+    }
+    DHT_DEBUG("Loaded %zu sequence numbers", publishedSeqs_.size());
+    seqLog_.reset(new SeqLog(path, publishedSeqs_, records));
+}
+
+void
+SecureDht::recordPublishedSeq(const InfoHash& hash, Value::Id id, uint16_t seq)
+{
+    auto s = publishedSeqs_.emplace(std::make_pair(hash, id), seq);
+    if (not s.second) {
+        if (s.first->second == seq)
+            return;
+        s.first->second = seq;
+    }
+    if (not seqLog_)
+        return;
+    auto error = seqLog_->record(hash, id, seq);
+    if (not error.empty())
+        DHT_WARN("%s", error.c_str());
+}
+
 void
 SecureDht::putEncrypted(const InfoHash& hash, const InfoHash& to, std::shared_ptr<Value> val, DoneCallback callback)
 {
@@ -315,13 +745,74 @@ SecureDht::putEncrypted(const InfoHash& hash, const InfoHash& to, std::shared_pt
             return;
         }
         DHT_WARN("Encrypting data for PK: %s", crt->getPublicKey().getId().toString().c_str());
+        // Encrypted from a copy, val may be in use by the DHT thread.
+        auto v = std::make_shared<Value>(*val);
+        putEncryptedValue(hash, [=]() {
+            return encrypt(*v, *crt);
+        }, callback);
+    });
+}
+
+void
+SecureDht::putEncrypted(const InfoHash& hash, const std::vector<InfoHash>& to, std::shared_ptr<Value> val, DoneCallback callback)
+{
+    if (to.empty()) {
+        if (callback)
+            callback(false, {});
+        return;
+    }
+    struct Recipients {
+        std::vector<std::shared_ptr<crypto::Certificate>> certs;
+        size_t pending;
+        bool ok {true};
+    };
+    auto recipients = std::make_shared<Recipients>();
+    recipients->certs.resize(to.size());
+    recipients->pending = to.size();
+    for (size_t i = 0; i < to.size(); i++) {
+        findCertificate(to[i], [=](const std::shared_ptr<crypto::Certificate> crt) {
+            if (!crt || !*crt) {
+                DHT_WARN("Can't find public key for recipient %s", to[i].toString().c_str());
+                recipients->ok = false;
+            } else
+                recipients->certs[i] = crt;
+            if (--recipients->pending)
+                return;
+            if (not recipients->ok) {
+                if (callback)
+                    callback(false, {});
+                return;
+            }
+            DHT_DEBUG("Encrypting data for %zu recipients", to.size());
+            auto v = std::make_shared<Value>(*val);
+            putEncryptedValue(hash, [=]() {
+                return encrypt(*v, recipients->certs);
+            }, callback);
+        });
+    }
+}
+
+void
+SecureDht::putEncryptedValue(const InfoHash& hash, std::function<Value()>&& encrypt_value, DoneCallback callback)
+{
+    auto encrypted = std::make_shared<std::shared_ptr<Value>>();
+    auto error = std::make_shared<std::string>();
+    auto encrypt_cb = std::make_shared<std::function<Value()>>(std::move(encrypt_value));
+    runCrypto([=]() {
         try {
-            put(hash, encrypt(*val, crt->getPublicKey()), callback);
+            *encrypted = std::make_shared<Value>((*encrypt_cb)());
         } catch (const std::exception& e) {
-            DHT_ERROR("Error putting encrypted data: %s", e.what());
+            *error = e.what();
+        }
+    }, [=]() {
+        if (stopping_ or not error->empty()) {
+            if (not error->empty())
+                DHT_ERROR("Error putting encrypted data: %s", error->c_str());
             if (callback)
                 callback(false, {});
+            return;
         }
+        put(hash, *encrypted, callback);
     });
 }
 
@@ -330,8 +821,15 @@ SecureDht::sign(Value& v) const
 {
     if (v.isEncrypted())
         throw DhtException("Can't sign encrypted data.");
-    v.owner = key_->getPublicKey();
-    v.signature = key_->sign(v.getToSign());
+    v.owner = publicKey_;
+    v.invalidate();
+    auto to_sign = v.getToSign();
+    Blob signature;
+    {
+        std::lock_guard<std::mutex> lck(keyMtx_);
+        signature = key_->sign(to_sign);
+    }
+    v.signature = std::move(signature);
 }
 
 Value
@@ -346,20 +844,65 @@ SecureDht::encrypt(Value& v, const crypto::PublicKey& to) const
     return nv;
 }
 
+Value
+SecureDht::encrypt(Value& v, const crypto::Certificate& to) const
+{
+    auto ec_key = to.getEncryptionKey();
+    if (ec_key.empty())
+        return encrypt(v, to.getPublicKey());
+    if (v.isEncrypted())
+        throw DhtException("Data is already encrypted.");
+    v.setRecipient(to.getId());
+    sign(v);
+    Value nv {v.id};
+    nv.setCypher(crypto::ecEncrypt(v.getToEncrypt(), ec_key));
+    return nv;
+}
+
+Value
+SecureDht::encrypt(Value& v, const std::vector<std::shared_ptr<crypto::Certificate>>& to) const
+{
+    if (v.isEncrypted())
+        throw DhtException("Data is already encrypted.");
+    std::vector<InfoHash> ids;
+    ids.reserve(to.size());
+    for (const auto& crt : to) {
+        if (not crt or not *crt)
+            throw DhtException("Invalid recipient certificate.");
+        ids.emplace_back(crt->getId());
+    }
+    v.setRecipient(recipientsHash(ids));
+    sign(v);
+    Value nv {v.id};
+    nv.setCypher(crypto::multiEncrypt(v.getToEncrypt(), to));
+    return nv;
+}
+
 Value
 SecureDht::decrypt(const Value& v)
 {
     if (not v.isEncrypted())
         throw DhtException("Data is not encrypted.");
 
-    auto decrypted = key_->decrypt(v.cypher);
+    Blob decrypted;
+    {
+        std::lock_guard<std::mutex> lck(keyMtx_);
+        decrypted = key_->decrypt(v.cypher);
+    }
 
+    // The payload of the decrypted value shares the decrypted bytes.
+    SharedBlob body {std::move(decrypted)};
     Value ret {v.id};
-    auto msg = msgpack::unpack((const char*)decrypted.data(), decrypted.size());
-    ret.msgpack_unpack_body(msg.get());
-
-    if (ret.recipient != getId())
-        throw crypto::DecryptError("Recipient mismatch");
+    auto msg = unpackMsgNoCopy(body.data(), body.size());
+    ret.msgpack_unpack_body(msg.get(), body);
+
+    if (ret.recipient != getId()) {
+        // Values encrypted for several recipients are addressed to the recipient list
+        auto recipients = crypto::getRecipients(v.cypher);
+        if (std::find(recipients.begin(), recipients.end(), getId()) == recipients.end()
+         or ret.recipient != recipientsHash(recipients))
+            throw crypto::DecryptError("Recipient mismatch");
+    }
     if (not ret.owner.checkSignature(ret.getToSign(), ret.signature))
         throw crypto::DecryptError("Signature mismatch");
 
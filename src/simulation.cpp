@@ -0,0 +1,284 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#include "simulation.h"
+
+namespace dht {
+
+static constexpr in_port_t SIMULATED_PORT {4222};
+
+class SimulatedNetwork::NodeTransport : public Transport {
+public:
+    NodeTransport(SimulatedNetwork& net, size_t i) : net_(net), i_(i) {}
+
+    int send(const uint8_t* buf, size_t len, int, const sockaddr* to, socklen_t tolen) {
+        return net_.send(i_, buf, len, to, tolen);
+    }
+    bool supports(sa_family_t af) const {
+        return af == 0 or af == AF_INET;
+    }
+
+private:
+    SimulatedNetwork& net_;
+    const size_t i_;
+};
+
+SimulatedNetwork::Traffic&
+SimulatedNetwork::Traffic::operator+=(const Traffic& o)
+{
+    sent_packets += o.sent_packets;
+    sent_bytes += o.sent_bytes;
+    received_packets += o.received_packets;
+    received_bytes += o.received_bytes;
+    dropped_packets += o.dropped_packets;
+    return *this;
+}
+
+SimulatedNetwork::SimulatedNetwork(Config config, unsigned seed) : config_(config), rd_(seed), now_(clock::now()) {}
+
+SimulatedNetwork::~SimulatedNetwork()
+{
+    // Nodes may send messages while being destroyed.
+    for (auto& n : nodes_)
+        n->online = false;
+    nodes_.clear();
+}
+
+size_t
+SimulatedNetwork::addNode()
+{
+    InfoHash id;
+    std::uniform_int_distribution<unsigned> rand_byte {0, 255};
+    std::generate(id.begin(), id.end(), [&]() { return rand_byte(rd_); });
+    return addNode(id);
+}
+
+size_t
+SimulatedNetwork::addNode(const InfoHash& id)
+{
+    size_t i = nodes_.size();
+    if (i >= (1 << 24))
+        throw DhtException("Simulated network is full");
+    std::unique_ptr<SimNode> n {new SimNode};
+    std::fill_n((uint8_t*)&n->addr, sizeof(n->addr), 0);
+    n->addr.sin_family = AF_INET;
+    n->addr.sin_port = htons(SIMULATED_PORT);
+    auto addr = (uint8_t*)&n->addr.sin_addr;
+    addr[0] = 10;
+    addr[1] = i >> 16;
+    addr[2] = i >> 8;
+    addr[3] = i;
+    nodes_.emplace_back(std::move(n));
+    auto& node = *nodes_.back();
+    Dht::Config config {
+        .node_id = id,
+        .is_bootstrap = false,
+        .max_store_size = 0,
+        .max_store_size_per_ip = 0,
+        .storage_path = {},
+        .time_source = [this]() { return now_; },
+        .random_seed = (uint32_t)rd_(),
+        .allow_loopback = false
+    };
+    node.dht.reset(new Dht(std::unique_ptr<Transport>(new NodeTransport(*this, i)), config));
+    // The budget is measured with the real clock: runs would not be reproducible.
+    node.dht->setMaintenanceBudget(duration::zero());
+
+    schedule(i, now_);
+    scheduleChurn(i, now_);
+    return i;
+}
+
+NodeExport
+SimulatedNetwork::exportNode(size_t i) const
+{
+    const auto& n = *nodes_.at(i);
+    NodeExport e;
+    e.id = n.dht->getNodeId();
+    std::fill_n((uint8_t*)&e.ss, sizeof(e.ss), 0);
+    std::copy_n((const uint8_t*)&n.addr, sizeof(n.addr), (uint8_t*)&e.ss);
+    e.sslen = sizeof(n.addr);
+    return e;
+}
+
+void
+SimulatedNetwork::setOnline(size_t i, bool online)
+{
+    auto& n = *nodes_.at(i);
+    if (n.online == online)
+        return;
+    n.online = online;
+    if (online)
+        schedule(i, now_);
+}
+
+SimulatedNetwork::Traffic
+SimulatedNetwork::getTraffic() const
+{
+    Traffic t;
+    for (const auto& n : nodes_)
+        t += n->traffic;
+    return t;
+}
+
+int
+SimulatedNetwork::send(size_t from, const uint8_t* buf, size_t len, const sockaddr* to, socklen_t tolen)
+{
+    if (from >= nodes_.size() or not nodes_[from]->online)
+        return -1;
+    auto& src = *nodes_[from];
+    src.traffic.sent_packets++;
+    src.traffic.sent_bytes += len;
+
+    if (to->sa_family != AF_INET or tolen < sizeof(sockaddr_in))
+        return -1;
+    auto sin = (const sockaddr_in*)to;
+    auto addr = (const uint8_t*)&sin->sin_addr;
+    size_t dst = ((size_t)addr[1] << 16) | ((size_t)addr[2] << 8) | addr[3];
+    if (addr[0] != 10 or ntohs(sin->sin_port) != SIMULATED_PORT or dst >= nodes_.size())
+        return len;
+
+    auto t = std::max(now_, src.link_free);
+    if (config_.bandwidth) {
+        t += std::chrono::duration_cast<duration>(std::chrono::duration<double>((double)len / config_.bandwidth));
+        src.link_free = t;
+    }
+    t += config_.latency;
+    if (config_.jitter > duration::zero())
+        t += uniform_duration_distribution<> {duration::zero(), config_.jitter}(rd_);
+    if (config_.loss > 0 and std::bernoulli_distribution {config_.loss}(rd_)) {
+        nodes_[dst]->traffic.dropped_packets++;
+        return len;
+    }
+    packets_.emplace(t, Packet {from, dst, Blob(buf, buf+len)});
+    return len;
+}
+
+void
+SimulatedNetwork::schedule(size_t i, time_point t)
+{
+    auto& n = *nodes_[i];
+    if (t == n.wakeup)
+        return;
+    n.wakeup = t;
+    if (t != time_point::max())
+        wakeups_.emplace(t, i);
+}
+
+void
+SimulatedNetwork::scheduleChurn(size_t i, time_point now)
+{
+    if (config_.uptime == duration::zero())
+        return;
+    auto& n = *nodes_[i];
+    auto mean = n.online ? config_.uptime : config_.downtime;
+    std::exponential_distribution<double> dis {1. / std::max<duration::rep>(mean.count(), 1)};
+    n.churn_time = now + duration {(duration::rep)dis(rd_)};
+    churn_.emplace(n.churn_time, i);
+}
+
+time_point
+SimulatedNetwork::nextEvent() const
+{
+    auto t = time_point::max();
+    if (not packets_.empty())
+        t = packets_.begin()->first;
+    if (not wakeups_.empty())
+        t = std::min(t, wakeups_.top().first);
+    if (not churn_.empty())
+        t = std::min(t, churn_.top().first);
+    return t;
+}
+
+/* The clock doesn't move while a node runs: a node asking
+   to run again right away runs at the next clock tick. */
+void
+SimulatedNetwork::runNode(size_t i, const uint8_t* buf, size_t len, const sockaddr* from, socklen_t fromlen)
+{
+    auto wakeup = nodes_[i]->dht->periodic(buf, len, from, fromlen);
+    schedule(i, std::max(wakeup, now_ + duration {1}));
+}
+
+/* Events happening at the same time run in a fixed order:
+   churn, then messages, then node wake-ups. */
+void
+SimulatedNetwork::runEvent()
+{
+    if (not churn_.empty() and churn_.top().first <= now_) {
+        auto e = churn_.top();
+        churn_.pop();
+        auto& n = *nodes_[e.second];
+        if (n.churn_time == e.first) {
+            setOnline(e.second, not n.online);
+            scheduleChurn(e.second, now_);
+        }
+        return;
+    }
+
+    if (not packets_.empty() and packets_.begin()->first <= now_) {
+        auto p = std::move(packets_.begin()->second);
+        packets_.erase(packets_.begin());
+        auto& n = *nodes_[p.to];
+        if (not n.online) {
+            n.traffic.dropped_packets++;
+            return;
+        }
+        n.traffic.received_packets++;
+        n.traffic.received_bytes += p.data.size();
+        const auto& from = nodes_[p.from]->addr;
+        runNode(p.to, p.data.data(), p.data.size(), (const sockaddr*)&from, sizeof(from));
+        return;
+    }
+
+    if (not wakeups_.empty() and wakeups_.top().first <= now_) {
+        auto e = wakeups_.top();
+        wakeups_.pop();
+        auto& n = *nodes_[e.second];
+        if (n.wakeup != e.first or not n.online)
+            return;
+        n.wakeup = time_point::min();
+        runNode(e.second, nullptr, 0, nullptr, 0);
+    }
+}
+
+void
+SimulatedNetwork::run(time_point t)
+{
+    run({}, t);
+}
+
+bool
+SimulatedNetwork::run(std::function<bool()> done, time_point t)
+{
+    if (done and done())
+        return true;
+    while (true) {
+        auto next = nextEvent();
+        if (next > t) {
+            now_ = std::max(now_, t);
+            return false;
+        }
+        now_ = std::max(now_, next);
+        runEvent();
+        if (done and done())
+            return true;
+    }
+}
+
+}
@@ -0,0 +1,155 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "threadpool.h"
+
+#include <sstream>
+
+namespace dht {
+
+ThreadPool::ThreadPool(unsigned threads, Task&& notify) : notify_(std::move(notify))
+{
+    threads_.reserve(threads);
+    for (unsigned i = 0; i < threads; i++)
+        threads_.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+void
+ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        running_ = false;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+    threads_.clear();
+}
+
+void
+ThreadPool::run(Task&& task, Task&& completion)
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        if (running_) {
+            jobs_.emplace(Job {std::move(task), std::move(completion), clock::now()});
+            cv_.notify_one();
+            return;
+        }
+    }
+    if (task)
+        task();
+    std::lock_guard<std::mutex> lck(mtx_);
+    if (completion)
+        completions_.emplace(std::move(completion));
+}
+
+void
+ThreadPool::work()
+{
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lck(mtx_);
+            cv_.wait(lck, [this]() { return not running_ or not jobs_.empty(); });
+            // Queued jobs are still run once stopped.
+            if (jobs_.empty())
+                return;
+            job = std::move(jobs_.front());
+            jobs_.pop();
+        }
+        if (job.task)
+            job.task();
+        Task notify;
+        {
+            std::lock_guard<std::mutex> lck(mtx_);
+            auto latency = clock::now() - job.submitted;
+            total_latency_ += latency;
+            max_latency_ = std::max(max_latency_, latency);
+            done_++;
+            if (job.completion)
+                completions_.emplace(std::move(job.completion));
+            notify = notify_;
+        }
+        if (notify)
+            notify();
+    }
+}
+
+size_t
+ThreadPool::runCompletions()
+{
+    decltype(completions_) completions;
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        completions = std::move(completions_);
+        completions_ = {};
+    }
+    size_t n = completions.size();
+    while (not completions.empty()) {
+        completions.front()();
+        completions.pop();
+    }
+    return n;
+}
+
+bool
+ThreadPool::hasCompletions() const
+{
+    std::lock_guard<std::mutex> lck(mtx_);
+    return not completions_.empty();
+}
+
+void
+ThreadPool::setNotify(Task&& notify)
+{
+    std::lock_guard<std::mutex> lck(mtx_);
+    notify_ = std::move(notify);
+}
+
+ThreadPool::Stats
+ThreadPool::getStats() const
+{
+    std::lock_guard<std::mutex> lck(mtx_);
+    Stats stats;
+    stats.queued = jobs_.size();
+    stats.completions = completions_.size();
+    stats.done = done_;
+    stats.avg_latency = done_ ? total_latency_ / static_cast<duration::rep>(done_) : duration {0};
+    stats.max_latency = max_latency_;
+    return stats;
+}
+
+std::string
+ThreadPool::Stats::toString() const
+{
+    using ms = std::chrono::duration<double, std::milli>;
+    std::stringstream ss;
+    ss << "Queued tasks: " << queued << ", pending completions: " << completions
+       << ", done: " << done << std::endl;
+    ss << "Latency: avg " << ms(avg_latency).count() << " ms, max " << ms(max_latency).count() << " ms" << std::endl;
+    return ss.str();
+}
+
+}
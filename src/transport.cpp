@@ -0,0 +1,94 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#include "transport.h"
+#include "utils.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#else
+#include <winsock2.h>
+#endif
+
+namespace dht {
+
+#ifdef _WIN32
+
+static bool
+set_nonblocking(int fd, int nonblocking)
+{
+    unsigned long mode = !!nonblocking;
+    int rc = ioctlsocket(fd, FIONBIO, &mode);
+    return rc == 0;
+}
+
+#else
+
+static bool
+set_nonblocking(int fd, int nonblocking)
+{
+    int rc = fcntl(fd, F_GETFL, 0);
+    if (rc < 0)
+        return false;
+    rc = fcntl(fd, F_SETFL, nonblocking?(rc | O_NONBLOCK):(rc & ~O_NONBLOCK));
+    return !(rc < 0);
+}
+
+#endif
+
+UdpTransport::UdpTransport(int s, int s6) : s_(s), s6_(s6)
+{
+    if (s >= 0 && !set_nonblocking(s, 1))
+        throw DhtException("Can't set socket to non-blocking mode");
+    if (s6 >= 0 && !set_nonblocking(s6, 1))
+        throw DhtException("Can't set socket to non-blocking mode");
+}
+
+int
+UdpTransport::send(const uint8_t* buf, size_t len, int flags, const sockaddr* to, socklen_t tolen)
+{
+    int s;
+    if (to->sa_family == AF_INET)
+        s = s_;
+    else if (to->sa_family == AF_INET6)
+        s = s6_;
+    else
+        s = -1;
+
+    if (s < 0)
+        return -1;
+    return sendto(s, (const char*)buf, len, flags, to, tolen);
+}
+
+bool
+UdpTransport::supports(sa_family_t af) const
+{
+    switch (af) {
+    case 0:
+        return s_ >= 0 || s6_ >= 0;
+    case AF_INET:
+        return s_ >= 0;
+    case AF_INET6:
+        return s6_ >= 0;
+    default:
+        return false;
+    }
+}
+
+}
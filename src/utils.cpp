@@ -21,13 +21,13 @@
 
 namespace dht {
 
-time_point from_time_t(std::time_t t) {
-    return clock::now() + (std::chrono::system_clock::from_time_t(t) - std::chrono::system_clock::now());
+time_point from_time_t(std::time_t t, time_point now) {
+    return now + (std::chrono::system_clock::from_time_t(t) - std::chrono::system_clock::now());
 }
 
-std::time_t to_time_t(time_point t) {
+std::time_t to_time_t(time_point t, time_point now) {
     return std::chrono::system_clock::to_time_t(std::chrono::system_clock::now() + 
-            (t - clock::now()));
+            (t - now));
 }
 
 Blob
@@ -49,9 +49,49 @@ unpackBlob(msgpack::object& o) {
     }
 }
 
+SharedBlob
+unpackSharedBlob(const msgpack::object& o, const SharedBlob& source) {
+    switch (o.type) {
+    case msgpack::type::BIN:
+        return source.share((const uint8_t*)o.via.bin.ptr, o.via.bin.size);
+    case msgpack::type::STR:
+        return source.share((const uint8_t*)o.via.str.ptr, o.via.str.size);
+    default: {
+        auto obj = o;
+        return unpackBlob(obj);
+    }
+    }
+}
+
 msgpack::unpacked
-unpackMsg(Blob b) {
+unpackMsg(const Blob& b) {
     return msgpack::unpack((const char*)b.data(), b.size());
 }
 
+static bool
+referenceData(msgpack::type::object_type, size_t, void*) {
+    return true;
+}
+
+msgpack::unpacked
+unpackMsgNoCopy(const uint8_t* data, size_t size) {
+    return msgpack::unpack((const char*)data, size, referenceData);
+}
+
+void
+writeBE(uint8_t* dst, uint64_t v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = v >> (8 * (n - i - 1));
+}
+
+uint64_t
+readBE(const uint8_t* src, size_t n)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++)
+        v = (v << 8) | src[i];
+    return v;
+}
+
 }
@@ -37,11 +37,11 @@ std::ostream& operator<< (std::ostream& s, const Value& v)
     }
     if (not v.isEncrypted()) {
         if (v.type == IpServiceAnnouncement::TYPE.id) {
-            s << IpServiceAnnouncement(v.data);
+            s << unpackMsg<IpServiceAnnouncement>(v.data);
         } else if (v.type == CERTIFICATE_TYPE.id) {
             s << "Certificate";
             try {
-                InfoHash h = crypto::Certificate(v.data).getPublicKey().getId();
+                InfoHash h = crypto::Certificate(v.data.data(), v.data.size()).getPublicKey().getId();
                 s << " with ID " << h;
             } catch (const std::exception& e) {
                 s << " (invalid)";
@@ -66,6 +66,55 @@ ValueType::DEFAULT_STORE_POLICY(InfoHash, std::shared_ptr<Value>& v, InfoHash, c
     return v->data.size() <= MAX_VALUE_SIZE;
 }
 
+std::shared_ptr<const Blob>
+Value::packToSign() const
+{
+    if (auto cached = std::atomic_load(&toSign_))
+        return cached;
+    auto packed = std::make_shared<Blob>();
+    BlobWriter writer(*packed);
+    msgpack::packer<BlobWriter> pk(&writer);
+    msgpack_pack_to_sign(pk);
+    return packed;
+}
+
+std::shared_ptr<const Blob>
+Value::packToEncrypt() const
+{
+    if (auto cached = std::atomic_load(&toEncrypt_))
+        return cached;
+    auto packed = std::make_shared<Blob>();
+    BlobWriter writer(*packed);
+    msgpack::packer<BlobWriter> pk(&writer);
+    if (isEncrypted()) {
+        pk.pack_bin(cypher.size());
+        pk.pack_bin_body((const char*)cypher.data(), cypher.size());
+    } else {
+        // Same as msgpack_pack_to_encrypt, reusing the memoized signed part.
+        pk.pack_map(isSigned() ? 2 : 1);
+        pk.pack(std::string("body"));
+        auto body = packToSign();
+        pk.pack_bin_body((const char*)body->data(), body->size());
+        if (isSigned()) {
+            pk.pack(std::string("sig")); pk.pack_bin(signature.size());
+                                         pk.pack_bin_body((const char*)signature.data(), signature.size());
+        }
+    }
+    return packed;
+}
+
+Blob
+Value::getToSign() const
+{
+    return *packToSign();
+}
+
+Blob
+Value::getToEncrypt() const
+{
+    return *packToEncrypt();
+}
+
 msgpack::object*
 findMapValue(const msgpack::object& map, const std::string& key) {
     if (map.type != msgpack::type::MAP) throw msgpack::type_error();
@@ -81,7 +130,7 @@ findMapValue(const msgpack::object& map, const std::string& key) {
 }
 
 void
-Value::msgpack_unpack(msgpack::object o)
+Value::msgpack_unpack(msgpack::object o, const SharedBlob& source)
 {
     if (o.type != msgpack::type::MAP) throw msgpack::type_error();
     if (o.via.map.size < 2) throw msgpack::type_error();
@@ -92,24 +141,28 @@ Value::msgpack_unpack(msgpack::object o)
         throw msgpack::type_error();
 
     if (auto rdat = findMapValue(o, "dat")) {
-        msgpack_unpack_body(*rdat);
+        msgpack_unpack_body(*rdat, source);
     } else
         throw msgpack::type_error();
 }
 
+// A payload is sliced from its source only if it makes a good part of it,
+// so that small values don't keep a large packet in memory.
+static constexpr size_t SHARED_PAYLOAD_RATIO {4};
+
 void
-Value::msgpack_unpack_body(const msgpack::object& o)
+Value::msgpack_unpack_body(const msgpack::object& o, const SharedBlob& source)
 {
+    invalidate();
     owner = {};
     recipient = {};
     cypher.clear();
     signature.clear();
-    data.clear();
+    data = {};
     type = 0;
 
     if (o.type == msgpack::type::BIN) {
-        auto dat = o.as<std::vector<char>>();
-        cypher = {dat.begin(), dat.end()};
+        cypher = {(const uint8_t*)o.via.bin.ptr, (const uint8_t*)o.via.bin.ptr + o.via.bin.size};
     } else {
         if (o.type != msgpack::type::MAP)
             throw msgpack::type_error();
@@ -118,7 +171,8 @@ Value::msgpack_unpack_body(const msgpack::object& o)
             throw msgpack::type_error();
 
         if (auto rdata = findMapValue(*rbody, "data")) {
-            data = unpackBlob(*rdata);
+            size_t size = rdata->type == msgpack::type::BIN ? rdata->via.bin.size : 0;
+            data = unpackSharedBlob(*rdata, size * SHARED_PAYLOAD_RATIO >= source.size() ? source : SharedBlob {});
         } else
             throw msgpack::type_error();
 
@@ -0,0 +1,465 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "valuestore.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+namespace dht {
+
+constexpr std::chrono::seconds LogValueStore::SYNC_PERIOD;
+constexpr size_t LogValueStore::MAX_PENDING_SIZE;
+constexpr uint64_t LogValueStore::MIN_COMPACT_SIZE;
+
+// Log record: operation, key, value id (64 bits), creation time (64 bits),
+// data size (32 bits), checksum of the record (32 bits), data.
+static constexpr size_t RECORD_HEADER_SIZE {1 + HASH_LEN + 8 + 8 + 4 + 4};
+static constexpr size_t CHECKSUM_POS {RECORD_HEADER_SIZE - 4};
+// Sanity limit for the data of a record.
+static constexpr uint32_t MAX_RECORD_SIZE {MAX_VALUE_SIZE * 4};
+
+enum : uint8_t {
+    RECORD_STORE = 1,
+    RECORD_REFRESH,
+    RECORD_REMOVE
+};
+
+// FNV-1a
+static uint32_t
+hashBytes(uint32_t h, const uint8_t* p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static constexpr uint32_t HASH_INIT {2166136261u};
+
+static uint32_t
+checksum(const uint8_t* header, const uint8_t* data, size_t data_size)
+{
+    return hashBytes(hashBytes(HASH_INIT, header, CHECKSUM_POS), data, data_size);
+}
+
+static bool
+syncFile(std::FILE* f)
+{
+    if (std::fflush(f) != 0)
+        return false;
+#ifndef _WIN32
+    return fsync(fileno(f)) == 0;
+#else
+    return _commit(_fileno(f)) == 0;
+#endif
+}
+
+static bool
+truncateFile(std::FILE* f, uint64_t size)
+{
+#ifndef _WIN32
+    return ftruncate(fileno(f), size) == 0;
+#else
+    return _chsize_s(_fileno(f), size) == 0;
+#endif
+}
+
+LogValueStore::LogValueStore(const std::string& path, std::function<time_point()> time_source)
+ : path_(path), time_source_(std::move(time_source)), last_sync_(now())
+{
+    recover();
+    writer_ = std::thread(&LogValueStore::work, this);
+}
+
+LogValueStore::~LogValueStore()
+{
+    try {
+        sync(true);
+    } catch (const std::exception&) {}
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+    if (log_)
+        std::fclose(log_);
+}
+
+void
+LogValueStore::openLog()
+{
+    log_ = std::fopen(path_.c_str(), "ab");
+    if (not log_)
+        throw DhtException("Can't open value store " + path_);
+    // Records are batched already, and a failed write must not stay buffered.
+    std::setvbuf(log_, nullptr, _IONBF, 0);
+}
+
+void
+LogValueStore::recover()
+{
+    uint64_t pos = 0;
+    bool torn = false;
+    if (auto f = std::fopen(path_.c_str(), "rb")) {
+        std::array<uint8_t, RECORD_HEADER_SIZE> header;
+        Blob data;
+        size_t n;
+        while ((n = std::fread(header.data(), 1, header.size(), f)) == header.size()) {
+            auto size = readBE(header.data() + CHECKSUM_POS - 4, 4);
+            if (size > MAX_RECORD_SIZE) {
+                torn = true;
+                break;
+            }
+            data.resize(size);
+            if (std::fread(data.data(), 1, size, f) != size
+             or readBE(header.data() + CHECKSUM_POS, 4) != checksum(header.data(), data.data(), size)) {
+                torn = true;
+                break;
+            }
+
+            Key key;
+            std::copy_n(header.begin() + 1, HASH_LEN, key.first.begin());
+            key.second = readBE(header.data() + 1 + HASH_LEN, 8);
+            std::time_t created = (int64_t)readBE(header.data() + 1 + HASH_LEN + 8, 8);
+            auto it = index_.find(key);
+            switch (header[0]) {
+            case RECORD_STORE:
+                if (it != index_.end())
+                    live_size_ -= RECORD_HEADER_SIZE + it->second.size;
+                index_[key] = {pos + RECORD_HEADER_SIZE, (uint32_t)size, created,
+                               hashBytes(HASH_INIT, data.data(), size), -1};
+                live_size_ += RECORD_HEADER_SIZE + size;
+                break;
+            case RECORD_REFRESH:
+                if (it != index_.end())
+                    it->second.created = created;
+                break;
+            case RECORD_REMOVE:
+                if (it != index_.end()) {
+                    live_size_ -= RECORD_HEADER_SIZE + it->second.size;
+                    index_.erase(it);
+                }
+                break;
+            default:
+                break;
+            }
+            pos += RECORD_HEADER_SIZE + size;
+        }
+        // partial header
+        if (not torn and n != 0)
+            torn = true;
+        std::fclose(f);
+    }
+    log_size_ = pos;
+    synced_size_ = pos;
+    openLog();
+    // Drop the torn record, so that new records are not appended after it.
+    if (torn and not truncateFile(log_, pos))
+        throw DhtException("Can't truncate value store " + path_);
+}
+
+static void
+writeRecord(Blob& out, uint8_t op, const InfoHash& key, Value::Id id, std::time_t created, const Blob& data)
+{
+    std::array<uint8_t, RECORD_HEADER_SIZE> header;
+    header[0] = op;
+    std::copy(key.begin(), key.end(), header.begin() + 1);
+    writeBE(header.data() + 1 + HASH_LEN, id, 8);
+    writeBE(header.data() + 1 + HASH_LEN + 8, (int64_t)created, 8);
+    writeBE(header.data() + CHECKSUM_POS - 4, data.size(), 4);
+    writeBE(header.data() + CHECKSUM_POS, checksum(header.data(), data.data(), data.size()), 4);
+    out.insert(out.end(), header.begin(), header.end());
+    out.insert(out.end(), data.begin(), data.end());
+}
+
+void
+LogValueStore::append(uint8_t op, const Key& key, std::time_t created, const Blob& data)
+{
+    writeRecord(pending_, op, key.first, key.second, created, data);
+    log_size_ += RECORD_HEADER_SIZE + data.size();
+}
+
+void
+LogValueStore::store(const InfoHash& key, const Value& value, time_point created)
+{
+    Key k {key, value.id};
+    auto it = index_.find(k);
+    // Values announced again by the network are new objects with the same content.
+    if (it != index_.end() and value.isSigned() and it->second.seq == value.seq) {
+        refresh(key, value.id, created);
+        return;
+    }
+    auto data = packMsg(value);
+    if (data.size() > MAX_RECORD_SIZE)
+        return;
+    auto hash = hashBytes(HASH_INIT, data.data(), data.size());
+    if (it != index_.end() and it->second.hash == hash and it->second.size == data.size()) {
+        it->second.seq = value.isSigned() ? value.seq : -1;
+        refresh(key, value.id, created);
+        return;
+    }
+    auto t = to_time_t(created, now());
+    if (it != index_.end())
+        live_size_ -= RECORD_HEADER_SIZE + it->second.size;
+    index_[k] = {log_size_ + RECORD_HEADER_SIZE, (uint32_t)data.size(), t, hash, value.isSigned() ? value.seq : -1};
+    live_size_ += RECORD_HEADER_SIZE + data.size();
+    append(RECORD_STORE, k, t, data);
+}
+
+void
+LogValueStore::refresh(const InfoHash& key, Value::Id id, time_point created)
+{
+    Key k {key, id};
+    auto it = index_.find(k);
+    if (it == index_.end())
+        return;
+    it->second.created = to_time_t(created, now());
+    append(RECORD_REFRESH, k, it->second.created);
+}
+
+void
+LogValueStore::remove(const InfoHash& key, Value::Id id)
+{
+    Key k {key, id};
+    auto it = index_.find(k);
+    if (it == index_.end())
+        return;
+    live_size_ -= RECORD_HEADER_SIZE + it->second.size;
+    index_.erase(it);
+    append(RECORD_REMOVE, k, 0);
+}
+
+Blob
+LogValueStore::read(std::FILE* f, const Entry& e) const
+{
+    Blob data(e.size);
+    if (std::fseek(f, e.offset, SEEK_SET) != 0
+     or std::fread(data.data(), 1, data.size(), f) != data.size())
+        throw DhtException("Can't read value store " + path_);
+    return data;
+}
+
+void
+LogValueStore::load(LoadCallback cb)
+{
+    sync(true);
+    auto f = std::fopen(path_.c_str(), "rb");
+    if (not f)
+        return;
+    for (const auto& e : index_) {
+        try {
+            auto data = read(f, e.second);
+            auto msg = unpackMsgNoCopy(data.data(), data.size());
+            cb(e.first.first, std::make_shared<Value>(msg.get()), from_time_t(e.second.created, now()));
+        } catch (const std::exception&) {
+            continue;
+        }
+    }
+    std::fclose(f);
+}
+
+time_point
+LogValueStore::sync(bool force)
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    time_point next = time_point::max();
+    if (not pending_.empty()) {
+        auto t = now();
+        if (force or pending_.size() >= MAX_PENDING_SIZE or t >= last_sync_ + SYNC_PERIOD) {
+            last_sync_ = t;
+            Job job;
+            job.records = std::move(pending_);
+            pending_ = {};
+            jobs_.emplace_back(std::move(job));
+            if (not compacting_ and log_size_ > MIN_COMPACT_SIZE and log_size_ > live_size_ * 2) {
+                compacting_ = true;
+                Job compaction;
+                compaction.compact.reset(new Index(index_));
+                compaction.log_size = log_size_;
+                jobs_.emplace_back(std::move(compaction));
+            }
+            cv_.notify_all();
+        } else
+            next = last_sync_ + SYNC_PERIOD;
+    }
+    if (force)
+        done_cv_.wait(lck, [this]() { return (jobs_.empty() and not busy_) or not error_.empty(); });
+    if (compacted_) {
+        applyCompaction(*compacted_);
+        compacted_.reset();
+        compacting_ = false;
+    } else if (compact_failed_) {
+        compact_failed_ = false;
+        compacting_ = false;
+    }
+    if (not error_.empty()) {
+        auto error = std::move(error_);
+        error_.clear();
+        throw DhtException(error);
+    }
+    return next;
+}
+
+void
+LogValueStore::applyCompaction(const Compaction& c)
+{
+    // Records appended after the compaction was requested follow the copied ones.
+    for (auto it = index_.begin(); it != index_.end();) {
+        auto& e = it->second;
+        if (e.offset >= c.old_size)
+            e.offset = e.offset - c.old_size + c.new_size;
+        else {
+            auto m = c.moved.find(e.offset);
+            if (m == c.moved.end()) {
+                // Couldn't be read: the value is lost.
+                live_size_ -= RECORD_HEADER_SIZE + e.size;
+                it = index_.erase(it);
+                continue;
+            }
+            e.offset = m->second;
+        }
+        ++it;
+    }
+    log_size_ = log_size_ - c.old_size + c.new_size;
+}
+
+void
+LogValueStore::work()
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    while (true) {
+        cv_.wait(lck, [this]() { return stop_ or not jobs_.empty(); });
+        if (jobs_.empty())
+            return;
+        auto job = std::move(jobs_.front());
+        jobs_.pop_front();
+        busy_ = true;
+        lck.unlock();
+
+        bool ok = true;
+        std::string error;
+        std::unique_ptr<Compaction> compaction;
+        try {
+            if (job.compact) {
+                compaction.reset(new Compaction(compact(*job.compact)));
+                compaction->old_size = job.log_size;
+            } else if (not writeRecords(job.records)) {
+                ok = false;
+                error = "Can't write value store " + path_;
+            }
+        } catch (const std::exception& e) {
+            ok = false;
+            error = e.what();
+        }
+
+        lck.lock();
+        busy_ = false;
+        if (compaction)
+            compacted_ = std::move(compaction);
+        if (not ok) {
+            error_ = error;
+            if (job.compact)
+                // The log stays as is, compaction will be tried again later.
+                compact_failed_ = true;
+            else if (not stop_) {
+                // Records must be written in order: retry later.
+                jobs_.emplace_front(std::move(job));
+                done_cv_.notify_all();
+                cv_.wait_for(lck, SYNC_PERIOD, [this]() { return stop_; });
+                continue;
+            } else
+                jobs_.clear();
+        }
+        done_cv_.notify_all();
+    }
+}
+
+bool
+LogValueStore::writeRecords(const Blob& records)
+{
+    if (std::fwrite(records.data(), 1, records.size(), log_) == records.size() and syncFile(log_)) {
+        synced_size_ += records.size();
+        return true;
+    }
+    // Remove the partial batch, so that it can be written again.
+    if (not truncateFile(log_, synced_size_))
+        throw DhtException("Can't truncate value store " + path_);
+    return false;
+}
+
+LogValueStore::Compaction
+LogValueStore::compact(const Index& index)
+{
+    auto in = std::fopen(path_.c_str(), "rb");
+    if (not in)
+        throw DhtException("Can't read value store " + path_);
+    auto tmp_path = path_ + ".tmp";
+    auto out = std::fopen(tmp_path.c_str(), "wb");
+    if (not out) {
+        std::fclose(in);
+        throw DhtException("Can't write value store " + tmp_path);
+    }
+
+    // Live records are copied to a new log, which then replaces the old one.
+    Compaction c;
+    uint64_t size = 0;
+    Blob buffer;
+    bool ok = true;
+    for (const auto& e : index) {
+        Blob data;
+        try {
+            data = read(in, e.second);
+        } catch (const std::exception&) {
+            continue;
+        }
+        c.moved[e.second.offset] = size + RECORD_HEADER_SIZE;
+        size += RECORD_HEADER_SIZE + data.size();
+        writeRecord(buffer, RECORD_STORE, e.first.first, e.first.second, e.second.created, data);
+        if (buffer.size() >= MAX_PENDING_SIZE) {
+            ok = ok and std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+            buffer.clear();
+        }
+    }
+    ok = ok and std::fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+    ok = syncFile(out) and ok;
+    std::fclose(out);
+    std::fclose(in);
+    if (not ok) {
+        std::remove(tmp_path.c_str());
+        throw DhtException("Can't write value store " + tmp_path);
+    }
+
+    std::fclose(log_);
+#ifdef _WIN32
+    std::remove(path_.c_str());
+#endif
+    if (std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+        openLog();
+        throw DhtException("Can't compact value store " + path_);
+    }
+    openLog();
+    synced_size_ = size;
+    c.new_size = size;
+    return c;
+}
+
+}
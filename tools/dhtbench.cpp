@@ -0,0 +1,485 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#include <opendht.h>
+extern "C" {
+#include <gnutls/gnutls.h>
+}
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
+using namespace dht;
+
+// RSA key length of node identities, smaller than the default
+// for large clusters to start quickly.
+static constexpr unsigned KEY_LENGTH {2048};
+// All nodes share the loopback address, and so its storage quota.
+static constexpr size_t MAX_STORE_SIZE_PER_IP {1024 * 1024 * 1024};
+static constexpr std::chrono::seconds CONNECT_TIMEOUT {30};
+
+struct bench_params {
+    bool help {false};
+    unsigned nodes {32};
+    in_port_t port {0};
+    unsigned ops {2000};
+    unsigned concurrency {16};
+    unsigned keys {1000};
+    double zipf {0};
+    size_t value_size {256};
+    std::array<unsigned, 3> mix {{30, 60, 10}};
+    unsigned signed_pct {0};
+    unsigned encrypted_pct {0};
+    std::chrono::seconds timeout {10};
+};
+
+static const constexpr struct option long_options[] = {
+   {"help",        no_argument,       nullptr, 'h'},
+   {"nodes",       required_argument, nullptr, 'n'},
+   {"port",        required_argument, nullptr, 'p'},
+   {"ops",         required_argument, nullptr, 'o'},
+   {"concurrency", required_argument, nullptr, 'c'},
+   {"keys",        required_argument, nullptr, 'k'},
+   {"zipf",        required_argument, nullptr, 'z'},
+   {"size",        required_argument, nullptr, 's'},
+   {"mix",         required_argument, nullptr, 'm'},
+   {"signed",      required_argument, nullptr, 'S'},
+   {"encrypted",   required_argument, nullptr, 'E'},
+   {"timeout",     required_argument, nullptr, 't'},
+   {nullptr,       0,                 nullptr,  0}
+};
+
+void print_usage() {
+    std::cout << "Usage: dhtbench [options]" << std::endl << std::endl;
+    std::cout << "dhtbench, a benchmark of a local OpenDHT cluster running in a single process." << std::endl << std::endl
+              << "  -n, --nodes N        Number of nodes (default 32)." << std::endl
+              << "  -p, --port P         Port of the first node on 127.0.0.1, the next ones" << std::endl
+              << "                       using the following ports (default: random ports)." << std::endl
+              << "  -o, --ops N          Number of operations (default 2000)." << std::endl
+              << "  -c, --concurrency N  Operations in progress at once (default 16)." << std::endl
+              << "  -k, --keys N         Number of keys (default 1000)." << std::endl
+              << "  -z, --zipf S         Exponent of the Zipf popularity of keys (default 0: uniform)." << std::endl
+              << "  -s, --size N         Size of put values in bytes (default 256)." << std::endl
+              << "  -m, --mix P:G:L      Weights of put, get and listen operations (default 30:60:10)." << std::endl
+              << "  -S, --signed PCT     Percentage of signed puts (default 0)." << std::endl
+              << "  -E, --encrypted PCT  Percentage of encrypted puts (default 0)." << std::endl
+              << "  -t, --timeout SEC    Operations not done after this time fail (default 10)." << std::endl;
+    std::cout << "Report bugs to: http://opendht.net" << std::endl;
+}
+
+bench_params
+parseArgs(int argc, char **argv) {
+    bench_params params;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hn:p:o:c:k:z:s:m:S:E:t:", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'n':
+            params.nodes = std::max(1, atoi(optarg));
+            break;
+        case 'p': {
+                int port_arg = atoi(optarg);
+                if (port_arg >= 0 && port_arg < 0x10000)
+                    params.port = port_arg;
+                else
+                    std::cout << "Invalid port: " << port_arg << std::endl;
+            }
+            break;
+        case 'o':
+            params.ops = atoi(optarg);
+            break;
+        case 'c':
+            params.concurrency = std::max(1, atoi(optarg));
+            break;
+        case 'k':
+            params.keys = std::max(1, atoi(optarg));
+            break;
+        case 'z':
+            params.zipf = std::max(0., atof(optarg));
+            break;
+        case 's':
+            params.value_size = atoi(optarg);
+            break;
+        case 'm': {
+                std::istringstream ss(optarg);
+                char sep;
+                if (not (ss >> params.mix[0] >> sep >> params.mix[1] >> sep >> params.mix[2])
+                    or params.mix[0] + params.mix[1] + params.mix[2] == 0) {
+                    std::cout << "Invalid mix: " << optarg << std::endl;
+                    params.mix = {{30, 60, 10}};
+                }
+            }
+            break;
+        case 'S':
+            params.signed_pct = std::min(100, atoi(optarg));
+            break;
+        case 'E':
+            params.encrypted_pct = std::min(100, atoi(optarg));
+            break;
+        case 't':
+            params.timeout = std::chrono::seconds(std::max(1, atoi(optarg)));
+            break;
+        case 'h':
+        default:
+            params.help = true;
+            break;
+        }
+    }
+    return params;
+}
+
+/** Key popularity following a Zipf distribution (uniform for s = 0) */
+class KeyDistribution {
+public:
+    KeyDistribution(unsigned n, double s) : cdf_(n) {
+        double sum = 0;
+        for (unsigned i = 0; i < n; i++)
+            cdf_[i] = (sum += 1. / std::pow(i + 1, s));
+        for (auto& c : cdf_)
+            c /= sum;
+    }
+
+    template <class G>
+    unsigned operator()(G& g) {
+        auto p = std::uniform_real_distribution<double>{}(g);
+        return std::min<size_t>(std::lower_bound(cdf_.begin(), cdf_.end(), p) - cdf_.begin(), cdf_.size() - 1);
+    }
+
+private:
+    std::vector<double> cdf_;
+};
+
+enum OpType : unsigned {
+    PUT = 0,
+    GET,
+    LISTEN
+};
+static const std::array<const char*, 3> OP_NAMES {{"put", "get", "listen"}};
+
+struct Operation {
+    OpType type;
+    InfoHash key;
+    DhtRunner* node;
+    time_point start;
+    bool done {false};
+    std::shared_future<size_t> listen_token {};
+};
+
+/** Operations in progress and latencies of the completed ones */
+class Workload {
+public:
+    Workload(unsigned concurrency) : concurrency_(concurrency) {}
+
+    std::shared_ptr<Operation> start(OpType type, const InfoHash& key, DhtRunner& node) {
+        auto op = std::make_shared<Operation>();
+        op->type = type;
+        op->key = key;
+        op->node = &node;
+        op->start = clock::now();
+        std::lock_guard<std::mutex> lck(mtx_);
+        running_.push_back(op);
+        return op;
+    }
+
+    void finish(const std::shared_ptr<Operation>& op, bool ok) {
+        auto t = clock::now();
+        std::shared_future<size_t> listen_token;
+        {
+            std::lock_guard<std::mutex> lck(mtx_);
+            if (op->done)
+                return;
+            op->done = true;
+            listen_token = op->listen_token;
+            running_.remove(op);
+            if (ok)
+                latencies_[op->type].push_back(t - op->start);
+            else
+                failures_[op->type]++;
+            if (ok and op->type == PUT)
+                put_keys_.push_back(op->key);
+        }
+        if (listen_token.valid())
+            op->node->cancelListen(op->key, listen_token);
+        cv_.notify_all();
+    }
+
+    /** Set the token of a listen operation, to cancel it once done */
+    void listening(const std::shared_ptr<Operation>& op, std::shared_future<size_t> token) {
+        bool done;
+        {
+            std::lock_guard<std::mutex> lck(mtx_);
+            op->listen_token = token;
+            done = op->done;
+        }
+        if (done)
+            op->node->cancelListen(op->key, token);
+    }
+
+    /**
+     * Wait for room for a new operation, or for all operations
+     * to be done if all is true, failing operations that timed out.
+     * Returns false if still waiting after a short time.
+     */
+    bool wait(duration timeout, bool all = false) {
+        std::vector<std::shared_ptr<Operation>> expired;
+        {
+            std::unique_lock<std::mutex> lck(mtx_);
+            cv_.wait_for(lck, std::chrono::milliseconds(100), [&]() { return ready(all); });
+            auto now = clock::now();
+            for (const auto& op : running_)
+                if (now > op->start + timeout)
+                    expired.push_back(op);
+        }
+        for (const auto& op : expired)
+            finish(op, false);
+        std::lock_guard<std::mutex> lck(mtx_);
+        return ready(all);
+    }
+
+    /** A key that was successfully put */
+    template <class G>
+    bool putKey(G& g, InfoHash& key) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        if (put_keys_.empty())
+            return false;
+        key = put_keys_[std::uniform_int_distribution<size_t>{0, put_keys_.size() - 1}(g)];
+        return true;
+    }
+
+    void report(double seconds) const {
+        std::lock_guard<std::mutex> lck(mtx_);
+        std::printf("%-8s %8s %8s %10s %10s %10s %10s\n", "op", "done", "failed", "ops/s", "p50 ms", "p99 ms", "p999 ms");
+        for (unsigned t = PUT; t <= LISTEN; t++) {
+            auto lat = latencies_[t];
+            std::sort(lat.begin(), lat.end());
+            auto pct = [&](double q) {
+                if (lat.empty())
+                    return 0.;
+                auto d = lat[std::min<size_t>(lat.size() - 1, q * lat.size())];
+                return std::chrono::duration<double, std::milli>(d).count();
+            };
+            std::printf("%-8s %8zu %8zu %10.1f %10.2f %10.2f %10.2f\n", OP_NAMES[t], lat.size(), failures_[t],
+                lat.size() / seconds, pct(.5), pct(.99), pct(.999));
+        }
+    }
+
+private:
+    bool ready(bool all) const {
+        return all ? running_.empty() : running_.size() < concurrency_;
+    }
+
+    const unsigned concurrency_;
+    mutable std::mutex mtx_ {};
+    std::condition_variable cv_ {};
+    std::list<std::shared_ptr<Operation>> running_ {};
+    std::array<std::vector<duration>, 3> latencies_ {};
+    std::array<size_t, 3> failures_ {{0, 0, 0}};
+    std::vector<InfoHash> put_keys_ {};
+};
+
+static double
+cpuTime()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static DhtRunner::Traffic
+totalTraffic(const std::vector<std::unique_ptr<DhtRunner>>& nodes)
+{
+    DhtRunner::Traffic total {0, 0, 0, 0};
+    for (const auto& n : nodes) {
+        auto t = n->getTraffic();
+        total.packets_in += t.packets_in;
+        total.bytes_in += t.bytes_in;
+        total.packets_out += t.packets_out;
+        total.bytes_out += t.bytes_out;
+    }
+    return total;
+}
+
+int
+main(int argc, char **argv)
+{
+    auto params = parseArgs(argc, argv);
+    if (params.help) {
+        print_usage();
+        return 0;
+    }
+
+    int rc = gnutls_global_init();
+    if (rc != GNUTLS_E_SUCCESS) {
+        std::cerr << "Failed to initialize GnuTLS: " << gnutls_strerror(rc) << std::endl;
+        return 1;
+    }
+
+    std::mt19937_64 rd {std::random_device{}()};
+    std::vector<std::unique_ptr<DhtRunner>> nodes;
+    try {
+        bool crypto = params.signed_pct or params.encrypted_pct;
+        if (crypto)
+            std::cout << "Generating " << params.nodes << " identities..." << std::endl;
+
+        for (unsigned i = 0; i < params.nodes; i++) {
+            sockaddr_in sin;
+            std::fill_n((uint8_t*)&sin, sizeof(sin), 0);
+            sin.sin_family = AF_INET;
+            sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            sin.sin_port = htons(params.port ? params.port + i : 0);
+
+            nodes.emplace_back(new DhtRunner);
+            nodes.back()->run(&sin, nullptr, {
+                .dht_config = {
+                    .node_config = {
+                        .node_id = {},
+                        .is_bootstrap = false,
+                        .max_store_size = 0,
+                        .max_store_size_per_ip = MAX_STORE_SIZE_PER_IP,
+                        .storage_path = {},
+                        .time_source = {},
+                        .random_seed = 0,
+                        .allow_loopback = true
+                    },
+                    .id = crypto ? crypto::generateIdentity("dhtbench", {}, KEY_LENGTH) : crypto::Identity {},
+                    .crypto_threads = 0,
+                    .certificate_store_path = {},
+                    .seq_store_path = {}
+                },
+                .threaded = true
+            });
+            if (i > 0) {
+                const auto& b = nodes.front()->getBound();
+                sockaddr_storage ss;
+                std::copy_n((const uint8_t*)&b.first, b.second, (uint8_t*)&ss);
+                nodes.back()->bootstrap(std::vector<std::pair<sockaddr_storage, socklen_t>> {{ss, b.second}});
+            }
+        }
+
+        // Wait for the routing tables to fill
+        std::cout << "Connecting " << params.nodes << " nodes..." << std::endl;
+        auto connect_end = clock::now() + CONNECT_TIMEOUT;
+        unsigned min_nodes = std::min(params.nodes - 1, 8u);
+        for (const auto& n : nodes) {
+            unsigned good = 0;
+            while (clock::now() < connect_end) {
+                unsigned dubious = 0, cached = 0, incoming = 0;
+                n->getNodesStats(AF_INET, &good, &dubious, &cached, &incoming);
+                if (good >= min_nodes)
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            if (good < min_nodes)
+                std::cout << "Node " << n->getNodeId() << " only knows " << good << " good nodes" << std::endl;
+        }
+
+        std::vector<InfoHash> keys(params.keys);
+        for (unsigned i = 0; i < params.keys; i++)
+            keys[i] = InfoHash::get("dhtbench:" + std::to_string(i));
+        KeyDistribution key_dist {params.keys, params.zipf};
+        std::discrete_distribution<unsigned> op_dist {params.mix.begin(), params.mix.end()};
+        std::uniform_int_distribution<size_t> node_dist {0, nodes.size() - 1};
+        std::uniform_int_distribution<unsigned> pct_dist {0, 99};
+        std::uniform_int_distribution<unsigned> byte_dist {0, 255};
+
+        std::cout << "Running " << params.ops << " operations..." << std::endl;
+        auto workload = std::make_shared<Workload>(params.concurrency);
+        auto traffic = totalTraffic(nodes);
+        auto cpu = cpuTime();
+        auto start = clock::now();
+
+        for (unsigned i = 0; i < params.ops;) {
+            if (not workload->wait(params.timeout))
+                continue;
+            auto type = (OpType)op_dist(rd);
+            auto key = keys[key_dist(rd)];
+            // Listen to keys having values, to measure the time to get them.
+            if (type == LISTEN and not workload->putKey(rd, key))
+                type = PUT;
+            auto& node = *nodes[node_dist(rd)];
+            auto op = workload->start(type, key, node);
+            auto done = [workload,op](bool ok) {
+                workload->finish(op, ok);
+            };
+
+            switch (type) {
+            case PUT: {
+                Blob data(params.value_size);
+                for (auto& b : data)
+                    b = byte_dist(rd);
+                auto pct = pct_dist(rd);
+                if (pct < params.encrypted_pct)
+                    node.putEncrypted(key, nodes[node_dist(rd)]->getId(), Value {std::move(data)}, done);
+                else if (pct < params.encrypted_pct + params.signed_pct)
+                    node.putSigned(key, Value {std::move(data)}, done);
+                else
+                    node.put(key, Value {std::move(data)}, done);
+                break;
+            }
+            case GET:
+                node.get(key, [](const std::vector<std::shared_ptr<Value>>&) {
+                    return true;
+                }, done);
+                break;
+            case LISTEN:
+                workload->listening(op, node.listen(key, [workload,op](const std::vector<std::shared_ptr<Value>>& values) {
+                    if (not values.empty())
+                        workload->finish(op, true);
+                    return true;
+                }).share());
+                break;
+            }
+            i++;
+        }
+        while (not workload->wait(params.timeout, true)) {}
+
+        double seconds = std::chrono::duration<double>(clock::now() - start).count();
+        cpu = cpuTime() - cpu;
+        auto end_traffic = totalTraffic(nodes);
+        auto packets = end_traffic.packets_out - traffic.packets_out;
+        auto bytes = end_traffic.bytes_out - traffic.bytes_out;
+
+        std::cout << std::endl;
+        workload->report(seconds);
+        std::printf("\n%u operations in %.2f s: %.1f ops/s\n", params.ops, seconds, params.ops / seconds);
+        std::printf("Wire: %lu packets, %lu bytes (%.1f packets/op, %.0f bytes/op)\n",
+            (unsigned long)packets, (unsigned long)bytes, (double)packets / params.ops, (double)bytes / params.ops);
+        std::printf("CPU: %.2f s (%.1f us/op, %.0f%% of a core)\n",
+            cpu, cpu * 1e6 / params.ops, 100. * cpu / seconds);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+
+    for (auto& n : nodes)
+        n->join();
+    gnutls_global_deinit();
+    return 0;
+}
@@ -24,11 +24,110 @@ extern "C" {
 }
 
 #include <set>
+#include <fstream>
+#include <thread>
+#include <atomic>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
 
 using namespace dht;
 
+/**
+ * Minimal HTTP server providing the node metrics at /metrics,
+ * in the Prometheus text format. Only listens on the loopback interface.
+ */
+class MetricsServer {
+public:
+    MetricsServer(const DhtRunner& dht, in_port_t port) : dht(dht) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+            throw std::runtime_error("Can't create metrics socket");
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in sin {};
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(port);
+        if (bind(sock, (sockaddr*)&sin, sizeof(sin)) < 0 or listen(sock, 8) < 0) {
+            close(sock);
+            throw std::runtime_error("Can't serve metrics on port " + std::to_string(port));
+        }
+        thread = std::thread([this]{ serve(); });
+    }
+    ~MetricsServer() {
+        running = false;
+        thread.join();
+        close(sock);
+    }
+
+private:
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    void serve() {
+        while (running) {
+            pollfd pfd {sock, POLLIN, 0};
+            if (poll(&pfd, 1, 250) <= 0)
+                continue;
+            int c = accept(sock, nullptr, nullptr);
+            if (c < 0)
+                continue;
+            timeval tv {1, 0};
+            setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            respond(c, readRequest(c));
+            close(c);
+        }
+    }
+
+    static std::string readRequest(int c) {
+        std::string req;
+        char buf[1024];
+        while (req.find("\r\n\r\n") == std::string::npos and req.size() < 8192) {
+            auto n = recv(c, buf, sizeof(buf), 0);
+            if (n <= 0)
+                break;
+            req.append(buf, n);
+        }
+        return req;
+    }
+
+    void respond(int c, const std::string& req) {
+        std::string status, body;
+        auto metrics = dht.getMetrics();
+        if (req.compare(0, 13, "GET /metrics ") == 0 and metrics) {
+            status = "200 OK";
+            body = metrics->toPrometheus();
+        } else {
+            status = "404 Not Found";
+            body = "Not found\n";
+        }
+        std::ostringstream out;
+        out << "HTTP/1.0 " << status << "\r\n"
+            << "Content-Type: text/plain; version=0.0.4\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << "Connection: close\r\n\r\n" << body;
+        auto resp = out.str();
+        for (size_t sent = 0; sent < resp.size();) {
+            auto n = send(c, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+    }
+
+    const DhtRunner& dht;
+    int sock {-1};
+    std::atomic_bool running {true};
+    std::thread thread {};
+};
+
 void print_usage() {
-    std::cout << "Usage: dhtnode [-p local_port] [-b bootstrap_host:port]" << std::endl << std::endl;
+    std::cout << "Usage: dhtnode [-p local_port] [-b bootstrap_host:port] [-m metrics_port]" << std::endl << std::endl;
     std::cout << "dhtnode, a simple OpenDHT command line node runner." << std::endl;
     std::cout << "Report bugs to: http://opendht.net" << std::endl;
 }
@@ -50,13 +149,18 @@ void print_help() {
     std::cout << "Possible commands:" << std::endl
               << "  h, help    Print this help message." << std::endl
               << "  q, quit    Quit the program." << std::endl
-              << "  log        Start/stop printing DHT logs." << std::endl;
+              << "  log        Start/stop printing DHT logs." << std::endl
+              << "  cap [file] Start capturing received packets to [file], or stop capturing." << std::endl;
 
     std::cout << std::endl << "Node information:" << std::endl
               << "  ll         Print basic information and stats about the current node." << std::endl
               << "  ls         Print basic information about current searches." << std::endl
               << "  ld         Print basic information about currenty stored values on this node." << std::endl
-              << "  lr         Print the full current routing table of this node" << std::endl;
+              << "  lr         Print the full current routing table of this node" << std::endl
+              << "  lm         Print the metrics of this node." << std::endl
+              << "  lp         Print the time spent in each phase of the node loop." << std::endl
+              << "  tr         Start/stop tracing searches." << std::endl
+              << "  lt [file]  Print search traces as JSON lines, or write them to [file]." << std::endl;
 
     std::cout << std::endl << "Operations on the DHT:" << std::endl
               << "  b ip:port             Ping potential node at given IP address/port." << std::endl
@@ -100,6 +204,12 @@ main(int argc, char **argv)
             dht.bootstrap(params.bootstrap.first.c_str(), params.bootstrap.second.c_str());
         }
 
+        std::unique_ptr<MetricsServer> metrics_server;
+        if (params.metrics_port) {
+            metrics_server.reset(new MetricsServer(dht, params.metrics_port));
+            std::cout << "Metrics available at http://127.0.0.1:" << params.metrics_port << "/metrics" << std::endl;
+        }
+
         print_node_info(dht, params);
         std::cout << " (type 'h' or 'help' for a list of possible commands)" << std::endl << std::endl;
 
@@ -137,7 +247,40 @@ main(int argc, char **argv)
                 std::cout << "IPv6 routing table:" << std::endl;
                 std::cout << dht.getRoutingTablesLog(AF_INET6) << std::endl;
                 continue;
+            } else if (op == "lp") {
+                auto stats = dht.getPhaseStats();
+                for (size_t i = 0; i < stats.size(); i++) {
+                    const auto& st = stats[i];
+                    std::cout << Dht::getPhaseName((Dht::Phase)i) << ": " << st.calls << " calls, "
+                              << print_dt(st.total) << "s total, "
+                              << print_dt(st.calls ? st.total / (long)st.calls : duration::zero()) << "s avg, "
+                              << print_dt(st.max) << "s max" << std::endl;
+                }
+                continue;
+            } else if (op == "lm") {
+                if (auto metrics = dht.getMetrics())
+                    std::cout << metrics->toPrometheus();
+                continue;
+            } else if (op == "tr") {
+                bool tracing = not dht.isSearchTracing();
+                dht.setSearchTracing(tracing);
+                std::cout << "Search tracing " << (tracing ? "started." : "stopped.") << std::endl;
+                continue;
+            } else if (op == "lt") {
+                std::ofstream file;
+                if (not idstr.empty()) {
+                    file.open(idstr);
+                    if (not file) {
+                        std::cout << "Can't open " << idstr << std::endl;
+                        continue;
+                    }
+                }
+                std::ostream& out = idstr.empty() ? std::cout : file;
+                for (const auto& t : dht.getSearchTraces())
+                    out << t.toJson();
+                continue;
             } else if (op == "ld") {
+                std::cout << dht.getStorageStats().toString();
                 std::cout << dht.getStorageLog() << std::endl;
                 continue;
             } else if (op == "ls") {
@@ -170,6 +313,19 @@ main(int argc, char **argv)
                 else
                     disableLogging(dht);
                 continue;
+            } else if (op == "cap") {
+                try {
+                    if (idstr.empty()) {
+                        dht.stopCapture();
+                        std::cout << "Capture stopped." << std::endl;
+                    } else {
+                        dht.startCapture(idstr);
+                        std::cout << "Capturing received packets to " << idstr << std::endl;
+                    }
+                } catch (const std::exception& e) {
+                    std::cout << e.what() << std::endl;
+                }
+                continue;
             }
 
             if (op.empty())
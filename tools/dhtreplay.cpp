@@ -0,0 +1,220 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#include <opendht.h>
+extern "C" {
+#include <gnutls/gnutls.h>
+}
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+using namespace dht;
+
+struct replay_params {
+    bool help {false};
+    bool paced {false};
+    bool log {false};
+    uint32_t seed {1};
+    std::string path {};
+};
+
+static const constexpr struct option long_options[] = {
+   {"help",    no_argument,       nullptr, 'h'},
+   {"paced",   no_argument,       nullptr, 'p'},
+   {"seed",    required_argument, nullptr, 's'},
+   {"verbose", no_argument,       nullptr, 'v'},
+   {nullptr,   0,                 nullptr,  0}
+};
+
+void print_usage() {
+    std::cout << "Usage: dhtreplay [-p] [-s seed] [-v] capture_file" << std::endl << std::endl;
+    std::cout << "dhtreplay, feeds packets captured by a node (see DhtRunner::startCapture)" << std::endl
+              << "to a new node, and reports the time spent handling them." << std::endl
+              << "Requests are handled as by the captured node, without checking put and listen tokens." << std::endl
+              << "Replies are decoded, but match no request of the new node." << std::endl << std::endl
+              << "  -p, --paced    Replay at the recorded pace instead of as fast as possible." << std::endl
+              << "  -s, --seed N   Seed of the node random number generator (default 1)." << std::endl
+              << "  -v, --verbose  Print DHT logs." << std::endl;
+    std::cout << "Report bugs to: http://opendht.net" << std::endl;
+}
+
+replay_params
+parseArgs(int argc, char **argv) {
+    replay_params params;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hps:v", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'p':
+            params.paced = true;
+            break;
+        case 's':
+            params.seed = std::max(1, atoi(optarg));
+            break;
+        case 'v':
+            params.log = true;
+            break;
+        case 'h':
+        default:
+            params.help = true;
+            break;
+        }
+    }
+    if (optind < argc)
+        params.path = argv[optind];
+    else
+        params.help = true;
+    return params;
+}
+
+/**
+ * Node replaying a capture.
+ *
+ * Only the datagrams received by the captured node are recorded, and the
+ * replay node doesn't know its secrets. So:
+ * - requests (ping, find, get, put, listen) are handled as by the captured
+ *   node: put and listen tokens are not checked, since they were given
+ *   with the secrets of the captured node;
+ * - replies and errors match no request of the replay node: they are decoded
+ *   and their sender is learned, but the searches of the captured node
+ *   are not reproduced;
+ * - the maintenance of the replay node (searches, storage maintenance)
+ *   only sends to the void and gets no replies.
+ */
+class ReplayDht : public Dht {
+public:
+    ReplayDht(std::unique_ptr<Transport>&& transport, Config config)
+     : Dht(std::move(transport), config) {
+        check_tokens = false;
+    }
+};
+
+/** Transport sending nowhere: replies are only built */
+class NullTransport : public Transport {
+public:
+    int send(const uint8_t*, size_t len, int, const sockaddr*, socklen_t) {
+        return len;
+    }
+    bool supports(sa_family_t) const {
+        return true;
+    }
+};
+
+static double
+cpuTime()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+    auto params = parseArgs(argc, argv);
+    if (params.help) {
+        print_usage();
+        return 0;
+    }
+
+    int rc = gnutls_global_init();
+    if (rc != GNUTLS_E_SUCCESS) {
+        std::cerr << "Failed to initialize GnuTLS: " << gnutls_strerror(rc) << std::endl;
+        return 1;
+    }
+
+    try {
+        // Read the whole capture first, so that replay doesn't include I/O.
+        CaptureReader reader {params.path};
+        std::vector<CapturedPacket> packets;
+        size_t bytes = 0;
+        CapturedPacket p;
+        while (reader.next(p)) {
+            bytes += p.data.size();
+            packets.emplace_back(std::move(p));
+        }
+        std::cout << "Replaying " << packets.size() << " packets (" << bytes << " bytes) received by "
+                  << reader.getNodeId() << std::endl;
+
+        // The node runs on the recorded time, so that replays are deterministic.
+        const auto base = clock::now();
+        auto now = base;
+        ReplayDht dht {std::unique_ptr<Transport>(new NullTransport), {reader.getNodeId(), false, 0, 0, {},
+            [&now]{ return now; }, params.seed, true}};
+        // The maintenance budget is measured with the real clock: replays would differ.
+        dht.setMaintenanceBudget(duration::zero());
+        if (params.log)
+            dht.setLoggers(
+                [](char const* m, va_list args) { vfprintf(stderr, m, args); fprintf(stderr, "\n"); },
+                [](char const* m, va_list args) { vfprintf(stderr, m, args); fprintf(stderr, "\n"); },
+                [](char const* m, va_list args) { vfprintf(stderr, m, args); fprintf(stderr, "\n"); });
+
+        duration handling {0}, maintenance {0};
+        auto cpu = cpuTime();
+        auto start = clock::now();
+        auto wakeup = dht.periodic(nullptr, 0, nullptr, 0);
+        for (const auto& pck : packets) {
+            auto t = base + pck.time;
+            // Run the maintenance the node would have done between packets.
+            while (wakeup < t) {
+                now = std::max(wakeup, now + std::chrono::milliseconds(1));
+                auto s = clock::now();
+                wakeup = dht.periodic(nullptr, 0, nullptr, 0);
+                maintenance += clock::now() - s;
+            }
+            if (params.paced)
+                std::this_thread::sleep_until(start + pck.time);
+            now = std::max(t, now);
+            auto s = clock::now();
+            wakeup = dht.periodic(pck.data.data(), pck.data.size(), (const sockaddr*)&pck.from, pck.fromlen);
+            handling += clock::now() - s;
+        }
+        double seconds = std::chrono::duration<double>(clock::now() - start).count();
+        cpu = cpuTime() - cpu;
+
+        auto n = std::max<size_t>(packets.size(), 1);
+        auto in = dht.getNodeMessageStats(true);
+        std::printf("Replayed in %.3f s (%.3f s of capture)\n", seconds,
+            packets.empty() ? 0. : std::chrono::duration<double>(packets.back().time).count());
+        std::printf("Requests: %u ping, %u find, %u get, %u listen, %u put\n", in[0], in[1], in[2], in[3], in[4]);
+        auto& metrics = *dht.getMetrics();
+        auto received = [&](const char* type) {
+            return (unsigned long)metrics.counter("dht_received_messages_total", {}, {{"type", type}}).get();
+        };
+        std::printf("Replies: %lu replies and %lu errors, not matched to requests\n", received("reply"), received("error"));
+        std::printf("Packet handling: %.3f s, %.0f ns/packet, %.0f packets/s\n",
+            std::chrono::duration<double>(handling).count(),
+            (double)std::chrono::duration_cast<std::chrono::nanoseconds>(handling).count() / n,
+            packets.size() / std::max(std::chrono::duration<double>(handling).count(), 1e-9));
+        std::printf("Maintenance: %.3f s\n", std::chrono::duration<double>(maintenance).count());
+        std::printf("CPU: %.3f s\n", cpu);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        gnutls_global_deinit();
+        return 1;
+    }
+
+    gnutls_global_deinit();
+    return 0;
+}
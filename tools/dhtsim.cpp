@@ -0,0 +1,346 @@
+/*
+ *  Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+
+#include <opendht.h>
+#include <opendht/simulation.h>
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+using namespace dht;
+
+// Lookups not done after this simulated time fail.
+static constexpr std::chrono::minutes LOOKUP_TIMEOUT {2};
+
+struct sim_params {
+    bool help {false};
+    unsigned nodes {1000};
+    unsigned keys {100};
+    unsigned lookups {1000};
+    unsigned concurrency {16};
+    size_t value_size {256};
+    std::chrono::milliseconds latency {50};
+    std::chrono::milliseconds jitter {20};
+    double loss {0};
+    size_t bandwidth {0};
+    std::chrono::seconds uptime {0};
+    std::chrono::seconds downtime {600};
+    std::chrono::seconds warmup {600};
+    unsigned seed {0};
+};
+
+static const constexpr struct option long_options[] = {
+   {"help",        no_argument,       nullptr, 'h'},
+   {"nodes",       required_argument, nullptr, 'n'},
+   {"keys",        required_argument, nullptr, 'k'},
+   {"lookups",     required_argument, nullptr, 'l'},
+   {"concurrency", required_argument, nullptr, 'c'},
+   {"size",        required_argument, nullptr, 's'},
+   {"latency",     required_argument, nullptr, 'L'},
+   {"jitter",      required_argument, nullptr, 'j'},
+   {"loss",        required_argument, nullptr, 'x'},
+   {"bandwidth",   required_argument, nullptr, 'b'},
+   {"uptime",      required_argument, nullptr, 'u'},
+   {"downtime",    required_argument, nullptr, 'd'},
+   {"warmup",      required_argument, nullptr, 'w'},
+   {"seed",        required_argument, nullptr, 'r'},
+   {nullptr,       0,                 nullptr,  0}
+};
+
+void print_usage() {
+    std::cout << "Usage: dhtsim [options]" << std::endl << std::endl;
+    std::cout << "dhtsim, lookups on a simulated network of OpenDHT nodes running in a single process." << std::endl
+              << "Times are simulated: the network runs as fast as the CPU allows." << std::endl << std::endl
+              << "  -n, --nodes N        Number of nodes (default 1000)." << std::endl
+              << "  -k, --keys N         Number of keys put before the lookups (default 100)." << std::endl
+              << "  -l, --lookups N      Number of lookups (default 1000)." << std::endl
+              << "  -c, --concurrency N  Lookups in progress at once (default 16)." << std::endl
+              << "  -s, --size N         Size of put values in bytes (default 256)." << std::endl
+              << "  -L, --latency MS     One-way latency of messages (default 50)." << std::endl
+              << "  -j, --jitter MS      Random additional latency (default 20)." << std::endl
+              << "  -x, --loss PCT       Percentage of lost messages (default 0)." << std::endl
+              << "  -b, --bandwidth N    Upload bandwidth of nodes in bytes per second (default 0: unlimited)." << std::endl
+              << "  -u, --uptime SEC     Average time a node stays online (default 0: no churn)." << std::endl
+              << "  -d, --downtime SEC   Average time a node stays offline (default 600)." << std::endl
+              << "  -w, --warmup SEC     Time for the nodes to fill their routing tables (default 600)." << std::endl
+              << "  -r, --seed N         Seed of node IDs and of the network (default 0)." << std::endl;
+    std::cout << "Report bugs to: http://opendht.net" << std::endl;
+}
+
+sim_params
+parseArgs(int argc, char **argv) {
+    sim_params params;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hn:k:l:c:s:L:j:x:b:u:d:w:r:", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'n':
+            params.nodes = std::max(2, atoi(optarg));
+            break;
+        case 'k':
+            params.keys = std::max(1, atoi(optarg));
+            break;
+        case 'l':
+            params.lookups = atoi(optarg);
+            break;
+        case 'c':
+            params.concurrency = std::max(1, atoi(optarg));
+            break;
+        case 's':
+            params.value_size = atoi(optarg);
+            break;
+        case 'L':
+            params.latency = std::chrono::milliseconds(std::max(0, atoi(optarg)));
+            break;
+        case 'j':
+            params.jitter = std::chrono::milliseconds(std::max(0, atoi(optarg)));
+            break;
+        case 'x':
+            params.loss = std::min(100., std::max(0., atof(optarg))) / 100.;
+            break;
+        case 'b':
+            params.bandwidth = std::max(0, atoi(optarg));
+            break;
+        case 'u':
+            params.uptime = std::chrono::seconds(std::max(0, atoi(optarg)));
+            break;
+        case 'd':
+            params.downtime = std::chrono::seconds(std::max(1, atoi(optarg)));
+            break;
+        case 'w':
+            params.warmup = std::chrono::seconds(std::max(0, atoi(optarg)));
+            break;
+        case 'r':
+            params.seed = strtoul(optarg, nullptr, 0);
+            break;
+        case 'h':
+        default:
+            params.help = true;
+            break;
+        }
+    }
+    return params;
+}
+
+static double
+toMs(duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+/** Value of quantile q of sorted values */
+template <typename T>
+static T
+quantile(const std::vector<T>& sorted, double q)
+{
+    if (sorted.empty())
+        return {};
+    return sorted[std::min<size_t>(sorted.size() - 1, q * sorted.size())];
+}
+
+static void
+printLatencies(const char* name, std::vector<duration> lat)
+{
+    std::sort(lat.begin(), lat.end());
+    std::printf("%-14s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, lat.size(),
+        toMs(quantile(lat, .5)), toMs(quantile(lat, .9)), toMs(quantile(lat, .99)), toMs(quantile(lat, 1)));
+}
+
+static void
+printTraffic(const char* name, std::vector<size_t> v)
+{
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (auto n : v)
+        sum += n;
+    std::printf("%-18s %12.1f %10zu %10zu %10zu\n", name, sum / v.size(),
+        quantile(v, .5), quantile(v, .99), quantile(v, 1));
+}
+
+/** Get hops observed by every node, by bucket */
+static std::vector<uint64_t>
+getHops(SimulatedNetwork& net, double& sum)
+{
+    std::vector<uint64_t> counts;
+    sum = 0;
+    for (size_t i = 0; i < net.size(); i++) {
+        auto& h = net.getNode(i).getMetrics()->histogram("dht_get_hops", {}, {});
+        auto c = h.getCounts();
+        counts.resize(c.size());
+        for (size_t b = 0; b < c.size(); b++)
+            counts[b] += c[b];
+        sum += h.getSum();
+    }
+    return counts;
+}
+
+int
+main(int argc, char **argv)
+{
+    auto params = parseArgs(argc, argv);
+    if (params.help) {
+        print_usage();
+        return 0;
+    }
+
+    try {
+        SimulatedNetwork net({
+            std::chrono::duration_cast<duration>(params.latency),
+            std::chrono::duration_cast<duration>(params.jitter),
+            params.loss,
+            params.bandwidth,
+            std::chrono::duration_cast<duration>(params.uptime),
+            std::chrono::duration_cast<duration>(params.downtime)
+        }, params.seed);
+        std::mt19937_64 rd {params.seed};
+
+        std::cout << "Connecting " << params.nodes << " nodes..." << std::endl;
+        auto real_start = clock::now();
+        for (unsigned i = 0; i < params.nodes; i++) {
+            auto n = net.addNode();
+            // Bootstrap from the first node and from a random earlier one.
+            if (n > 0) {
+                net.getNode(n).insertNode(net.exportNode(0));
+                net.getNode(n).insertNode(net.exportNode(std::uniform_int_distribution<size_t>{0, n - 1}(rd)));
+            }
+        }
+        net.run(net.now() + params.warmup);
+
+        auto randomNode = [&]() {
+            std::uniform_int_distribution<size_t> node_dist {0, net.size() - 1};
+            while (true) {
+                auto i = node_dist(rd);
+                if (net.isOnline(i))
+                    return i;
+            }
+        };
+
+        std::cout << "Putting " << params.keys << " values..." << std::endl;
+        std::vector<InfoHash> keys;
+        unsigned put_running = 0;
+        std::uniform_int_distribution<unsigned> byte_dist {0, 255};
+        for (unsigned i = 0; i < params.keys; i++) {
+            auto key = InfoHash::get("dhtsim:" + std::to_string(i));
+            Blob data(params.value_size);
+            for (auto& b : data)
+                b = byte_dist(rd);
+            put_running++;
+            net.getNode(randomNode()).put(key, Value {std::move(data)}, [&,key](bool ok) {
+                put_running--;
+                if (ok)
+                    keys.push_back(key);
+            });
+        }
+        net.run([&]() { return put_running == 0; }, net.now() + LOOKUP_TIMEOUT);
+        if (keys.empty())
+            throw DhtException("No value could be put");
+        if (keys.size() < params.keys)
+            std::cout << params.keys - keys.size() << " puts failed" << std::endl;
+
+        std::cout << "Running " << params.lookups << " lookups..." << std::endl;
+        std::vector<SimulatedNetwork::Traffic> traffic;
+        for (size_t i = 0; i < net.size(); i++)
+            traffic.emplace_back(net.getTraffic(i));
+        double hops_sum;
+        auto hops = getHops(net, hops_sum);
+        std::vector<duration> found_latency, done_latency;
+        unsigned launched = 0, running = 0, finished = 0, failed = 0;
+        std::uniform_int_distribution<size_t> key_dist {0, keys.size() - 1};
+        auto lookup_start = net.now();
+
+        while (finished < params.lookups) {
+            for (; launched < params.lookups and running < params.concurrency; launched++) {
+                auto start = net.now();
+                auto found = std::make_shared<bool>(false);
+                running++;
+                net.getNode(randomNode()).get(keys[key_dist(rd)], [&,start,found](const std::vector<std::shared_ptr<Value>>& values) {
+                    if (not *found and not values.empty()) {
+                        *found = true;
+                        found_latency.push_back(net.now() - start);
+                    }
+                    return true;
+                }, [&,start,found](bool ok) {
+                    running--;
+                    finished++;
+                    if (ok and *found)
+                        done_latency.push_back(net.now() - start);
+                    else
+                        failed++;
+                });
+            }
+            if (not net.run([&]() {
+                return finished == params.lookups or (launched < params.lookups and running < params.concurrency);
+            }, net.now() + LOOKUP_TIMEOUT)) {
+                std::cout << running << " lookups did not complete" << std::endl;
+                failed += running;
+                break;
+            }
+        }
+        auto lookup_time = net.now() - lookup_start;
+
+        std::cout << std::endl;
+        std::printf("%-14s %8s %10s %10s %10s %10s\n", "lookup", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+        printLatencies("first value", std::move(found_latency));
+        printLatencies("done", std::move(done_latency));
+        std::printf("%u lookups failed, %.1f s simulated\n", failed, std::chrono::duration<double>(lookup_time).count());
+
+        double end_hops_sum;
+        auto end_hops = getHops(net, end_hops_sum);
+        uint64_t hops_count = 0;
+        for (size_t b = 0; b < end_hops.size(); b++)
+            hops_count += (end_hops[b] -= hops[b]);
+        auto bounds = net.getNode(0).getMetrics()->histogram("dht_get_hops", {}, {}).getBounds();
+        std::printf("\nHops to the closest node: %.2f on average\n", hops_count ? (end_hops_sum - hops_sum) / hops_count : 0.);
+        for (size_t b = 0; b < end_hops.size(); b++) {
+            if (not end_hops[b])
+                continue;
+            if (b < bounds.size())
+                std::printf("  <= %-4g %6.1f%%\n", bounds[b], 100. * end_hops[b] / hops_count);
+            else
+                std::printf("  >  %-4g %6.1f%%\n", bounds.back(), 100. * end_hops[b] / hops_count);
+        }
+
+        std::vector<size_t> sent_packets, sent_bytes, received_packets, received_bytes;
+        size_t dropped = 0;
+        for (size_t i = 0; i < net.size(); i++) {
+            const auto& t = net.getTraffic(i);
+            sent_packets.push_back(t.sent_packets - traffic[i].sent_packets);
+            sent_bytes.push_back(t.sent_bytes - traffic[i].sent_bytes);
+            received_packets.push_back(t.received_packets - traffic[i].received_packets);
+            received_bytes.push_back(t.received_bytes - traffic[i].received_bytes);
+            dropped += t.dropped_packets - traffic[i].dropped_packets;
+        }
+        std::printf("\n%-18s %12s %10s %10s %10s\n", "traffic per node", "mean", "p50", "p99", "max");
+        printTraffic("sent packets", std::move(sent_packets));
+        printTraffic("sent bytes", std::move(sent_bytes));
+        printTraffic("received packets", std::move(received_packets));
+        printTraffic("received bytes", std::move(received_bytes));
+        std::printf("%zu packets dropped\n", dropped);
+        std::printf("\nSimulated in %.2f s\n", std::chrono::duration<double>(clock::now() - real_start).count());
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
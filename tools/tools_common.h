@@ -131,6 +131,7 @@ struct dht_params {
     bool help {false}; // print help and exit
     bool log {false};
     in_port_t port {0};
+    in_port_t metrics_port {0}; // serve metrics over HTTP if not 0
     bool is_bootstrap_node {false};
     bool generate_identity {false};
     std::pair<std::string, std::string> bootstrap {};
@@ -142,6 +143,7 @@ static const constexpr struct option long_options[] = {
    {"bootstrap",  optional_argument, nullptr, 'b'},
    {"identity",   no_argument      , nullptr, 'i'},
    {"verbose",    no_argument      , nullptr, 'v'},
+   {"metrics",    required_argument, nullptr, 'm'},
    {nullptr,      0,                 nullptr,  0}
 };
 
@@ -149,7 +151,7 @@ dht_params
 parseArgs(int argc, char **argv) {
     dht_params params;
     int opt;
-    while ((opt = getopt_long(argc, argv, ":hivp:b:", long_options, nullptr)) != -1) {
+    while ((opt = getopt_long(argc, argv, ":hivp:b:m:", long_options, nullptr)) != -1) {
         switch (opt) {
         case 'p': {
                 int port_arg = atoi(optarg);
@@ -159,6 +161,14 @@ parseArgs(int argc, char **argv) {
                     std::cout << "Invalid port: " << port_arg << std::endl;
             }
             break;
+        case 'm': {
+                int port_arg = atoi(optarg);
+                if (port_arg > 0 && port_arg < 0x10000)
+                    params.metrics_port = port_arg;
+                else
+                    std::cout << "Invalid metrics port: " << port_arg << std::endl;
+            }
+            break;
         case 'b':
             if (optarg) {
                 params.bootstrap = splitPort((optarg[0] == '=') ? optarg+1 : optarg);